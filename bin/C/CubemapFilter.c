@@ -13,6 +13,7 @@ typedef struct CubemapFilter_t
 typedef struct JobData_t
 {
 	int targetIndex;
+	int readback;
 	Image image;
 	CubemapFilterData param;
 } JobData;
@@ -36,18 +37,32 @@ int FilterJob(JobData *data)
 	return EVAL_OK;
 }		
 		
+int ReadbackJob(JobData *data)
+{
+	if (EndEvaluationImageRead(data->readback, &data->image) == EVAL_OK)
+	{
+		JobData dataFilter = *data;
+		Job(FilterJob, &dataFilter, sizeof(JobData));
+	}
+	else
+	{
+		SetProcessing(data->targetIndex, 0);
+	}
+	return EVAL_OK;
+}
+
 int main(CubemapFilterData *param, Evaluation *evaluation)
 {
-	Image image;
+	JobData data;
 	
-	if (GetEvaluationImage(evaluation->inputIndices[0], &image) == EVAL_OK)
+	data.readback = BeginEvaluationImageRead(evaluation->inputIndices[0]);
+	if (data.readback != -1)
 	{
-		JobData data;
-		data.image = image;
 		data.targetIndex = evaluation->targetIndex;
 		data.param = *param;
 		SetProcessing(evaluation->targetIndex, 1);
-		Job(FilterJob, &data, sizeof(JobData));
+		// the readback completes at the end of the frame, without stalling evaluation
+		JobMain(ReadbackJob, &data, sizeof(JobData));
 	}
 
 	return EVAL_ERR;
@@ -8,6 +8,7 @@ typedef struct ImageWrite_t
 	int quality;
 	int width, height;
 	int mode;
+	EncoderParameters encoder;
 }ImageWrite;
 
 int main(ImageWrite *param, Evaluation *evaluation)
@@ -43,6 +44,9 @@ int main(ImageWrite *param, Evaluation *evaluation)
 	if (!evaluation->forcedDirty)
 		return EVAL_OK;
 	
+	if (param->format == 7)
+		SetEncoderParameters(param->filename, &param->encoder);
+
 	if (Evaluate(evaluation->inputIndices[0], param->width, param->height, &image) == EVAL_OK)
 	{
 		if (WriteImage(param->filename, &image, param->format, param->quality) == EVAL_OK)
@@ -16,6 +16,15 @@ typedef struct Image_t
 	void *mStream;
 } Image;
 
+// video export settings. 0 uses the encoder default
+typedef struct EncoderParameters_t
+{
+	int fps;
+	int bitrate; // kbps
+	int codec; // 0 = H.264, 1 = HEVC, 2 = MPEG-4
+	int preset; // 0 = default, 1 = ultrafast .. 9 = veryslow
+} EncoderParameters;
+
 typedef struct Evaluation_t
 {
 	float inv_view_rot[16];
@@ -23,7 +32,7 @@ typedef struct Evaluation_t
 	int targetIndex;
 	int forcedDirty;
 	int uiPass;
-	int padding;
+	int cubeFace;
 	float mouse[4];
 	int inputIndices[8];	
 	
@@ -82,10 +91,18 @@ enum CubeMapFace
 
 // call FreeImage when done
 int ReadImage(char *filename, Image *image);
-// writes an allocated image
+// writes an allocated image. MP4 frames are encoded asynchronously and the image bits are released by the encoder
 int WriteImage(char *filename, Image *image, int format, int quality);
+// settings used when the MP4 stream for filename is created
+int SetEncoderParameters(char *filename, EncoderParameters *parameters);
 // call FreeImage when done
 int GetEvaluationImage(int target, Image *image);
+// asynchronous version of GetEvaluationImage. Begin returns a readback index or -1.
+// Poll returns EVAL_PENDING until the data is available. End waits if needed and fills the image (call FreeImage when done)
+// Poll and End must be called from main thread (main or JobMain function)
+int BeginEvaluationImageRead(int target);
+int PollEvaluationImageRead(int readback);
+int EndEvaluationImageRead(int readback, Image *image);
 // 
 int SetEvaluationImage(int target, Image *image);
 int SetEvaluationImageCube(int target, Image *image, int cubeFace);
@@ -106,6 +123,10 @@ void SetBlendingMode(int target, int blendSrc, int blendDst);
 int GetEvaluationSize(int target, int *imageWidth, int *imageHeight);
 int SetEvaluationSize(int target, int imageWidth, int imageHeight);
 int SetEvaluationCubeSize(int target, int faceWidth);
+// output format (see ImageFormat) used by the next size change and GLSL evaluation
+// by default, the format declared by the node or the highest precision of its inputs.
+// Formats that can't be rendered to are promoted to the RGBA one with the same precision
+int SetEvaluationFormat(int target, int format);
 int CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase, int glossScale, int glossBias);
 
 int Job(int(*jobFunction)(void*), void *ptr, unsigned int size);
@@ -113,4 +134,5 @@ int JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size);
 void SetProcessing(int target, int processing);
 
 #define EVAL_OK 0
-#define EVAL_ERR 1
\ No newline at end of file
+#define EVAL_ERR 1
+#define EVAL_PENDING 2
\ No newline at end of file
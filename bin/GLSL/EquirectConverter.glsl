@@ -6,7 +6,7 @@ layout (std140) uniform EquirectConverterBlock
 
 vec4 EquirectToCubemap()
 {
-	vec3 dir = (EvaluationParam.viewRot * vec4(vUV * 2.0 - 1.0, 1.0, 0.0)).xyz;
+	vec3 dir = (GetViewRot() * vec4(vUV * 2.0 - 1.0, 1.0, 0.0)).xyz;
 	vec2 uv = envMapEquirect(normalize(dir));
 	vec4 tex = texture(Sampler0, vec2(uv.x, 1.0-uv.y));
 	return tex;
@@ -16,7 +16,7 @@ const int step_count = 16;
 
 vec3 get_world_normal()
 {
-	vec3 dir = (EvaluationParam.viewRot * vec4(vUV * 2.0 - 1.0, 1.0, 0.0)).xyz;
+	vec3 dir = (GetViewRot() * vec4(vUV * 2.0 - 1.0, 1.0, 0.0)).xyz;
 	return normalize(dir);
 }
 
@@ -3,15 +3,35 @@
 
 #define TwoPI (PI*2)
 
+layout (std140) uniform EvaluationBlock
+{
+	mat4 viewRot;
+
+	int targetIndex;
+	int forcedDirty;
+	int	uiPass;
+	int cubeFace; // first face rendered by the draw
+	vec4 mouse; // x,y, lbut down, rbut down
+	int inputIndices[8];
+	
+	vec2 viewport;
+} EvaluationParam;
+
 #ifdef VERTEX_SHADER
 
 layout(location = 0)in vec2 inUV;
 out vec2 vUV;
+flat out int vFace;
 
 void main()
 {
     gl_Position = vec4(inUV.xy*2.0-1.0,0.5,1.0); 
 	vUV = inUV;
+	// cube targets: one instance per face
+	vFace = EvaluationParam.cubeFace + gl_InstanceID;
+#ifdef LAYERED_RENDERING
+	gl_Layer = vFace;
+#endif
 }
 
 #endif
@@ -19,23 +39,24 @@ void main()
 
 #ifdef FRAGMENT_SHADER
 
-layout (std140) uniform EvaluationBlock
-{
-	mat4 viewRot;
-
-	int targetIndex;
-	int forcedDirty;
-	int	uiPass;
-	int padding;
-	vec4 mouse; // x,y, lbut down, rbut down
-	int inputIndices[8];
-	
-	vec2 viewport;
-} EvaluationParam;
-
 
 layout(location=0) out vec4 outPixDiffuse;
 in vec2 vUV;
+flat in int vFace;
+
+// view direction of each cube face, in GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+const mat4 CubeFaceRotations[6] = mat4[6](
+	mat4(0,0,-1,0, 0,1,0,0, 1,0,0,0, 0,0,0,1),
+	mat4(0,0,1,0, 0,1,0,0, -1,0,0,0, 0,0,0,1),
+	mat4(1,0,0,0, 0,0,1,0, 0,-1,0,0, 0,0,0,1),
+	mat4(1,0,0,0, 0,0,-1,0, 0,1,0,0, 0,0,0,1),
+	mat4(1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1),
+	mat4(-1,0,0,0, 0,1,0,0, 0,0,-1,0, 0,0,0,1));
+
+mat4 GetViewRot()
+{
+	return CubeFaceRotations[vFace];
+}
 
 uniform sampler2D Sampler0;
 uniform sampler2D Sampler1;
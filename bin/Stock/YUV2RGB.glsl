@@ -0,0 +1,44 @@
+#ifdef VERTEX_SHADER
+
+layout(location = 0)in vec2 inUV;
+out vec2 vUV;
+void main()
+{ 
+	gl_Position = vec4(inUV.xy*2.0 - 1.0,0.5,1.0);
+	vUV = inUV; 
+}
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+uniform sampler2D samplerY;
+uniform sampler2D samplerU;
+uniform sampler2D samplerV;
+uniform int bt709;
+uniform int fullRange;
+layout(location = 0) out vec4 outPixDiffuse;
+in vec2 vUV;
+
+void main()
+{
+	// planes are top-down
+	vec2 uv = vec2(vUV.x, 1.0 - vUV.y);
+	float y = texture(samplerY, uv).x;
+	float u = texture(samplerU, uv).x - 128.0/255.0;
+	float v = texture(samplerV, uv).x - 128.0/255.0;
+	if (fullRange == 0)
+	{
+		y = (y - 16.0/255.0) * (255.0/219.0);
+		u *= 255.0/224.0;
+		v *= 255.0/224.0;
+	}
+	vec3 rgb;
+	if (bt709 != 0)
+		rgb = vec3(y + 1.5748 * v, y - 0.187324 * u - 0.468124 * v, y + 1.8556 * u);
+	else
+		rgb = vec3(y + 1.402 * v, y - 0.344136 * u - 0.714136 * v, y + 1.772 * u);
+	outPixDiffuse = vec4(clamp(rgb, 0.0, 1.0), 1.0);
+}
+
+#endif
@@ -260,12 +260,39 @@ namespace FFMPEGCodec
 			break;
 		}
 
-		m_rgb_buffer.resize(
-			avpicture_get_size(m_dst_pix_format,
-				m_codec_context->width,
-				m_codec_context->height),
-			0
-		);
+		m_frame_buffer_size = avpicture_get_size(m_dst_pix_format,
+			m_codec_context->width,
+			m_codec_context->height);
+
+		const AVPixFmtDescriptor *pixDesc = av_pix_fmt_desc_get(src_pix_format);
+		bool planar8Bits = pixDesc && (pixDesc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(pixDesc->flags & AV_PIX_FMT_FLAG_RGB) && pixDesc->nb_components == 3 && pixDesc->comp[0].depth == 8;
+		if (m_yuv_requested && planar8Bits)
+		{
+			int width = m_codec_context->width;
+			int height = m_codec_context->height;
+			int chromaWidth = -((-width) >> pixDesc->log2_chroma_w);
+			int chromaHeight = -((-height) >> pixDesc->log2_chroma_h);
+			m_yuv_output = true;
+			m_yuv_layout.mWidths[0] = width;
+			m_yuv_layout.mHeights[0] = height;
+			for (int i = 1; i < 3; i++)
+			{
+				m_yuv_layout.mWidths[i] = chromaWidth;
+				m_yuv_layout.mHeights[i] = chromaHeight;
+			}
+			size_t offset = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				m_yuv_layout.mPlanes[i] = (const uint8_t*)offset;
+				offset += m_yuv_layout.mWidths[i] * m_yuv_layout.mHeights[i];
+			}
+			m_frame_buffer_size = offset;
+			m_yuv_layout.mbFullRange = (m_codec_context->color_range == AVCOL_RANGE_JPEG) || (src_pix_format != m_codec_context->pix_fmt);
+			if (m_codec_context->colorspace == AVCOL_SPC_UNSPECIFIED)
+				m_yuv_layout.mbBT709 = height >= 720;
+			else
+				m_yuv_layout.mbBT709 = m_codec_context->colorspace == AVCOL_SPC_BT709;
+		}
 
 		m_sws_rgb_context = sws_getContext(
 			m_codec_context->width,
@@ -303,13 +330,53 @@ namespace FFMPEGCodec
 
 	void *Decoder::GetRGBData()
 	{
-		if (!m_rgb_frame)
+		if (!m_current_frame)
 			return NULL;
-		return m_rgb_frame->data[0];
+		if (!m_yuv_output)
+			return m_current_frame->data();
+
+		if (m_rgb_source != m_current_frame)
+		{
+			YUVPlanes planes;
+			GetYUVPlanes(planes);
+			m_rgb_buffer.resize(avpicture_get_size(m_dst_pix_format, int(mWidth), int(mHeight)));
+			avpicture_fill(reinterpret_cast<AVPicture*>(m_rgb_frame), m_rgb_buffer.data(), m_dst_pix_format, int(mWidth), int(mHeight));
+			const uint8_t * const src[4] = { planes.mPlanes[0], planes.mPlanes[1], planes.mPlanes[2], NULL };
+			const int srcStride[4] = { planes.mWidths[0], planes.mWidths[1], planes.mWidths[2], 0 };
+			sws_scale(m_sws_rgb_context, src, srcStride, 0, int(mHeight), m_rgb_frame->data, m_rgb_frame->linesize);
+			m_rgb_source = m_current_frame;
+		}
+		return m_rgb_buffer.data();
+	}
+
+	bool Decoder::GetYUVPlanes(YUVPlanes& planes)
+	{
+		if (!m_yuv_output || !m_current_frame)
+			return false;
+		planes = m_yuv_layout;
+		for (int i = 0; i < 3; i++)
+			planes.mPlanes[i] = m_current_frame->data() + size_t(m_yuv_layout.mPlanes[i]);
+		return true;
+	}
+
+	void Decoder::CopyYUVPlanes(uint8_t *dst)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			uint8_t *planeDst = dst + size_t(m_yuv_layout.mPlanes[i]);
+			const uint8_t *planeSrc = m_frame->data[i];
+			for (int j = 0; j < m_yuv_layout.mHeights[i]; j++)
+			{
+				memcpy(planeDst, planeSrc, m_yuv_layout.mWidths[i]);
+				planeDst += m_yuv_layout.mWidths[i];
+				planeSrc += m_frame->linesize[i];
+			}
+		}
 	}
 
 	bool Decoder::Close(void)
 	{
+		std::lock_guard<std::mutex> lock(m_mutex);
 		if (m_codec_context)
 			avcodec_close(m_codec_context);
 		if (m_format_context)
@@ -323,9 +390,81 @@ namespace FFMPEGCodec
 	}
 
 	bool Decoder::ReadFrame(int frame)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		FrameBits bits = FindCachedFrame(frame);
+		if (!bits)
+			bits = DecodeFrame(frame);
+		if (bits)
+		{
+			m_current_frame = bits;
+			m_read_frame = true;
+		}
+		return m_read_frame;
+	}
+
+	bool Decoder::Prefetch(int frame)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (FindCachedFrame(frame))
+			return true;
+		return DecodeFrame(frame) != NULL;
+	}
+
+	bool Decoder::IsFrameCached(int frame)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& cached : m_frame_cache)
+		{
+			if (cached.mFrame == frame)
+				return true;
+		}
+		return false;
+	}
+
+	void Decoder::SetCacheBudget(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cache_budget = bytes;
+		EvictCachedFrames();
+	}
+
+	Decoder::FrameBits Decoder::FindCachedFrame(int frame)
+	{
+		for (auto iter = m_frame_cache.begin(); iter != m_frame_cache.end(); ++iter)
+		{
+			if (iter->mFrame == frame)
+			{
+				m_frame_cache.splice(m_frame_cache.begin(), m_frame_cache, iter);
+				return m_frame_cache.front().mBits;
+			}
+		}
+		return NULL;
+	}
+
+	void Decoder::AddCachedFrame(int frame, FrameBits bits)
+	{
+		m_frame_cache.push_front({ frame, bits });
+		EvictCachedFrames();
+	}
+
+	void Decoder::EvictCachedFrames()
+	{
+		while (!m_frame_cache.empty() && m_frame_cache.size() * m_frame_buffer_size > m_cache_budget)
+		{
+			FrameBits evicted = m_frame_cache.back().mBits;
+			m_frame_cache.pop_back();
+			// the current frame may still reference it
+			if (evicted.use_count() == 1)
+				m_spare_frame = evicted;
+		}
+	}
+
+	Decoder::FrameBits Decoder::DecodeFrame(int frame)
 	{
 		if (!m_codec_context)
-			return false;
+			return NULL;
+		FrameBits bits;
 		if (m_last_decoded_pos + 1 != frame)
 		{
 			Seek(frame);
@@ -361,33 +500,45 @@ namespace FFMPEGCodec
 
 				if (current_frame == frame && finished)
 				{
-					avpicture_fill
-					(
-						reinterpret_cast<AVPicture*>(m_rgb_frame),
-						&m_rgb_buffer[0],
-						m_dst_pix_format,
-						m_codec_context->width,
-						m_codec_context->height
-					);
-					sws_scale
-					(
-						m_sws_rgb_context,
-						static_cast<uint8_t const * const *> (m_frame->data),
-						m_frame->linesize,
-						0,
-						m_codec_context->height,
-						m_rgb_frame->data,
-						m_rgb_frame->linesize
-					);
+					if (m_spare_frame && m_spare_frame->size() == m_frame_buffer_size)
+						bits.swap(m_spare_frame);
+					else
+						bits = std::make_shared<std::vector<uint8_t> >(m_frame_buffer_size);
+					m_spare_frame.reset();
+					if (m_yuv_output)
+					{
+						CopyYUVPlanes(bits->data());
+					}
+					else
+					{
+						avpicture_fill
+						(
+							reinterpret_cast<AVPicture*>(m_rgb_frame),
+							bits->data(),
+							m_dst_pix_format,
+							m_codec_context->width,
+							m_codec_context->height
+						);
+						sws_scale
+						(
+							m_sws_rgb_context,
+							static_cast<uint8_t const * const *> (m_frame->data),
+							m_frame->linesize,
+							0,
+							m_codec_context->height,
+							m_rgb_frame->data,
+							m_rgb_frame->linesize
+						);
+					}
 					m_last_decoded_pos = current_frame;
 					av_free_packet(&pkt);
-					m_read_frame = true;
+					AddCachedFrame(frame, bits);
 					break;
 				}
 			}
 			av_free_packet(&pkt);
 		}
-		return m_read_frame;
+		return bits;
 	}
 
 	int64_t FrameToPts(AVStream* pavStream, int frame)
@@ -426,8 +577,6 @@ namespace FFMPEGCodec
 		return 1.0f;
 	}
 
-#define VIDEO_TMP_FILE "tmp.h264"
-
 	using namespace std;
 	void Debug(const std::string& str, int err) 
 	{
@@ -435,18 +584,30 @@ namespace FFMPEGCodec
 	}
 
 	void Encoder::Init(const std::string& filename, int width, int height, int fpsrate, int bitrate)
+	{
+		Parameters parameters;
+		parameters.mFps = fpsrate;
+		parameters.mBitrate = bitrate;
+		parameters.mCodec = "h264";
+		Init(filename, width, height, parameters);
+	}
+
+	void Encoder::Init(const std::string& filename, int width, int height, const Parameters& parameters)
 	{
 		mFilename = filename;
-		fps = fpsrate;
+		// encoded as a raw stream first then remuxed. one temp file per output so encoders can run concurrently
+		mTmpFilename = filename + ".tmp." + (parameters.mCodec.empty() ? std::string("h264") : parameters.mCodec);
+		fps = parameters.mFps;
+		int bitrate = parameters.mBitrate;
 
 		int err;
 
-		if (!(oformat = av_guess_format(NULL, VIDEO_TMP_FILE, NULL))) {
+		if (!(oformat = av_guess_format(NULL, mTmpFilename.c_str(), NULL))) {
 			Debug("Failed to define output format", 0);
 			return;
 		}
 
-		if ((err = avformat_alloc_output_context2(&ofctx, oformat, NULL, VIDEO_TMP_FILE) < 0)) {
+		if ((err = avformat_alloc_output_context2(&ofctx, oformat, NULL, mTmpFilename.c_str()) < 0)) {
 			Debug("Failed to allocate output context", err);
 			Free();
 			return;
@@ -482,9 +643,9 @@ namespace FFMPEGCodec
 		cctx->time_base = { 1, fps };
 		cctx->max_b_frames = 2;
 		cctx->gop_size = 12;
-		/*if (videoStream->codecpar->codec_id == AV_CODEC_ID_H264) {
-		av_opt_set(cctx, "preset", "ultrafast", 0);
-		}*/
+		if (!parameters.mPreset.empty() && av_opt_set(cctx->priv_data, "preset", parameters.mPreset.c_str(), 0) < 0) {
+			Debug("Preset not supported by encoder", 0);
+		}
 		if (ofctx->oformat->flags & AVFMT_GLOBALHEADER) {
 			cctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 		}
@@ -497,7 +658,7 @@ namespace FFMPEGCodec
 		}
 
 		if (!(oformat->flags & AVFMT_NOFILE)) {
-			if ((err = avio_open(&ofctx->pb, VIDEO_TMP_FILE, AVIO_FLAG_WRITE)) < 0) {
+			if ((err = avio_open(&ofctx->pb, mTmpFilename.c_str(), AVIO_FLAG_WRITE)) < 0) {
 				Debug("Failed to open file", err);
 				Free();
 				return;
@@ -510,12 +671,14 @@ namespace FFMPEGCodec
 			return;
 		}
 
-		av_dump_format(ofctx, 0, VIDEO_TMP_FILE, 1);
+		av_dump_format(ofctx, 0, mTmpFilename.c_str(), 1);
 	}
 
 	void Encoder::AddFrame(uint8_t *data, int width, int height) 
 	{
 		int err;
+		if (!cctx)
+			return;
 		if (!videoFrame) {
 
 			videoFrame = av_frame_alloc();
@@ -571,7 +734,55 @@ namespace FFMPEGCodec
 		}
 	}
 
+	void Encoder::PushFrame(uint8_t *data, int width, int height)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mQueueMutex);
+			if (!mWorker.joinable())
+				mWorker = std::thread(&Encoder::WorkerMain, this);
+			mQueueCondition.wait(lock, [&] { return mQueue.size() < MaxQueuedFrames; });
+			mQueue.push_back({ data, width, height });
+		}
+		mQueueCondition.notify_all();
+	}
+
+	void Encoder::WorkerMain()
+	{
+		while (true)
+		{
+			QueuedFrame frame;
+			{
+				std::unique_lock<std::mutex> lock(mQueueMutex);
+				mQueueCondition.wait(lock, [&] { return !mQueue.empty() || mbStopWorker; });
+				if (mQueue.empty())
+					return;
+				frame = mQueue.front();
+				mQueue.pop_front();
+			}
+			mQueueCondition.notify_all();
+			AddFrame(frame.mData, frame.mWidth, frame.mHeight);
+			free(frame.mData);
+		}
+	}
+
+	// pending frames are encoded before the worker exits
+	void Encoder::StopWorker()
+	{
+		if (!mWorker.joinable())
+			return;
+		{
+			std::unique_lock<std::mutex> lock(mQueueMutex);
+			mbStopWorker = true;
+		}
+		mQueueCondition.notify_all();
+		mWorker.join();
+		mbStopWorker = false;
+	}
+
 	void Encoder::Finish() {
+		StopWorker();
+		if (!cctx)
+			return;
 		//DELAYED FRAMES
 		AVPacket pkt;
 		av_init_packet(&pkt);
@@ -627,7 +838,7 @@ namespace FFMPEGCodec
 		AVStream *inVideoStream = NULL, *outVideoStream = NULL;
 		int err, ts = 0;
 
-		if ((err = avformat_open_input(&ifmt_ctx, VIDEO_TMP_FILE, 0, 0)) < 0) {
+		if ((err = avformat_open_input(&ifmt_ctx, mTmpFilename.c_str(), 0, 0)) < 0) {
 			Debug("Failed to open input file for remuxing", err);
 			goto end;
 		}
@@ -694,5 +905,6 @@ namespace FFMPEGCodec
 		if (ofmt_ctx) {
 			avformat_free_context(ofmt_ctx);
 		}
+		remove(mTmpFilename.c_str());
 	}
 }
\ No newline at end of file
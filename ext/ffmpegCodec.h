@@ -12,6 +12,12 @@
 #include <string.h>
 #include <algorithm>
 #include <string> 
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <condition_variable>
 
 namespace FFMPEGCodec
 {
@@ -22,7 +28,7 @@ namespace FFMPEGCodec
 	class Decoder
 	{
 	public:
-		Decoder() { Init(); }
+		Decoder() : m_cache_budget(DefaultFrameCacheBudget), m_yuv_requested(false) { Init(); }
 		virtual ~Decoder() 
 		{ 
 			Close(); 
@@ -34,9 +40,29 @@ namespace FFMPEGCodec
 		}
 		bool SeekSubimage(int subimage, int miplevel);
 
-		void *GetRGBData();
+		void *GetRGBData(); // converted on demand when the decoder outputs YUV planes
 		bool ReadFrame(int pos);
 
+		// 8 bits planar YUV sources can skip swscale. Must be set before Open
+		struct YUVPlanes
+		{
+			const uint8_t *mPlanes[3];
+			int mWidths[3];
+			int mHeights[3];
+			bool mbBT709;
+			bool mbFullRange;
+		};
+		void SetYUVOutput(bool enable) { m_yuv_requested = enable; }
+		bool IsYUVOutput() const { return m_yuv_output; }
+		bool GetYUVPlanes(YUVPlanes& planes); // planes of the current frame
+		// decode a frame into the cache without changing the current frame. Safe to call from a worker thread
+		bool Prefetch(int pos);
+		bool IsFrameCached(int pos);
+		// memory used by converted frames. Least recently used frames are evicted first
+		void SetCacheBudget(size_t bytes);
+		size_t GetCacheBudget() const { return m_cache_budget; }
+		static const size_t DefaultFrameCacheBudget = 256 * 1024 * 1024;
+
 		bool Seek(int pos);
 		double Fps() const;
 		int64_t TimeStamp(int pos) const;
@@ -58,7 +84,8 @@ namespace FFMPEGCodec
 		AVPixelFormat m_dst_pix_format;
 		SwsContext *m_sws_rgb_context;
 		AVRational m_frame_rate;
-		std::vector<uint8_t> m_rgb_buffer;
+		size_t m_frame_buffer_size;
+		std::vector<uint8_t> m_rgb_buffer; // on demand conversion of YUV frames
 		std::vector<int> m_video_indexes;
 		int m_video_stream;
 		int64_t m_frames;
@@ -69,6 +96,30 @@ namespace FFMPEGCodec
 		bool m_read_frame;
 		int64_t m_start_time;
 
+		typedef std::shared_ptr<std::vector<uint8_t> > FrameBits;
+		struct CachedFrame
+		{
+			int mFrame;
+			FrameBits mBits;
+		};
+		std::mutex m_mutex;
+		std::list<CachedFrame> m_frame_cache; // most recently used first
+		size_t m_cache_budget;
+		FrameBits m_current_frame;
+		FrameBits m_spare_frame; // last evicted buffer, reused by the next decode
+		FrameBits m_rgb_source; // frame converted in m_rgb_buffer
+
+		bool m_yuv_requested;
+		bool m_yuv_output;
+		YUVPlanes m_yuv_layout; // plane offsets in a frame buffer instead of pointers
+
+		void CopyYUVPlanes(uint8_t *dst);
+
+		FrameBits FindCachedFrame(int frame);
+		void AddCachedFrame(int frame, FrameBits bits);
+		void EvictCachedFrames();
+		FrameBits DecodeFrame(int frame);
+
 		// init to initialize state
 		void Init(void) {
 			m_filename.clear();
@@ -79,7 +130,14 @@ namespace FFMPEGCodec
 			m_rgb_frame = 0;
 			m_sws_rgb_context = 0;
 			m_stride = 0;
+			m_frame_buffer_size = 0;
 			m_rgb_buffer.clear();
+			m_frame_cache.clear();
+			m_current_frame.reset();
+			m_spare_frame.reset();
+			m_rgb_source.reset();
+			m_yuv_output = false;
+			memset(&m_yuv_layout, 0, sizeof(YUVPlanes));
 			m_video_indexes.clear();
 			m_video_stream = -1;
 			m_frames = 0;
@@ -103,22 +161,39 @@ namespace FFMPEGCodec
 			ofctx = NULL;
 			videoStream = NULL;
 			videoFrame = NULL;
+			codec = NULL;
+			cctx = NULL;
 			swsCtx = NULL;
 			frameCounter = 0;
+			mbStopWorker = false;
 		}
 
 		~Encoder() {
+			StopWorker();
 			Free();
 		}
 
+		struct Parameters
+		{
+			int mFps;
+			int mBitrate; // kbps
+			std::string mCodec; // raw stream extension used to pick the encoder (h264, hevc, m4v)
+			std::string mPreset; // x264/x265 preset, empty for encoder default
+		};
+
 		void Init(const std::string& filename, int width, int height, int fpsrate, int bitrate);
+		void Init(const std::string& filename, int width, int height, const Parameters& parameters);
 
 		void AddFrame(uint8_t *data, int width, int height);
+		// encodes on a worker thread. takes ownership of data (malloc). Blocks only when MaxQueuedFrames are pending
+		void PushFrame(uint8_t *data, int width, int height);
 
 		void Finish();
 
+		static const size_t MaxQueuedFrames = 4;
 	private:
 		std::string mFilename;
+		std::string mTmpFilename;
 		AVOutputFormat *oformat;
 		AVFormatContext *ofctx;
 
@@ -134,6 +209,20 @@ namespace FFMPEGCodec
 
 		int fps;
 
+		struct QueuedFrame
+		{
+			uint8_t *mData;
+			int mWidth, mHeight;
+		};
+		std::thread mWorker;
+		std::mutex mQueueMutex;
+		std::condition_variable mQueueCondition;
+		std::deque<QueuedFrame> mQueue;
+		bool mbStopWorker;
+
+		void WorkerMain();
+		void StopWorker();
+
 		void Free();
 
 		void Remux();
@@ -15,6 +15,8 @@ extern "C"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/opt.h>
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57,24,0)
 # include <libavutil/imgutils.h>
 #endif
@@ -0,0 +1,372 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "DiskCache.h"
+#include "Evaluation.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <iterator>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+int Log(const char *szFormat, ...);
+
+DiskCache gDiskCache;
+
+static const uint32_t DiskCacheMagic = 0x43444D49; // 'IMDC'
+static const uint32_t DiskCacheVersion = 1;
+
+struct DiskCacheHeader
+{
+	uint32_t mMagic;
+	uint32_t mVersion;
+	int32_t mWidth;
+	int32_t mHeight;
+	uint32_t mDataSize;
+	uint8_t mNumMips;
+	uint8_t mNumFaces;
+	uint8_t mFormat;
+	uint8_t mPadding;
+};
+
+bool DiskCache::MapFile(const char *filename, MappedFile& mapped)
+{
+#ifdef _WIN32
+	// shared: a mapped library journal is still appended to
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || !size.QuadPart)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!data)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	mapped.mData = data;
+	mapped.mSize = size_t(size.QuadPart);
+	mapped.mFile = file;
+	mapped.mMapping = mapping;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) || !st.st_size)
+	{
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	mapped.mData = data;
+	mapped.mSize = size_t(st.st_size);
+#endif
+	return true;
+}
+
+static void MakeDirectory(const char *directory)
+{
+#ifdef _WIN32
+	_mkdir(directory);
+#else
+	mkdir(directory, 0755);
+#endif
+}
+
+DiskCache::DiskCache() : mbEnabled(false), mbIndexLoaded(false), mbIndexDirty(false), mMaxBytes(DefaultMaxBytes)
+{
+	memset(&mStatistics, 0, sizeof(Statistics));
+}
+
+void DiskCache::Init(const char *directory)
+{
+	mDirectory = directory;
+	if (!mDirectory.empty() && mDirectory.back() != '/' && mDirectory.back() != '\\')
+		mDirectory += '/';
+	MakeDirectory(mDirectory.c_str());
+	ReadSettings();
+}
+
+void DiskCache::Finish()
+{
+	FlushIndex();
+}
+
+void DiskCache::SetEnabled(bool enabled)
+{
+	if (enabled && !mbIndexLoaded)
+	{
+		ReadIndex();
+		mbIndexLoaded = true;
+	}
+	if (enabled == mbEnabled)
+		return;
+	mbEnabled = enabled;
+	WriteSettings();
+}
+
+std::string DiskCache::GetPath(uint64_t key) const
+{
+	char tmps[32];
+	sprintf(tmps, "%08x%08x.cache", uint32_t(key >> 32), uint32_t(key));
+	return mDirectory + tmps;
+}
+
+bool DiskCache::Load(uint64_t key, Image_t& image, MappedFile& mapped)
+{
+	auto iter = mEntryPerKey.find(key);
+	if (iter == mEntryPerKey.end())
+	{
+		mStatistics.mMissCount++;
+		return false;
+	}
+
+	if (!MapFile(GetPath(key).c_str(), mapped))
+	{
+		// deleted behind our back
+		Remove(key);
+		mStatistics.mMissCount++;
+		return false;
+	}
+	const DiskCacheHeader *header = (const DiskCacheHeader*)mapped.mData;
+	if (mapped.mSize < sizeof(DiskCacheHeader) || header->mMagic != DiskCacheMagic || header->mVersion != DiskCacheVersion
+		|| mapped.mSize < sizeof(DiskCacheHeader) + header->mDataSize)
+	{
+		Unmap(mapped);
+		Remove(key);
+		mStatistics.mMissCount++;
+		return false;
+	}
+
+	image.mBits = (unsigned char*)mapped.mData + sizeof(DiskCacheHeader);
+	image.mDecoder = NULL;
+	image.mWidth = header->mWidth;
+	image.mHeight = header->mHeight;
+	image.mDataSize = header->mDataSize;
+	image.mNumMips = header->mNumMips;
+	image.mNumFaces = header->mNumFaces;
+	image.mFormat = header->mFormat;
+
+	mEntries.splice(mEntries.begin(), mEntries, iter->second);
+	mStatistics.mHitCount++;
+	return true;
+}
+
+void DiskCache::Unmap(MappedFile& mapped)
+{
+	if (!mapped.mData)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(mapped.mData);
+	CloseHandle((HANDLE)mapped.mMapping);
+	CloseHandle((HANDLE)mapped.mFile);
+#else
+	munmap(mapped.mData, mapped.mSize);
+#endif
+	mapped = MappedFile();
+}
+
+bool DiskCache::Write(uint64_t key, const Image_t& image) const
+{
+	if (!image.mBits || !image.mDataSize)
+		return false;
+
+	DiskCacheHeader header;
+	memset(&header, 0, sizeof(DiskCacheHeader));
+	header.mMagic = DiskCacheMagic;
+	header.mVersion = DiskCacheVersion;
+	header.mWidth = image.mWidth;
+	header.mHeight = image.mHeight;
+	header.mDataSize = image.mDataSize;
+	header.mNumMips = image.mNumMips;
+	header.mNumFaces = image.mNumFaces;
+	header.mFormat = image.mFormat;
+
+	// a partially written file never gets a valid name
+	std::string path = GetPath(key);
+	std::string tmpPath = path + ".tmp";
+	FILE *fp = fopen(tmpPath.c_str(), "wb");
+	if (!fp)
+		return false;
+	bool written = fwrite(&header, sizeof(DiskCacheHeader), 1, fp) == 1 && fwrite(image.mBits, image.mDataSize, 1, fp) == 1;
+	fclose(fp);
+	remove(path.c_str());
+	if (!written || rename(tmpPath.c_str(), path.c_str()))
+	{
+		remove(tmpPath.c_str());
+		Log("Disk cache: unable to write %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void DiskCache::Insert(uint64_t key, const Image_t& image)
+{
+	if (Contains(key))
+		return;
+	Entry entry = { key, sizeof(DiskCacheHeader) + image.mDataSize };
+	mEntries.push_front(entry);
+	mEntryPerKey[key] = mEntries.begin();
+	mStatistics.mCount++;
+	mStatistics.mBytes += entry.mSize;
+	Evict();
+	mbIndexDirty = true;
+}
+
+void DiskCache::Remove(uint64_t key)
+{
+	auto iter = mEntryPerKey.find(key);
+	if (iter == mEntryPerKey.end())
+		return;
+	remove(GetPath(key).c_str());
+	mStatistics.mCount--;
+	mStatistics.mBytes -= iter->second->mSize;
+	mEntries.erase(iter->second);
+	mEntryPerKey.erase(iter);
+	mbIndexDirty = true;
+}
+
+void DiskCache::Evict()
+{
+	while (!mEntries.empty() && mStatistics.mBytes > mMaxBytes)
+		Remove(mEntries.back().mKey);
+}
+
+void DiskCache::Clear()
+{
+	while (!mEntries.empty())
+		Remove(mEntries.back().mKey);
+	FlushIndex();
+}
+
+void DiskCache::FlushIndex()
+{
+	if (!mbIndexLoaded || !mbIndexDirty)
+		return;
+	WriteIndex();
+	mbIndexDirty = false;
+}
+
+// index keeps the LRU order between sessions
+void DiskCache::ReadIndex()
+{
+	mEntries.clear();
+	mEntryPerKey.clear();
+	memset(&mStatistics, 0, sizeof(Statistics));
+	mbIndexDirty = false;
+
+	FILE *fp = fopen((mDirectory + "index.dat").c_str(), "rb");
+	if (!fp)
+		return;
+	uint32_t magic = 0, version = 0, count = 0;
+	if (fread(&magic, sizeof(uint32_t), 1, fp) == 1 && magic == DiskCacheMagic
+		&& fread(&version, sizeof(uint32_t), 1, fp) == 1 && version == DiskCacheVersion
+		&& fread(&count, sizeof(uint32_t), 1, fp) == 1)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint64_t entryData[2];
+			if (fread(entryData, sizeof(entryData), 1, fp) != 1)
+				break;
+			if (mEntryPerKey.find(entryData[0]) != mEntryPerKey.end())
+				continue;
+			Entry entry = { entryData[0], size_t(entryData[1]) };
+			mEntries.push_back(entry);
+			mEntryPerKey[entry.mKey] = std::prev(mEntries.end());
+			mStatistics.mCount++;
+			mStatistics.mBytes += entry.mSize;
+		}
+	}
+	fclose(fp);
+	Evict();
+}
+
+void DiskCache::WriteIndex()
+{
+	FILE *fp = fopen((mDirectory + "index.dat").c_str(), "wb");
+	if (!fp)
+		return;
+	uint32_t count = uint32_t(mEntries.size());
+	fwrite(&DiskCacheMagic, sizeof(uint32_t), 1, fp);
+	fwrite(&DiskCacheVersion, sizeof(uint32_t), 1, fp);
+	fwrite(&count, sizeof(uint32_t), 1, fp);
+	for (auto& entry : mEntries)
+	{
+		uint64_t entryData[2] = { entry.mKey, uint64_t(entry.mSize) };
+		fwrite(entryData, sizeof(entryData), 1, fp);
+	}
+	fclose(fp);
+}
+
+// enabled state is kept with the cache it applies to
+void DiskCache::ReadSettings()
+{
+	FILE *fp = fopen((mDirectory + "settings.dat").c_str(), "rb");
+	if (!fp)
+		return;
+	uint32_t magic = 0, version = 0, enabled = 0;
+	if (fread(&magic, sizeof(uint32_t), 1, fp) == 1 && magic == DiskCacheMagic
+		&& fread(&version, sizeof(uint32_t), 1, fp) == 1 && version == DiskCacheVersion
+		&& fread(&enabled, sizeof(uint32_t), 1, fp) == 1)
+	{
+		if (enabled)
+		{
+			ReadIndex();
+			mbIndexLoaded = true;
+		}
+		mbEnabled = enabled != 0;
+	}
+	fclose(fp);
+}
+
+void DiskCache::WriteSettings()
+{
+	FILE *fp = fopen((mDirectory + "settings.dat").c_str(), "wb");
+	if (!fp)
+		return;
+	uint32_t enabled = mbEnabled ? 1 : 0;
+	fwrite(&DiskCacheMagic, sizeof(uint32_t), 1, fp);
+	fwrite(&DiskCacheVersion, sizeof(uint32_t), 1, fp);
+	fwrite(&enabled, sizeof(uint32_t), 1, fp);
+	fclose(fp);
+}
@@ -0,0 +1,109 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+struct Image_t;
+
+// evaluated stage outputs stored on disk between sessions, keyed by the stage hash of the evaluation context.
+// One uncompressed file per output, read back by mapping it. Bounded in size, least recently used go first
+struct DiskCache
+{
+	struct MappedFile
+	{
+		MappedFile() : mData(NULL), mSize(0), mFile(NULL), mMapping(NULL) {}
+		void *mData;
+		size_t mSize;
+		void *mFile;
+		void *mMapping;
+	};
+
+	struct Statistics
+	{
+		size_t mCount;
+		size_t mBytes;
+		size_t mHitCount;
+		size_t mMissCount;
+	};
+
+	DiskCache();
+
+	void Init(const char *directory);
+	void Finish();
+
+	void SetEnabled(bool enabled);
+	bool IsEnabled() const { return mbEnabled; }
+	void SetMaxBytes(size_t maxBytes) { mMaxBytes = maxBytes; Evict(); }
+
+	bool Contains(uint64_t key) const { return mEntryPerKey.find(key) != mEntryPerKey.end(); }
+	// image bits point into the mapping, valid until Unmap
+	bool Load(uint64_t key, Image_t& image, MappedFile& mapped);
+	// writing the file touches no entry and can run on a worker. Insert then records it, on the main thread
+	bool Write(uint64_t key, const Image_t& image) const;
+	void Insert(uint64_t key, const Image_t& image);
+	void Clear();
+	// index is rewritten once per batch of stores rather than after each one
+	void FlushIndex();
+
+	// read only mapping of a whole file, also used by chunked libraries
+	static bool MapFile(const char *filename, MappedFile& mapped);
+	static void Unmap(MappedFile& mapped);
+
+	const Statistics& GetStatistics() const { return mStatistics; }
+
+	static const size_t DefaultMaxBytes = 1024 * 1024 * 1024;
+
+protected:
+	struct Entry
+	{
+		uint64_t mKey;
+		size_t mSize;
+	};
+
+	std::string GetPath(uint64_t key) const;
+	void Remove(uint64_t key);
+	void Evict();
+	void ReadIndex();
+	void WriteIndex();
+	void ReadSettings();
+	void WriteSettings();
+
+	bool mbEnabled;
+	bool mbIndexLoaded;
+	bool mbIndexDirty;
+	std::string mDirectory;
+	size_t mMaxBytes;
+	std::list<Entry> mEntries; // most recently used first
+	std::map<uint64_t, std::list<Entry>::iterator> mEntryPerKey;
+	Statistics mStatistics;
+};
+
+extern DiskCache gDiskCache;
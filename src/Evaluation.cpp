@@ -23,26 +23,145 @@
 // SOFTWARE.
 //
 
+#include <GL/gl3w.h>    // Initialize with gl3wInit()
 #include "Evaluation.h"
 #include "EvaluationContext.h"
 #include "Evaluators.h"
+#include "DiskCache.h"
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include "TaskScheduler.h"
 
-Evaluation::Evaluation() : mProgressShader(0), mDisplayCubemapShader(0)
+extern enki::TaskScheduler g_TS;
+
+// decodes the frames following the last one displayed so scrubbing and exports hit the decoder cache.
+// one task per decoder, newer requests replace the pending one
+struct DecoderReadAheadTaskSet final : enki::ITaskSet
+{
+	DecoderReadAheadTaskSet(std::shared_ptr<FFMPEGCodec::Decoder> decoder) : enki::ITaskSet(), mDecoder(decoder), mFrame(0), mDirection(1), mbPending(false)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		std::shared_ptr<FFMPEGCodec::Decoder> decoder = mDecoder.lock();
+		while (true)
+		{
+			int frame, direction;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				if (!mbPending || !decoder)
+				{
+					mbPending = false;
+					return;
+				}
+				frame = mFrame;
+				direction = mDirection;
+				mbPending = false;
+			}
+			// backward read-ahead still decodes in ascending order: one seek for the whole range
+			int first = (direction > 0) ? frame + 1 : ImMax(frame - ReadAheadFrameCount, 0);
+			int last = (direction > 0) ? ImMin(frame + ReadAheadFrameCount, int(decoder->mFrameCount) - 1) : frame - 1;
+			for (int i = first; i <= last; i++)
+			{
+				if (mbPending)
+					break;
+				decoder->Prefetch(i);
+			}
+		}
+	}
+	void Request(int frame, int direction)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFrame = frame;
+		mDirection = direction;
+		mbPending = true;
+	}
+	bool IsPending() const { return mbPending; }
+	static const int ReadAheadFrameCount = 8;
+	std::mutex mMutex;
+	std::weak_ptr<FFMPEGCodec::Decoder> mDecoder;
+	int mFrame;
+	int mDirection;
+	std::atomic<bool> mbPending; // written under mMutex, polled without it
+};
+
+static std::map<FFMPEGCodec::Decoder*, DecoderReadAheadTaskSet*> gDecoderReadAheads;
+
+static void RequestReadAhead(const std::shared_ptr<FFMPEGCodec::Decoder>& decoder, int frame, int direction)
+{
+	DecoderReadAheadTaskSet*& readAhead = gDecoderReadAheads[decoder.get()];
+	if (readAhead && readAhead->mDecoder.expired())
+	{
+		// address reused by a new decoder
+		g_TS.WaitforTask(readAhead);
+		delete readAhead;
+		readAhead = NULL;
+	}
+	if (!readAhead)
+		readAhead = new DecoderReadAheadTaskSet(decoder);
+	readAhead->Request(frame, direction);
+	if (readAhead->GetIsComplete())
+		g_TS.AddTaskSetToPipe(readAhead);
+}
+
+void Evaluation::UpdateReadAheads()
+{
+	for (auto iter = gDecoderReadAheads.begin(); iter != gDecoderReadAheads.end();)
+	{
+		DecoderReadAheadTaskSet *readAhead = iter->second;
+		if (!readAhead->GetIsComplete())
+		{
+			++iter;
+			continue;
+		}
+		if (readAhead->mDecoder.expired())
+		{
+			delete readAhead;
+			iter = gDecoderReadAheads.erase(iter);
+			continue;
+		}
+		// requested while the task was returning
+		if (readAhead->IsPending())
+			g_TS.AddTaskSetToPipe(readAhead);
+		++iter;
+	}
+}
+
+Evaluation::Evaluation() : mProgressShader(0), mDisplayCubemapShader(0), mStreamUploadIndex(0), mYUV2RGBShader(0), mYUV2RGBBT709Location(-1), mYUV2RGBFullRangeLocation(-1)
 {
-	
+	memset(mStreamPlanes, 0, sizeof(mStreamPlanes));
+	memset(mStreamPlaneWidths, 0, sizeof(mStreamPlaneWidths));
+	memset(mStreamPlaneHeights, 0, sizeof(mStreamPlaneHeights));
 }
 
 void Evaluation::Init()
 {
 	APIInit();
+	gDiskCache.Init("Cache/");
 }
 
 void Evaluation::Finish()
 {
-
+	for (auto& readAhead : gDecoderReadAheads)
+	{
+		g_TS.WaitforTask(readAhead.second);
+		delete readAhead.second;
+	}
+	gDecoderReadAheads.clear();
+	for (auto& readback : mReadbacks)
+	{
+		if (readback.mFence)
+			glDeleteSync((GLsync)readback.mFence);
+		glDeleteBuffers(1, &readback.mPBO);
+	}
+	mReadbacks.clear();
+	mStreamStaging.Destroy();
+	gNodeOutputCache.Clear();
+	gRenderTargetPool.Clear();
+	gDiskCache.Finish();
 }
 
 size_t Evaluation::AddEvaluation(size_t nodeType, const std::string& nodeName)
@@ -58,6 +177,7 @@ size_t Evaluation::AddEvaluation(size_t nodeType, const std::string& nodeName)
 	evaluation.mBlendingSrc			= ONE;
 	evaluation.mBlendingDst			= ZERO;
 	evaluation.mLocalTime			= 0;
+	evaluation.mOutputFormat		= TextureFormat::Null;
 	evaluation.mEvaluationMask		= gEvaluators.GetMask(nodeType, nodeName);
 
 	if (evaluation.mEvaluationMask)
@@ -168,10 +288,11 @@ void Evaluation::SetStageLocalTime(size_t target, int localTime, bool updateDeco
 	int newLocalTime = ImMin(localTime, int(GetEvaluationImageDuration(target)));
 	if (stage.mDecoder && updateDecoder && stage.mLocalTime != newLocalTime)
 	{
+		int direction = (newLocalTime < stage.mLocalTime) ? -1 : 1;
 		stage.mLocalTime = newLocalTime;
-		Image_t image = stage.DecodeImage();
-		SetEvaluationImage(int(target), &image);
-		FreeImage(&image);
+		StreamEvaluationImage(int(target), stage.mDecoder.get(), stage.mLocalTime);
+
+		RequestReadAhead(stage.mDecoder, newLocalTime, direction);
 	}
 	else
 	{
@@ -198,6 +319,7 @@ FFMPEGCodec::Decoder* Evaluation::FindDecoder(const std::string& filename)
 			return evaluation.mDecoder.get();
 	}
 	auto decoder = new FFMPEGCodec::Decoder;
+	decoder->SetYUVOutput(mYUV2RGBShader != 0);
 	decoder->Open(filename);
 	return decoder;
 }
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include "ffmpegCodec.h"
 #include <memory>
+#include <list>
 #include "Utils.h"
 
 
@@ -65,6 +66,7 @@ enum EvaluationStatus
 {
 	EVAL_OK,
 	EVAL_ERR,
+	EVAL_PENDING,
 };
 
 struct EvaluationInfo
@@ -74,7 +76,7 @@ struct EvaluationInfo
 	int targetIndex;
 	int forcedDirty;
 	int uiPass;
-	int padding;
+	int cubeFace; // first face rendered by the draw
 	float mouse[4];
 	int inputIndices[8];
 	float pad2[4];
@@ -84,6 +86,15 @@ struct EvaluationInfo
 	size_t mLocalFrame;
 };
 
+// mirrors EncoderParameters in C/Imogen.h. 0 uses the encoder default
+struct EncoderParameters
+{
+	int mFps;
+	int mBitrate; // kbps
+	int mCodec;
+	int mPreset;
+};
+
 struct TextureFormat
 {
 	enum Enum
@@ -128,20 +139,131 @@ public:
 	{
 		memset(&mImage, 0, sizeof(Image_t));
 	}
+	~RenderTarget()
+	{
+		Destroy();
+	}
+	// owns its texture and framebuffer: storages are exchanged with Swap, never copied
+	RenderTarget(const RenderTarget&) = delete;
+	RenderTarget& operator = (const RenderTarget&) = delete;
 
-	void InitBuffer(int width, int height);
-	void InitCube(int width);
+	void InitBuffer(int width, int height, uint8_t format = TextureFormat::RGBA8, uint8_t numMips = 1);
+	void InitCube(int width, uint8_t format = TextureFormat::RGBA8, uint8_t numMips = 1);
 	void BindAsTarget() const;
 	void BindAsCubeTarget() const;
 	void BindCubeFace(size_t face);
-	void Destroy();
+	void BindAsLayeredCubeTarget(); // every face attached, selected with gl_Layer
+	void Destroy(); // storage goes back to gRenderTargetPool
 	void CheckFBO();
+	void Swap(RenderTarget& other); // exchanges storages, no copy
+	void EnsureMipChain(); // reallocates with every mip level, keeps level 0
+	void GenerateMips(); // rebuilds levels 1..n from level 0
+	// mips to allocate for new content: a chain built for sampling is kept when the storage doesn't change
+	uint8_t GetReusableMipCount(int width, int height, uint8_t format, uint8_t numFaces, uint8_t numMips) const;
+
+	static uint8_t GetFullMipCount(int width, int height);
 
 
 	Image_t mImage;
 	unsigned int mGLTexID;
 	TextureID mFbo;
 	int mRefCount;
+
+protected:
+	bool Allocate(int width, int height, uint8_t format, uint8_t numFaces, uint8_t numMips); // true when the storage comes from the pool
+};
+
+// process wide pool of render target storages (texture + fbo)
+// storages are keyed by size and format and are reused by every evaluation context
+struct RenderTargetPool
+{
+	struct Key
+	{
+		int mWidth;
+		int mHeight;
+		uint8_t mFormat;
+		uint8_t mNumFaces;
+		uint8_t mNumMips;
+		bool operator < (const Key& other) const;
+	};
+
+	struct Storage
+	{
+		unsigned int mGLTexID;
+		unsigned int mFbo;
+	};
+
+	struct Statistics
+	{
+		size_t mUsedCount;
+		size_t mUsedBytes;
+		size_t mFreeCount;
+		size_t mFreeBytes;
+		size_t mPeakCount; // high-water mark of used + free storages
+		size_t mPeakBytes;
+		size_t mAllocationCount;
+		size_t mReuseCount;
+	};
+
+	RenderTargetPool() : mMaxFreeBytes(256 * 1024 * 1024)
+	{
+		memset(&mStatistics, 0, sizeof(Statistics));
+	}
+
+	// returns true and fills storage when a free one matches the key. Otherwise the caller allocates it.
+	bool Acquire(const Key& key, Storage& storage);
+	void Release(const Key& key, const Storage& storage);
+	void Clear();
+
+	const Statistics& GetStatistics() const { return mStatistics; }
+	static size_t ComputeSize(const Key& key);
+
+	size_t mMaxFreeBytes; // free storages above that budget are deleted instead of pooled
+
+protected:
+	std::multimap<Key, Storage> mFreeStorages;
+	Statistics mStatistics;
+};
+
+// outputs of previous evaluations keyed by content hash (see EvaluationContext::ComputeStageHash)
+// entries own their storage. It is swapped with stage targets, never copied
+struct NodeOutputCache
+{
+	struct Statistics
+	{
+		size_t mCount;
+		size_t mBytes;
+		size_t mHitCount;
+		size_t mMissCount;
+	};
+
+	NodeOutputCache() : mMaxBytes(256 * 1024 * 1024)
+	{
+		memset(&mStatistics, 0, sizeof(Statistics));
+	}
+
+	// on hit, target gets the cached content and its previous content is stored under targetHash (0 to release it)
+	bool Fetch(uint64_t hash, RenderTarget *target, uint64_t targetHash);
+	// moves target content in the cache. target is left without storage
+	void Store(uint64_t hash, RenderTarget *target);
+	void Clear();
+
+	const Statistics& GetStatistics() const { return mStatistics; }
+
+	size_t mMaxBytes; // least recently used entries above that budget go back to gRenderTargetPool
+
+protected:
+	struct Entry
+	{
+		uint64_t mHash;
+		RenderTarget *mTarget;
+		size_t mSize;
+	};
+	std::list<Entry> mEntries; // most recently used first
+	std::map<uint64_t, std::list<Entry>::iterator> mEntryPerHash;
+	Statistics mStatistics;
+
+	void Evict();
 };
 
 struct Input
@@ -170,13 +292,13 @@ struct EvaluationStage
 	int mBlendingSrc;
 	int mBlendingDst;
 	int mLocalTime;
+	int mOutputFormat; // TextureFormat set by the C evaluator. Null for the one declared by the node or the highest precision of the inputs
 	// mouse
 	float mRx;
 	float mRy;
 	bool mLButDown;
 	bool mRButDown;
 	void Clear();
-	Image_t DecodeImage();
 };
 
 enum EvaluationMask
@@ -209,14 +331,18 @@ struct Evaluation
 	void Clear();
 	
 	void SetStageLocalTime(size_t target, int localTime, bool updateDecoder);
+	// once per frame: queues read-aheads requested while their task was completing, releases the ones of closed decoders
+	void UpdateReadAheads();
 
 	// API
 	static int ReadImage(const char *filename, Image *image);
 	static int ReadImageMem(unsigned char *data, size_t dataSize, Image *image);
 	static int WriteImage(const char *filename, Image *image, int format, int quality);
+	static int SetEncoderParameters(const char *filename, EncoderParameters *parameters);
 	static int GetEvaluationImage(int target, Image *image);
 	static int SetEvaluationImage(int target, Image *image);
 	static int SetEvaluationImageCube(int target, Image *image, int cubeFace);
+	static int SetRenderTargetImage(RenderTarget *tgt, const Image *image); // upload only, no dirty/decoder update
 	static int SetThumbnailImage(Image *image);
 	static int AllocateImage(Image *image);
 	static int FreeImage(Image *image);
@@ -224,10 +350,20 @@ struct Evaluation
 	static int Evaluate(int target, int width, int height, Image *image);
 	static void SetBlendingMode(int target, int blendSrc, int blendDst);
 	static int EncodePng(Image *image, std::vector<unsigned char> &pngImage);
+	// node images and thumbnails stored in the library. Decoding also reads png blobs of previous versions
+	static int EncodeImageBlob(Image *image, std::vector<unsigned char> &blob);
+	static int DecodeImageBlob(const unsigned char *data, size_t dataSize, Image *image);
 	static int SetNodeImage(int target, Image *image);
 	static int GetEvaluationSize(int target, int *imageWidth, int *imageHeight);
 	static int SetEvaluationSize(int target, int imageWidth, int imageHeight);
 	static int SetEvaluationCubeSize(int target, int faceWidth);
+	static int SetEvaluationFormat(int target, int format);
+	// asynchronous readback. returns a readback index or -1. Poll and End must be called on the GL thread
+	static int BeginEvaluationImageRead(int target);
+	static int PollEvaluationImageRead(int readback);
+	static int EndEvaluationImageRead(int readback, Image *image);
+	// video frame upload through the pixel unpack ring. No intermediate copy of the decoded frame
+	static int StreamEvaluationImage(int target, FFMPEGCodec::Decoder *decoder, int frame);
 	static int CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase, int glossScale, int glossBias);
 	static int Job(int(*jobFunction)(void*), void *ptr, unsigned int size);
 	static int JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size);
@@ -259,7 +395,40 @@ protected:
 
 	// ffmpeg encoders
 	FFMPEGCodec::Decoder* FindDecoder(const std::string& filename);
+
+	// pixel pack buffers used by asynchronous readbacks
+	struct ImageReadback
+	{
+		unsigned int mPBO;
+		size_t mPBOSize;
+		void *mFence;
+		bool mbInUse;
+		Image_t mImage; // bits are not allocated until the read ends
+	};
+	std::vector<ImageReadback> mReadbacks;
+
+	// pixel unpack buffers used by streamed video frames
+	struct StreamUpload
+	{
+		unsigned int mPBO;
+		size_t mPBOSize;
+		void *mFence; // set when the GPU may still read from mPBO
+	};
+	std::vector<StreamUpload> mStreamUploads;
+	size_t mStreamUploadIndex;
+	static void *MapStreamUpload(size_t size);
+	static void UnbindStreamUpload();
+	static int StreamYUVPlanes(RenderTarget *tgt, const FFMPEGCodec::Decoder::YUVPlanes& planes);
+	RenderTarget mStreamStaging; // decoded frames are top-down. flipped when blitted to the stage target
+	unsigned int mStreamPlanes[3]; // R8 textures for YUV frames, converted by mYUV2RGBShader
+	int mStreamPlaneWidths[3];
+	int mStreamPlaneHeights[3];
+	unsigned int mYUV2RGBShader;
+	int mYUV2RGBBT709Location; // uniforms changing per stream. Plane samplers are set at load
+	int mYUV2RGBFullRangeLocation;
 };
 
 extern Evaluation gEvaluation;
-extern FullScreenTriangle gFSQuad;
\ No newline at end of file
+extern FullScreenTriangle gFSQuad;
+extern RenderTargetPool gRenderTargetPool;
+extern NodeOutputCache gNodeOutputCache;
\ No newline at end of file
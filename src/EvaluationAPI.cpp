@@ -44,6 +44,8 @@
 #include "NodesDelegate.h"
 #include "cmft/print.h"
 #include "ffmpegCodec.h"
+#include "Profiler.h"
+#include "ImageCodec.h"
 
 extern enki::TaskScheduler g_TS;
 extern cmft::ClContext* clContext;
@@ -51,19 +53,35 @@ extern cmft::ClContext* clContext;
 static const unsigned int glInputFormats[] = {
 		GL_BGR,
 		GL_RGB,
-		GL_RGB16,
-		GL_RGB16F,
-		GL_RGB32F,
+		GL_RGB,
+		GL_RGB,
+		GL_RGB,
 		GL_RGBA, // RGBE
 
 		GL_BGRA,
 		GL_RGBA,
-		GL_RGBA16,
-		GL_RGBA16F,
-		GL_RGBA32F,
+		GL_RGBA,
+		GL_RGBA,
+		GL_RGBA,
 
 		GL_RGBA, // RGBM
 };
+static const unsigned int glInputTypes[] = {
+		GL_UNSIGNED_BYTE,
+		GL_UNSIGNED_BYTE,
+		GL_UNSIGNED_SHORT,
+		GL_HALF_FLOAT,
+		GL_FLOAT,
+		GL_UNSIGNED_BYTE, // RGBE
+
+		GL_UNSIGNED_BYTE,
+		GL_UNSIGNED_BYTE,
+		GL_UNSIGNED_SHORT,
+		GL_HALF_FLOAT,
+		GL_FLOAT,
+
+		GL_UNSIGNED_BYTE, // RGBM
+};
 static const unsigned int glInternalFormats[] = {
 	GL_RGB,
 	GL_RGB,
@@ -80,6 +98,23 @@ static const unsigned int glInternalFormats[] = {
 
 	GL_RGBA, // RGBM
 };
+// sized formats used for render target storages
+static const unsigned int glStorageFormats[] = {
+	GL_RGB8,
+	GL_RGB8,
+	GL_RGB16,
+	GL_RGB16F,
+	GL_RGB32F,
+	GL_RGBA8, // RGBE
+
+	GL_RGBA8,
+	GL_RGBA8,
+	GL_RGBA16,
+	GL_RGBA16F,
+	GL_RGBA32F,
+
+	GL_RGBA8, // RGBM
+};
 static const unsigned int glCubeFace[] = {
 	GL_TEXTURE_CUBE_MAP_POSITIVE_X,
 	GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
@@ -97,6 +132,225 @@ unsigned int GetTexelSize(uint8_t fmt)
 	return textureFormatSize[fmt];
 }
 
+// renderable format with the same precision. Used when an image is uploaded into a render target.
+static uint8_t GetRenderTargetFormat(uint8_t fmt)
+{
+	switch (fmt)
+	{
+	case TextureFormat::RGB16:
+	case TextureFormat::RGBA16:
+		return TextureFormat::RGBA16;
+	case TextureFormat::RGB16F:
+	case TextureFormat::RGBA16F:
+		return TextureFormat::RGBA16F;
+	case TextureFormat::RGB32F:
+	case TextureFormat::RGBA32F:
+		return TextureFormat::RGBA32F;
+	default:
+		return TextureFormat::RGBA8;
+	}
+}
+
+static void ToCmftImage(const Image *image, cmft::Image& img)
+{
+	img.m_data = image->mBits;
+	img.m_dataSize = image->mDataSize;
+	img.m_numMips = image->mNumMips;
+	img.m_numFaces = image->mNumFaces;
+	img.m_width = image->mWidth;
+	img.m_height = image->mHeight;
+	img.m_format = (cmft::TextureFormat::Enum)image->mFormat;
+}
+
+// stb writers expect 8 bits per component. Returns true when a converted copy was made in converted.
+static bool ConvertImage(const Image *image, uint8_t format, Image *converted, cmft::Image& convertedImg)
+{
+	*converted = *image;
+	if (image->mFormat == format)
+		return false;
+	cmft::Image src;
+	ToCmftImage(image, src);
+	cmft::imageConvert(convertedImg, (cmft::TextureFormat::Enum)format, src);
+	converted->mBits = (unsigned char*)convertedImg.m_data;
+	converted->mDataSize = convertedImg.m_dataSize;
+	converted->mFormat = format;
+	return true;
+}
+
+static bool Is8BitsFormat(uint8_t format)
+{
+	return format == TextureFormat::BGR8 || format == TextureFormat::RGB8 || format == TextureFormat::BGRA8 || format == TextureFormat::RGBA8;
+}
+
+RenderTargetPool gRenderTargetPool;
+
+bool RenderTargetPool::Key::operator < (const Key& other) const
+{
+	if (mWidth != other.mWidth)
+		return mWidth < other.mWidth;
+	if (mHeight != other.mHeight)
+		return mHeight < other.mHeight;
+	if (mFormat != other.mFormat)
+		return mFormat < other.mFormat;
+	if (mNumFaces != other.mNumFaces)
+		return mNumFaces < other.mNumFaces;
+	return mNumMips < other.mNumMips;
+}
+
+size_t RenderTargetPool::ComputeSize(const Key& key)
+{
+	size_t size = 0;
+	for (int i = 0; i < key.mNumMips; i++)
+		size += size_t(std::max(key.mWidth >> i, 1)) * size_t(std::max(key.mHeight >> i, 1)) * GetTexelSize(key.mFormat);
+	return size * key.mNumFaces;
+}
+
+bool RenderTargetPool::Acquire(const Key& key, Storage& storage)
+{
+	size_t size = ComputeSize(key);
+	mStatistics.mUsedCount++;
+	mStatistics.mUsedBytes += size;
+
+	auto iter = mFreeStorages.find(key);
+	if (iter != mFreeStorages.end())
+	{
+		storage = iter->second;
+		mFreeStorages.erase(iter);
+		mStatistics.mFreeCount--;
+		mStatistics.mFreeBytes -= size;
+		mStatistics.mReuseCount++;
+		return true;
+	}
+
+	mStatistics.mAllocationCount++;
+	mStatistics.mPeakCount = std::max(mStatistics.mPeakCount, mStatistics.mUsedCount + mStatistics.mFreeCount);
+	mStatistics.mPeakBytes = std::max(mStatistics.mPeakBytes, mStatistics.mUsedBytes + mStatistics.mFreeBytes);
+	return false;
+}
+
+void RenderTargetPool::Release(const Key& key, const Storage& storage)
+{
+	size_t size = ComputeSize(key);
+	mStatistics.mUsedCount--;
+	mStatistics.mUsedBytes -= size;
+
+	if (mStatistics.mFreeBytes + size > mMaxFreeBytes)
+	{
+		glDeleteTextures(1, &storage.mGLTexID);
+		glDeleteFramebuffers(1, &storage.mFbo);
+		return;
+	}
+	mFreeStorages.insert(std::make_pair(key, storage));
+	mStatistics.mFreeCount++;
+	mStatistics.mFreeBytes += size;
+}
+
+void RenderTargetPool::Clear()
+{
+	for (auto& freeStorage : mFreeStorages)
+	{
+		glDeleteTextures(1, &freeStorage.second.mGLTexID);
+		glDeleteFramebuffers(1, &freeStorage.second.mFbo);
+	}
+	mFreeStorages.clear();
+	mStatistics.mFreeCount = 0;
+	mStatistics.mFreeBytes = 0;
+}
+
+NodeOutputCache gNodeOutputCache;
+
+static size_t GetRenderTargetSize(const RenderTarget *target)
+{
+	const Image_t& image = target->mImage;
+	RenderTargetPool::Key key = { image.mWidth, image.mHeight, image.mFormat, image.mNumFaces, image.mNumMips };
+	return RenderTargetPool::ComputeSize(key);
+}
+
+bool NodeOutputCache::Fetch(uint64_t hash, RenderTarget *target, uint64_t targetHash)
+{
+	auto iter = mEntryPerHash.find(hash);
+	if (iter == mEntryPerHash.end())
+	{
+		mStatistics.mMissCount++;
+		return false;
+	}
+	mStatistics.mHitCount++;
+	auto entry = iter->second;
+	mEntryPerHash.erase(iter);
+	RenderTarget *cached = entry->mTarget;
+	mStatistics.mBytes -= entry->mSize;
+	mStatistics.mCount--;
+	mEntries.erase(entry);
+
+	target->Swap(*cached);
+	if (targetHash && cached->mGLTexID)
+	{
+		// reuse the entry for the previous content
+		Entry newEntry = { targetHash, cached, GetRenderTargetSize(cached) };
+		if (mEntryPerHash.find(targetHash) == mEntryPerHash.end())
+		{
+			mEntries.push_front(newEntry);
+			mEntryPerHash[targetHash] = mEntries.begin();
+			mStatistics.mBytes += newEntry.mSize;
+			mStatistics.mCount++;
+			Evict();
+			return true;
+		}
+	}
+	delete cached;
+	return true;
+}
+
+void NodeOutputCache::Store(uint64_t hash, RenderTarget *target)
+{
+	if (!target->mGLTexID)
+		return;
+	auto iter = mEntryPerHash.find(hash);
+	if (iter != mEntryPerHash.end())
+	{
+		// same content already cached
+		target->Destroy();
+		return;
+	}
+	RenderTarget *cached = new RenderTarget;
+	cached->Swap(*target);
+	Entry entry = { hash, cached, GetRenderTargetSize(cached) };
+	mEntries.push_front(entry);
+	mEntryPerHash[hash] = mEntries.begin();
+	mStatistics.mBytes += entry.mSize;
+	mStatistics.mCount++;
+	Evict();
+}
+
+void NodeOutputCache::Evict()
+{
+	while (!mEntries.empty() && mStatistics.mBytes > mMaxBytes)
+	{
+		Entry& entry = mEntries.back();
+		mStatistics.mBytes -= entry.mSize;
+		mStatistics.mCount--;
+		mEntryPerHash.erase(entry.mHash);
+		delete entry.mTarget;
+		mEntries.pop_back();
+	}
+}
+
+void NodeOutputCache::Clear()
+{
+	for (auto& entry : mEntries)
+		delete entry.mTarget;
+	mEntries.clear();
+	mEntryPerHash.clear();
+	mStatistics.mCount = 0;
+	mStatistics.mBytes = 0;
+}
+
+void RenderTarget::Swap(RenderTarget& other)
+{
+	std::swap(mImage, other.mImage);
+	std::swap(mGLTexID, other.mGLTexID);
+	std::swap(mFbo, other.mFbo);
+}
 
 void RenderTarget::BindAsTarget() const
 {
@@ -116,45 +370,78 @@ void RenderTarget::BindCubeFace(size_t face)
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GLenum(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face), mGLTexID, 0);
 }
 
+void RenderTarget::BindAsLayeredCubeTarget()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mGLTexID, 0);
+	glViewport(0, 0, mImage.mWidth, mImage.mHeight);
+}
+
 void RenderTarget::Destroy()
 {
 	if (mGLTexID)
-		glDeleteTextures(1, &mGLTexID);
-	if (mFbo)
-		glDeleteFramebuffers(1, &mFbo);
+	{
+		RenderTargetPool::Key key = { mImage.mWidth, mImage.mHeight, mImage.mFormat, mImage.mNumFaces, mImage.mNumMips };
+		RenderTargetPool::Storage storage = { mGLTexID, mFbo };
+		gRenderTargetPool.Release(key, storage);
+	}
 	mFbo = 0;
 	mImage.mWidth = mImage.mHeight = 0;
 	mGLTexID = 0;
 }
 
-void RenderTarget::InitBuffer(int width, int height)
+bool RenderTarget::Allocate(int width, int height, uint8_t format, uint8_t numFaces, uint8_t numMips)
 {
-	if ((width == mImage.mWidth) && (mImage.mHeight == height) && mImage.mNumFaces == 1)
-		return;
-	Destroy();
-
 	mImage.mWidth = width;
 	mImage.mHeight = height;
-	mImage.mNumMips = 1;
-	mImage.mNumFaces = 1;
-	mImage.mFormat = TextureFormat::RGBA8;
+	mImage.mNumMips = numMips;
+	mImage.mNumFaces = numFaces;
+	mImage.mFormat = format;
+
+	unsigned int textureTarget = (numFaces == 6) ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	RenderTargetPool::Key key = { width, height, format, numFaces, numMips };
+	RenderTargetPool::Storage storage;
+	bool pooled = gRenderTargetPool.Acquire(key, storage);
+	if (pooled)
+	{
+		mGLTexID = storage.mGLTexID;
+		mFbo = storage.mFbo;
+		glBindTexture(textureTarget, mGLTexID);
+	}
+	else
+	{
+		glGenFramebuffers(1, &mFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
 
-	glGenFramebuffers(1, &mFbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
+		// immutable storage, never respecified. Uploads use glTexSubImage2D.
+		glGenTextures(1, &mGLTexID);
+		glBindTexture(textureTarget, mGLTexID);
+		glTexStorage2D(textureTarget, numMips, glStorageFormats[format], width, height);
 
-	// diffuse
-	glGenTextures(1, &mGLTexID);
-	glBindTexture(GL_TEXTURE_2D, mGLTexID);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	TexParam(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mGLTexID, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, (numFaces == 6) ? GL_TEXTURE_CUBE_MAP_POSITIVE_X : GL_TEXTURE_2D, mGLTexID, 0);
 
-	static const GLenum DrawBuffers[] = { GL_COLOR_ATTACHMENT0 };
-	glDrawBuffers(sizeof(DrawBuffers) / sizeof(GLenum), DrawBuffers);
+		static const GLenum DrawBuffers[] = { GL_COLOR_ATTACHMENT0 };
+		glDrawBuffers(sizeof(DrawBuffers) / sizeof(GLenum), DrawBuffers);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	CheckFBO();
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		CheckFBO();
+	}
+
+	if (numFaces == 6)
+		TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
+	else
+		TexParam(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+	return pooled;
+}
+
+void RenderTarget::InitBuffer(int width, int height, uint8_t format, uint8_t numMips)
+{
+	if (mGLTexID && (width == mImage.mWidth) && (mImage.mHeight == height) && mImage.mNumFaces == 1 && mImage.mFormat == format && mImage.mNumMips == numMips)
+		return;
+	Destroy();
+	Allocate(width, height, format, 1, numMips);
 
+	// pooled storages keep their previous content
 	GLint last_viewport[4]; glGetIntegerv(GL_VIEWPORT, last_viewport);
 	BindAsTarget();
 	glClearColor(0, 0, 0, 0);
@@ -163,33 +450,60 @@ void RenderTarget::InitBuffer(int width, int height)
 	glViewport(last_viewport[0], last_viewport[1], (GLsizei)last_viewport[2], (GLsizei)last_viewport[3]);
 }
 
-void RenderTarget::InitCube(int width)
+void RenderTarget::InitCube(int width, uint8_t format, uint8_t numMips)
 {
-	if ( (width == mImage.mWidth) && (mImage.mHeight == width) && mImage.mNumFaces == 6)
+	if (mGLTexID && (width == mImage.mWidth) && (mImage.mHeight == width) && mImage.mNumFaces == 6 && mImage.mFormat == format && mImage.mNumMips == numMips)
 		return;
 	Destroy();
+	if (!Allocate(width, width, format, 6, numMips))
+		return;
 
-	mImage.mWidth = width;
-	mImage.mHeight = width;
-	mImage.mNumMips = 1;
-	mImage.mNumFaces = 6;
-	mImage.mFormat = TextureFormat::RGBA8;
+	// pooled storages keep their previous content. Faces uploaded one at a time must not show it
+	GLint last_viewport[4]; glGetIntegerv(GL_VIEWPORT, last_viewport);
+	BindAsLayeredCubeTarget();
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	BindCubeFace(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(last_viewport[0], last_viewport[1], (GLsizei)last_viewport[2], (GLsizei)last_viewport[3]);
+}
 
-	glGenFramebuffers(1, &mFbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
+uint8_t RenderTarget::GetFullMipCount(int width, int height)
+{
+	uint8_t count = 1;
+	for (int size = std::max(width, height); size > 1; size >>= 1)
+		count++;
+	return count;
+}
 
-	glGenTextures(1, &mGLTexID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, mGLTexID);
-	
-	for (int i = 0; i < 6; i++)
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA8, width, width, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		
+void RenderTarget::EnsureMipChain()
+{
+	uint8_t numMips = GetFullMipCount(mImage.mWidth, mImage.mHeight);
+	if (!mGLTexID || mImage.mNumMips >= numMips)
+		return;
 
-	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
+	unsigned int textureTarget = (mImage.mNumFaces == 6) ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	RenderTarget mipmapped;
+	mipmapped.Allocate(mImage.mWidth, mImage.mHeight, mImage.mFormat, mImage.mNumFaces, numMips);
+	glCopyImageSubData(mGLTexID, textureTarget, 0, 0, 0, 0, mipmapped.mGLTexID, textureTarget, 0, 0, 0, 0, mImage.mWidth, mImage.mHeight, mImage.mNumFaces);
+	Swap(mipmapped);
+	GenerateMips();
+}
 
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, mGLTexID, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	CheckFBO();
+uint8_t RenderTarget::GetReusableMipCount(int width, int height, uint8_t format, uint8_t numFaces, uint8_t numMips) const
+{
+	if (mGLTexID && mImage.mWidth == width && mImage.mHeight == height && mImage.mFormat == format && mImage.mNumFaces == numFaces)
+		return std::max(numMips, mImage.mNumMips);
+	return numMips;
+}
+
+void RenderTarget::GenerateMips()
+{
+	if (!mGLTexID || mImage.mNumMips < 2)
+		return;
+	unsigned int textureTarget = (mImage.mNumFaces == 6) ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	glBindTexture(textureTarget, mGLTexID);
+	glGenerateMipmap(textureTarget);
 }
 
 void RenderTarget::CheckFBO()
@@ -243,9 +557,19 @@ void Evaluation::APIInit()
 {
 	std::ifstream prgStr("Stock/ProgressingNode.glsl");
 	std::ifstream cubStr("Stock/DisplayCubemap.glsl");
+	std::ifstream yuvStr("Stock/YUV2RGB.glsl");
 
 	mProgressShader = prgStr.good() ? LoadShader(std::string(std::istreambuf_iterator<char>(prgStr), std::istreambuf_iterator<char>()), "progressShader") : 0;
 	mDisplayCubemapShader = cubStr.good() ? LoadShader(std::string(std::istreambuf_iterator<char>(cubStr), std::istreambuf_iterator<char>()), "cubeDisplay") : 0;
+	mYUV2RGBShader = yuvStr.good() ? LoadShader(std::string(std::istreambuf_iterator<char>(yuvStr), std::istreambuf_iterator<char>()), "yuv2rgb") : 0;
+	if (mYUV2RGBShader)
+	{
+		static const char *planeSamplers[] = { "samplerY", "samplerU", "samplerV" };
+		for (int i = 0; i < 3; i++)
+			glProgramUniform1i(mYUV2RGBShader, glGetUniformLocation(mYUV2RGBShader, planeSamplers[i]), i);
+		mYUV2RGBBT709Location = glGetUniformLocation(mYUV2RGBShader, "bt709");
+		mYUV2RGBFullRangeLocation = glGetUniformLocation(mYUV2RGBShader, "fullRange");
+	}
 }
 
 static Image_t DecodeImage(FFMPEGCodec::Decoder *decoder, int frame)
@@ -283,11 +607,6 @@ static Image_t DecodeImage(FFMPEGCodec::Decoder *decoder, int frame)
 	return image;
 }
 
-Image_t EvaluationStage::DecodeImage()
-{
-	return ::DecodeImage(mDecoder.get(), mLocalTime);
-}
-
 int Evaluation::ReadImage(const char *filename, Image *image)
 {
 #if __linux__ || __unix__
@@ -341,28 +660,42 @@ int Evaluation::ReadImageMem(unsigned char *data, size_t dataSize, Image *image)
 
 int Evaluation::WriteImage(const char *filename, Image *image, int format, int quality)
 {
-	int components = textureComponentCount[image->mFormat];
+	// ldr and hdr writers only handle plain 8 bits or 32 bits float images
+	Image source;
+	cmft::Image convertedImg;
+	bool converted = false;
+	if (format <= 3 && !Is8BitsFormat(image->mFormat))
+		converted = ConvertImage(image, TextureFormat::RGBA8, &source, convertedImg);
+	else if (format == 7)
+		converted = ConvertImage(image, TextureFormat::RGBA8, &source, convertedImg);
+	else if (format == 4 && image->mFormat != TextureFormat::RGB32F)
+		converted = ConvertImage(image, TextureFormat::RGBA32F, &source, convertedImg);
+	else
+		source = *image;
+
+	int components = textureComponentCount[source.mFormat];
+	int res = EVAL_OK;
 	switch (format)
 	{
 	case 0:
-		if (!stbi_write_jpg(filename, image->mWidth, image->mHeight, components, image->mBits, quality))
-			return EVAL_ERR;
+		if (!stbi_write_jpg(filename, source.mWidth, source.mHeight, components, source.mBits, quality))
+			res = EVAL_ERR;
 		break;
 	case 1:
-		if (!stbi_write_png(filename, image->mWidth, image->mHeight, components, image->mBits, image->mWidth * components))
-			return EVAL_ERR;
+		if (!stbi_write_png(filename, source.mWidth, source.mHeight, components, source.mBits, source.mWidth * components))
+			res = EVAL_ERR;
 		break;
 	case 2:
-		if (!stbi_write_tga(filename, image->mWidth, image->mHeight, components, image->mBits))
-			return EVAL_ERR;
+		if (!stbi_write_tga(filename, source.mWidth, source.mHeight, components, source.mBits))
+			res = EVAL_ERR;
 		break;
 	case 3:
-		if (!stbi_write_bmp(filename, image->mWidth, image->mHeight, components, image->mBits))
-			return EVAL_ERR;
+		if (!stbi_write_bmp(filename, source.mWidth, source.mHeight, components, source.mBits))
+			res = EVAL_ERR;
 		break;
 	case 4:
-		//if (stbi_write_hdr(filename, image->width, image->height, image->components, image->bits))
-			return EVAL_ERR;
+		if (!stbi_write_hdr(filename, source.mWidth, source.mHeight, components, (float*)source.mBits))
+			res = EVAL_ERR;
 		break;
 	case 5:
 	{
@@ -400,58 +733,330 @@ int Evaluation::WriteImage(const char *filename, Image *image, int format, int q
 	case 7:
 	{
 		FFMPEGCodec::Encoder *encoder = gCurrentContext->GetEncoder(std::string(filename), image->mWidth, image->mHeight);
-		std::string fn(filename);
-		encoder->AddFrame(image->mBits, image->mWidth, image->mHeight);
+		// the encoder thread owns the frame bits
+		unsigned char *bits = image->mBits;
+		if (converted)
+		{
+			bits = (unsigned char*)malloc(source.mDataSize);
+			memcpy(bits, source.mBits, source.mDataSize);
+		}
+		else
+		{
+			image->mBits = NULL;
+		}
+		encoder->PushFrame(bits, source.mWidth, source.mHeight);
 	}
 		break;
 	}
+	if (converted)
+		cmft::imageUnload(convertedImg);
+	return res;
+}
+
+int Evaluation::SetEncoderParameters(const char *filename, EncoderParameters *parameters)
+{
+	if (!filename || !parameters)
+		return EVAL_ERR;
+	gCurrentContext->SetEncoderParameters(std::string(filename), *parameters);
 	return EVAL_OK;
 }
 
 int Evaluation::GetEvaluationImage(int target, Image *image)
 {
-	if (target == -1 || target >= gEvaluation.mEvaluationStages.size())
+	int readback = BeginEvaluationImageRead(target);
+	if (readback == -1)
 		return EVAL_ERR;
+	return EndEvaluationImageRead(readback, image);
+}
 
-	RenderTarget& tgt = *gCurrentContext->GetRenderTarget(target);
+int Evaluation::BeginEvaluationImageRead(int target)
+{
+	if (target == -1 || target >= gEvaluation.mEvaluationStages.size())
+		return -1;
+
+	RenderTarget* renderTarget = gCurrentContext->GetRenderTarget(target);
+	if (!renderTarget || !renderTarget->mGLTexID)
+		return -1;
+	RenderTarget& tgt = *renderTarget;
 
 	// compute total size
 	Image_t& img = tgt.mImage;
 	unsigned int texelSize = GetTexelSize(img.mFormat);
-	unsigned int texelFormat = glInternalFormats[img.mFormat];
-	uint32_t size = 0;// img.mNumFaces * img.mWidth * img.mHeight * texelSize;
-	for (int i = 0;i<img.mNumMips;i++)
-		size += img.mNumFaces * (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
-
-	image->mBits = (unsigned char*)malloc(size);
-	image->mDataSize = size;
-	image->mWidth = img.mWidth;
-	image->mHeight = img.mHeight;
-	image->mNumMips = img.mNumMips;
-	image->mFormat = img.mFormat;
-	image->mNumFaces = img.mNumFaces;
-
-	glBindTexture(GL_TEXTURE_2D, tgt.mGLTexID);
-	unsigned char *ptr = (unsigned char *)image->mBits;
+	unsigned int texelFormat = glInputFormats[img.mFormat];
+	unsigned int texelType = glInputTypes[img.mFormat];
+	uint32_t size = 0;
+	for (int i = 0; i < img.mNumMips; i++)
+		size += img.mNumFaces * std::max(img.mWidth >> i, 1) * std::max(img.mHeight >> i, 1) * texelSize;
+
+	auto& readbacks = gEvaluation.mReadbacks;
+	size_t readbackIndex = 0;
+	for (; readbackIndex < readbacks.size(); readbackIndex++)
+	{
+		if (!readbacks[readbackIndex].mbInUse)
+			break;
+	}
+	if (readbackIndex == readbacks.size())
+	{
+		ImageReadback newReadback = {};
+		glGenBuffers(1, &newReadback.mPBO);
+		readbacks.push_back(newReadback);
+	}
+	ImageReadback& readback = readbacks[readbackIndex];
+	readback.mbInUse = true;
+	readback.mImage = img;
+	readback.mImage.mBits = NULL;
+	readback.mImage.mDecoder = NULL;
+	readback.mImage.mDataSize = size;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.mPBO);
+	if (readback.mPBOSize < size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		readback.mPBOSize = size;
+	}
+
+	// with a pack buffer bound, the pointer is an offset in the buffer
+	size_t offset = 0;
 	if (img.mNumFaces == 1)
 	{
+		glBindTexture(GL_TEXTURE_2D, tgt.mGLTexID);
 		for (int i = 0; i < img.mNumMips; i++)
 		{
-			glGetTexImage(GL_TEXTURE_2D, i, texelFormat, GL_UNSIGNED_BYTE, ptr);
-			ptr += (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
+			glGetTexImage(GL_TEXTURE_2D, i, texelFormat, texelType, (void*)offset);
+			offset += std::max(img.mWidth >> i, 1) * std::max(img.mHeight >> i, 1) * texelSize;
 		}
 	}
 	else
 	{
+		glBindTexture(GL_TEXTURE_CUBE_MAP, tgt.mGLTexID);
 		for (int cube = 0; cube < img.mNumFaces; cube++)
 		{
 			for (int i = 0; i < img.mNumMips; i++)
 			{
-				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X+cube, i, texelFormat, GL_UNSIGNED_BYTE, ptr);
-				ptr += (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
+				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cube, i, texelFormat, texelType, (void*)offset);
+				offset += std::max(img.mWidth >> i, 1) * std::max(img.mHeight >> i, 1) * texelSize;
 			}
 		}
 	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	return int(readbackIndex);
+}
+
+int Evaluation::PollEvaluationImageRead(int readback)
+{
+	auto& readbacks = gEvaluation.mReadbacks;
+	if (readback < 0 || readback >= int(readbacks.size()) || !readbacks[readback].mbInUse)
+		return EVAL_ERR;
+
+	GLenum res = glClientWaitSync((GLsync)readbacks[readback].mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if (res == GL_ALREADY_SIGNALED || res == GL_CONDITION_SATISFIED)
+		return EVAL_OK;
+	return (res == GL_WAIT_FAILED) ? EVAL_ERR : EVAL_PENDING;
+}
+
+int Evaluation::EndEvaluationImageRead(int readback, Image *image)
+{
+	auto& readbacks = gEvaluation.mReadbacks;
+	if (readback < 0 || readback >= int(readbacks.size()) || !readbacks[readback].mbInUse)
+		return EVAL_ERR;
+	ImageReadback& rb = readbacks[readback];
+
+	GLenum res;
+	do
+	{
+		res = glClientWaitSync((GLsync)rb.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	} while (res == GL_TIMEOUT_EXPIRED);
+	glDeleteSync((GLsync)rb.mFence);
+	rb.mFence = NULL;
+	rb.mbInUse = false;
+	if (res == GL_WAIT_FAILED)
+		return EVAL_ERR;
+
+	*image = rb.mImage;
+	image->mBits = (unsigned char*)malloc(rb.mImage.mDataSize);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.mPBO);
+	void *ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rb.mImage.mDataSize, GL_MAP_READ_BIT);
+	if (ptr)
+	{
+		memcpy(image->mBits, ptr, rb.mImage.mDataSize);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return ptr ? EVAL_OK : EVAL_ERR;
+}
+
+static const size_t StreamUploadRingSize = 3;
+
+// returns a write pointer in the next buffer of the ring. The buffer stays bound to GL_PIXEL_UNPACK_BUFFER
+void *Evaluation::MapStreamUpload(size_t size)
+{
+	auto& uploads = gEvaluation.mStreamUploads;
+	if (uploads.empty())
+	{
+		uploads.resize(StreamUploadRingSize);
+		memset(uploads.data(), 0, sizeof(StreamUpload) * uploads.size());
+		gEvaluation.mStreamUploadIndex = 0;
+	}
+	StreamUpload& upload = uploads[gEvaluation.mStreamUploadIndex];
+
+	// slot is reused every StreamUploadRingSize frames. Only wait if the GPU is that late
+	if (upload.mFence)
+	{
+		GLenum res;
+		do
+		{
+			res = glClientWaitSync((GLsync)upload.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while (res == GL_TIMEOUT_EXPIRED);
+		glDeleteSync((GLsync)upload.mFence);
+		upload.mFence = NULL;
+	}
+	if (!upload.mPBO)
+		glGenBuffers(1, &upload.mPBO);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.mPBO);
+	if (upload.mPBOSize < size)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		upload.mPBOSize = size;
+	}
+	void *ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (!ptr)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return ptr;
+}
+
+// call once the texture uploads from the mapped buffer are issued
+void Evaluation::UnbindStreamUpload()
+{
+	StreamUpload& upload = gEvaluation.mStreamUploads[gEvaluation.mStreamUploadIndex];
+	gEvaluation.mStreamUploadIndex = (gEvaluation.mStreamUploadIndex + 1) % gEvaluation.mStreamUploads.size();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	upload.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+int Evaluation::StreamYUVPlanes(RenderTarget *tgt, const FFMPEGCodec::Decoder::YUVPlanes& planes)
+{
+	size_t planeSizes[3];
+	size_t imgDataSize = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		planeSizes[i] = size_t(planes.mWidths[i]) * planes.mHeights[i];
+		imgDataSize += planeSizes[i];
+	}
+	unsigned char *ptr = (unsigned char*)MapStreamUpload(imgDataSize);
+	if (!ptr)
+		return EVAL_ERR;
+	for (int i = 0; i < 3; i++)
+	{
+		memcpy(ptr, planes.mPlanes[i], planeSizes[i]);
+		ptr += planeSizes[i];
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	size_t offset = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		unsigned int& texture = gEvaluation.mStreamPlanes[i];
+		if (!texture || gEvaluation.mStreamPlaneWidths[i] != planes.mWidths[i] || gEvaluation.mStreamPlaneHeights[i] != planes.mHeights[i])
+		{
+			if (texture)
+				glDeleteTextures(1, &texture);
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, planes.mWidths[i], planes.mHeights[i]);
+			TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+			gEvaluation.mStreamPlaneWidths[i] = planes.mWidths[i];
+			gEvaluation.mStreamPlaneHeights[i] = planes.mHeights[i];
+		}
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, planes.mWidths[i], planes.mHeights[i], GL_RED, GL_UNSIGNED_BYTE, (void*)offset);
+		offset += planeSizes[i];
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	UnbindStreamUpload();
+
+	GLint last_viewport[4]; glGetIntegerv(GL_VIEWPORT, last_viewport);
+	tgt->InitBuffer(planes.mWidths[0], planes.mHeights[0], TextureFormat::RGBA8, tgt->GetReusableMipCount(planes.mWidths[0], planes.mHeights[0], TextureFormat::RGBA8, 1, 1));
+	tgt->BindAsTarget();
+	unsigned int program = gEvaluation.mYUV2RGBShader;
+	glUseProgram(program);
+	for (int i = 0; i < 3; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, gEvaluation.mStreamPlanes[i]);
+	}
+	glUniform1i(gEvaluation.mYUV2RGBBT709Location, planes.mbBT709 ? 1 : 0);
+	glUniform1i(gEvaluation.mYUV2RGBFullRangeLocation, planes.mbFullRange ? 1 : 0);
+	gFSQuad.Render();
+	glActiveTexture(GL_TEXTURE0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(last_viewport[0], last_viewport[1], (GLsizei)last_viewport[2], (GLsizei)last_viewport[3]);
+
+	glBindTexture(GL_TEXTURE_2D, tgt->mGLTexID);
+	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+	tgt->GenerateMips();
+	return EVAL_OK;
+}
+
+int Evaluation::StreamEvaluationImage(int target, FFMPEGCodec::Decoder *decoder, int frame)
+{
+	RenderTarget *tgt = gCurrentContext->GetRenderTarget(target);
+	if (!tgt || !decoder)
+		return EVAL_ERR;
+	if (!decoder->ReadFrame(frame))
+	{
+		Log("error: ReadFrame failed\n");
+		return EVAL_ERR;
+	}
+	gCurrentContext->InvalidateStageHash(target);
+
+	// planes are converted by a shader, swscale is not involved
+	FFMPEGCodec::Decoder::YUVPlanes planes;
+	if (gEvaluation.mYUV2RGBShader && decoder->GetYUVPlanes(planes))
+	{
+		if (StreamYUVPlanes(tgt, planes) != EVAL_OK)
+			return EVAL_ERR;
+		// children use the new frame, like SetEvaluationImage
+		gCurrentContext->SetTargetDirty(target, true);
+		return EVAL_OK;
+	}
+
+	const unsigned char *src = (const unsigned char*)decoder->GetRGBData();
+	if (!src)
+		return EVAL_ERR;
+	int width = int(decoder->mWidth);
+	int height = int(decoder->mHeight);
+	size_t imgDataSize = size_t(width) * height * 3;
+
+	void *ptr = MapStreamUpload(imgDataSize);
+	if (!ptr)
+		return EVAL_ERR;
+	memcpy(ptr, src, imgDataSize);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	// with an unpack buffer bound, the pointer is an offset in the buffer
+	RenderTarget& staging = gEvaluation.mStreamStaging;
+	staging.InitBuffer(width, height, TextureFormat::RGBA8);
+	glBindTexture(GL_TEXTURE_2D, staging.mGLTexID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void*)0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	UnbindStreamUpload();
+
+	// inverted source rectangle puts the first decoded row at v = 1
+	tgt->InitBuffer(width, height, TextureFormat::RGBA8, tgt->GetReusableMipCount(width, height, TextureFormat::RGBA8, 1, 1));
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, staging.mFbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, tgt->mFbo);
+	glBlitFramebuffer(0, height, width, 0, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glBindTexture(GL_TEXTURE_2D, tgt->mGLTexID);
+	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+	tgt->GenerateMips();
+	gCurrentContext->SetTargetDirty(target, true);
 	return EVAL_OK;
 }
 
@@ -461,50 +1066,64 @@ int Evaluation::SetEvaluationImage(int target, Image *image)
 	RenderTarget *tgt = gCurrentContext->GetRenderTarget(target);
 	if (!tgt)
 		return EVAL_ERR;
+	gCurrentContext->InvalidateStageHash(target);
+	SetRenderTargetImage(tgt, image);
+	if (stage.mDecoder.get() != (FFMPEGCodec::Decoder*)image->mDecoder)
+		stage.mDecoder = std::shared_ptr<FFMPEGCodec::Decoder>((FFMPEGCodec::Decoder*)image->mDecoder);
+	gCurrentContext->SetTargetDirty(target, true);
+	return EVAL_OK;
+}
+
+int Evaluation::SetRenderTargetImage(RenderTarget *tgt, const Image *image)
+{
 	unsigned int texelSize = GetTexelSize(image->mFormat);
 	unsigned int inputFormat = glInputFormats[image->mFormat];
-	unsigned int internalFormat = glInternalFormats[image->mFormat];
-	unsigned char *ptr = (unsigned char *)image->mBits;
+	unsigned int inputType = glInputTypes[image->mFormat];
+	uint8_t targetFormat = GetRenderTargetFormat(image->mFormat);
+	const unsigned char *ptr = image->mBits;
 	if (image->mNumFaces == 1)
 	{
-		tgt->InitBuffer(image->mWidth, image->mHeight);
+		tgt->InitBuffer(image->mWidth, image->mHeight, targetFormat, tgt->GetReusableMipCount(image->mWidth, image->mHeight, targetFormat, 1, image->mNumMips));
 
 		glBindTexture(GL_TEXTURE_2D, tgt->mGLTexID);
 
 		for (int i = 0; i < image->mNumMips; i++)
 		{
-			glTexImage2D(GL_TEXTURE_2D, i, internalFormat, image->mWidth >> i, image->mHeight >> i, 0, inputFormat, GL_UNSIGNED_BYTE, ptr);
-			ptr += (image->mWidth >> i) * (image->mHeight >> i) * texelSize;
+			int mipWidth = std::max(image->mWidth >> i, 1);
+			int mipHeight = std::max(image->mHeight >> i, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, mipWidth, mipHeight, inputFormat, inputType, ptr);
+			ptr += mipWidth * mipHeight * texelSize;
 		}
 
-		if (image->mNumMips > 1)
+		if (tgt->mImage.mNumMips > 1)
 			TexParam(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
 		else
 			TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
 	}
 	else
 	{
-		tgt->InitCube(image->mWidth);
+		tgt->InitCube(image->mWidth, targetFormat, tgt->GetReusableMipCount(image->mWidth, image->mWidth, targetFormat, 6, image->mNumMips));
 		glBindTexture(GL_TEXTURE_CUBE_MAP, tgt->mGLTexID);
 
 		for (int face = 0; face < image->mNumFaces; face++)
 		{
 			for (int i = 0; i < image->mNumMips; i++)
 			{
-				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, i, internalFormat, image->mWidth >> i, image->mWidth >> i, 0, inputFormat, GL_UNSIGNED_BYTE, ptr);
-				ptr += (image->mWidth >> i) * (image->mWidth >> i) * texelSize;
+				int mipWidth = std::max(image->mWidth >> i, 1);
+				glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, i, 0, 0, mipWidth, mipWidth, inputFormat, inputType, ptr);
+				ptr += mipWidth * mipWidth * texelSize;
 			}
 		}
 
-		if (image->mNumMips > 1)
+		if (tgt->mImage.mNumMips > 1)
 			TexParam(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
 		else
 			TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
 
 	}
-	if (stage.mDecoder.get() != (FFMPEGCodec::Decoder*)image->mDecoder)
-		stage.mDecoder = std::shared_ptr<FFMPEGCodec::Decoder>((FFMPEGCodec::Decoder*)image->mDecoder);
-	gCurrentContext->SetTargetDirty(target, true);
+	// levels the image doesn't have
+	if (tgt->mImage.mNumMips > image->mNumMips)
+		tgt->GenerateMips();
 	return EVAL_OK;
 }
 
@@ -512,11 +1131,18 @@ int Evaluation::SetEvaluationImageCube(int target, Image *image, int cubeFace)
 {
 	if (image->mNumFaces != 1)
 		return EVAL_ERR;
-	RenderTarget& tgt = *gCurrentContext->GetRenderTarget(target);
+	RenderTarget* tgt = gCurrentContext->GetRenderTarget(target);
+	if (!tgt)
+		return EVAL_ERR;
 
-	tgt.InitCube(image->mWidth);
+	uint8_t targetFormat = GetRenderTargetFormat(image->mFormat);
+	tgt->InitCube(image->mWidth, targetFormat, tgt->GetReusableMipCount(image->mWidth, image->mWidth, targetFormat, 6, 1));
+	gCurrentContext->InvalidateStageHash(target);
 
-	UploadImage(image, tgt.mGLTexID, cubeFace);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, tgt->mGLTexID);
+	glTexSubImage2D(glCubeFace[cubeFace], 0, 0, 0, image->mWidth, image->mWidth, glInputFormats[image->mFormat], glInputTypes[image->mFormat], image->mBits);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	tgt->GenerateMips();
 	gCurrentContext->SetTargetDirty(target, true);
 	return EVAL_OK;
 }
@@ -574,9 +1200,15 @@ int Evaluation::FreeImage(Image *image)
 
 int Evaluation::EncodePng(Image *image, std::vector<unsigned char> &pngImage)
 {
+	Image source;
+	cmft::Image convertedImg;
+	bool converted = ConvertImage(image, TextureFormat::RGBA8, &source, convertedImg);
+
 	int outlen;
-	int components = 4; // TODO
-	unsigned char *bits = stbi_write_png_to_mem((unsigned char*)image->mBits, image->mWidth * components, image->mWidth, image->mHeight, components, &outlen);
+	int components = 4;
+	unsigned char *bits = stbi_write_png_to_mem((unsigned char*)source.mBits, source.mWidth * components, source.mWidth, source.mHeight, components, &outlen);
+	if (converted)
+		cmft::imageUnload(convertedImg);
 	if (!bits)
 		return EVAL_ERR;
 	pngImage.resize(outlen);
@@ -586,10 +1218,41 @@ int Evaluation::EncodePng(Image *image, std::vector<unsigned char> &pngImage)
 	return EVAL_OK;
 }
 
+int Evaluation::EncodeImageBlob(Image *image, std::vector<unsigned char> &blob)
+{
+	Image source;
+	cmft::Image convertedImg;
+	bool converted = ConvertImage(image, TextureFormat::RGBA8, &source, convertedImg);
+
+	bool encoded = ImageCodecEncode(source.mBits, source.mWidth, source.mHeight, blob);
+	if (converted)
+		cmft::imageUnload(convertedImg);
+	return encoded ? EVAL_OK : EVAL_ERR;
+}
+
+int Evaluation::DecodeImageBlob(const unsigned char *data, size_t dataSize, Image *image)
+{
+	int components = 4;
+	unsigned char *bits;
+	if (IsImageCodecBlob(data, dataSize))
+		bits = ImageCodecDecode(data, dataSize, &image->mWidth, &image->mHeight);
+	else
+		bits = stbi_load_from_memory(data, int(dataSize), &image->mWidth, &image->mHeight, &components, 0);
+	if (!bits)
+		return EVAL_ERR;
+	image->mBits = bits;
+	image->mDataSize = image->mWidth * image->mHeight * components;
+	image->mNumMips = 1;
+	image->mNumFaces = 1;
+	image->mFormat = (components == 3) ? TextureFormat::RGB8 : TextureFormat::RGBA8;
+	image->mDecoder = NULL;
+	return EVAL_OK;
+}
+
 int Evaluation::SetThumbnailImage(Image *image)
 {
-	std::vector<unsigned char> pngImage;
-	if (EncodePng(image, pngImage) == EVAL_ERR)
+	std::vector<unsigned char> blob;
+	if (EncodeImageBlob(image, blob) == EVAL_ERR)
 		return EVAL_ERR;
 
 	extern Library library;
@@ -597,15 +1260,16 @@ int Evaluation::SetThumbnailImage(Image *image)
 
 	int materialIndex = imogen.GetCurrentMaterialIndex();
 	Material & material = library.mMaterials[materialIndex];
-	material.mThumbnail = pngImage;
-	material.mThumbnailTextureId = 0;
+	material.mThumbnail = blob;
+	material.mThumbnailHandle = 0;
+	material.mChunk.mbDirty = true;
 	return EVAL_OK;
 }
 
 int Evaluation::SetNodeImage(int target, Image *image)
 {
-	std::vector<unsigned char> pngImage;
-	if (EncodePng(image, pngImage) == EVAL_ERR)
+	std::vector<unsigned char> blob;
+	if (EncodeImageBlob(image, blob) == EVAL_ERR)
 		return EVAL_ERR;
 
 	extern Library library;
@@ -613,28 +1277,45 @@ int Evaluation::SetNodeImage(int target, Image *image)
 
 	int materialIndex = imogen.GetCurrentMaterialIndex();
 	Material & material = library.mMaterials[materialIndex];
-	material.mMaterialNodes[target].mImage = pngImage;
+	material.mMaterialNodes[target].mImage = blob;
+	material.mChunk.mbDirty = true;
 
 	return EVAL_OK;
 }
 
 typedef int(*jobFunction)(void*);
 
+// jobs are profiled with the node that spawned them
+static size_t GetJobTarget()
+{
+	return size_t(gCurrentContext->GetEvaluationInfo().targetIndex);
+}
+
+static const char *GetJobName(size_t target)
+{
+	return gMetaNodes[gEvaluation.GetStageType(target)].mName.c_str();
+}
+
 struct CFunctionTaskSet : enki::ITaskSet
 {
 	CFunctionTaskSet(jobFunction function, void *ptr, unsigned int size) : enki::ITaskSet()
 		, mFunction(function)
 		, mBuffer(malloc(size))
+		, mTarget(GetJobTarget())
 	{
 		memcpy(mBuffer, ptr, size);
 	}
 	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
 	{
-		mFunction(mBuffer);
+		{
+			Profiler::CPUScope jobScope(mTarget, GetJobName(mTarget), Profiler::Sample_Job);
+			mFunction(mBuffer);
+		}
 		free(mBuffer);
 	}
 	jobFunction mFunction;
 	void *mBuffer;
+	size_t mTarget;
 };
 
 struct CFunctionMainTask : enki::IPinnedTask
@@ -643,16 +1324,21 @@ struct CFunctionMainTask : enki::IPinnedTask
 		: enki::IPinnedTask(0) // set pinned thread to 0
 		, mFunction(function)
 		, mBuffer(malloc(size))
+		, mTarget(GetJobTarget())
 	{
 		memcpy(mBuffer, ptr, size);
 	}
 	virtual void Execute()
 	{
-		mFunction(mBuffer);
+		{
+			Profiler::CPUScope jobScope(mTarget, GetJobName(mTarget), Profiler::Sample_Job);
+			mFunction(mBuffer);
+		}
 		free(mBuffer);
 	}
 	jobFunction mFunction;
 	void *mBuffer;
+	size_t mTarget;
 };
 
 void Evaluation::SetProcessing(int target, int processing)
@@ -664,6 +1350,8 @@ int Evaluation::Job(int(*jobFunction)(void*), void *ptr, unsigned int size)
 {
 	if (gCurrentContext->IsSynchronous())
 	{
+		size_t target = GetJobTarget();
+		Profiler::CPUScope jobScope(target, GetJobName(target), Profiler::Sample_Job);
 		return jobFunction(ptr);
 	}
 	else
@@ -677,6 +1365,8 @@ int Evaluation::JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int si
 {
 	if (gCurrentContext->IsSynchronous())
 	{
+		size_t target = GetJobTarget();
+		Profiler::CPUScope jobScope(target, GetJobName(target), Profiler::Sample_Job);
 		return jobMainFunction(ptr);
 	}
 	else
@@ -729,7 +1419,7 @@ unsigned int Evaluation::UploadImage(Image *image, unsigned int textureId, int c
 
 	unsigned int inputFormat = glInputFormats[image->mFormat];
 	unsigned int internalFormat = glInternalFormats[image->mFormat];
-	glTexImage2D((cubeFace==-1)? GL_TEXTURE_2D: glCubeFace[cubeFace], 0, internalFormat, image->mWidth, image->mHeight, 0, inputFormat, GL_UNSIGNED_BYTE, image->mBits);
+	glTexImage2D((cubeFace==-1)? GL_TEXTURE_2D: glCubeFace[cubeFace], 0, internalFormat, image->mWidth, image->mHeight, 0, inputFormat, glInputTypes[image->mFormat], image->mBits);
 	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, targetType);
 
 	glBindTexture(targetType, 0);
@@ -871,7 +1561,10 @@ int Evaluation::SetEvaluationSize(int target, int imageWidth, int imageHeight)
 		return EVAL_ERR;
 	//if (gCurrentContext->GetEvaluationInfo().uiPass)
 	//	return EVAL_OK;
-	renderTarget->InitBuffer(imageWidth, imageHeight);
+	gCurrentContext->GetProxySize(target, imageWidth, imageHeight);
+	uint8_t format = gCurrentContext->GetOutputFormat(target);
+	renderTarget->InitBuffer(imageWidth, imageHeight, format, renderTarget->GetReusableMipCount(imageWidth, imageHeight, format, 1, 1));
+	gCurrentContext->InvalidateStageHash(target);
 	return EVAL_OK;
 }
 
@@ -883,6 +1576,20 @@ int Evaluation::SetEvaluationCubeSize(int target, int faceWidth)
 	RenderTarget* renderTarget = gCurrentContext->GetRenderTarget(target);
 	if (!renderTarget)
 		return EVAL_ERR;
-	renderTarget->InitCube(faceWidth);
+	int faceHeight = faceWidth;
+	gCurrentContext->GetProxySize(target, faceWidth, faceHeight);
+	uint8_t format = gCurrentContext->GetOutputFormat(target);
+	renderTarget->InitCube(faceWidth, format, renderTarget->GetReusableMipCount(faceWidth, faceWidth, format, 6, 1));
+	gCurrentContext->InvalidateStageHash(target);
+	return EVAL_OK;
+}
+
+int Evaluation::SetEvaluationFormat(int target, int format)
+{
+	if (target < 0 || target >= gEvaluation.mEvaluationStages.size())
+		return EVAL_ERR;
+	if (format < 0 || format >= TextureFormat::Count)
+		return EVAL_ERR;
+	gEvaluation.mEvaluationStages[target].mOutputFormat = GetRenderTargetFormat(uint8_t(format));
 	return EVAL_OK;
 }
\ No newline at end of file
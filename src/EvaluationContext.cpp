@@ -26,15 +26,83 @@
 #include <GL/gl3w.h>    // Initialize with gl3wInit()
 #include "EvaluationContext.h"
 #include "Evaluators.h"
+#include "Profiler.h"
+#include "DiskCache.h"
+#include "TaskScheduler.h"
+#include <sys/stat.h>
+
+extern enki::TaskScheduler g_TS;
+
+struct DiskCacheWriteTaskSet final : enki::ITaskSet
+{
+	DiskCacheWriteTaskSet(uint64_t key, Image image) : enki::ITaskSet(), mKey(key), mImage(image), mbWritten(false)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		mbWritten = gDiskCache.Write(mKey, mImage);
+	}
+	uint64_t mKey;
+	Image mImage;
+	bool mbWritten;
+};
 
 EvaluationContext *gCurrentContext = NULL;
 
 static const unsigned int wrap[] = { GL_REPEAT, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_BORDER, GL_MIRRORED_REPEAT };
-static const unsigned int filter[] = { GL_LINEAR, GL_NEAREST };
-static const char* samplerName[] = { "Sampler0", "Sampler1", "Sampler2", "Sampler3", "Sampler4", "Sampler5", "Sampler6", "Sampler7", "CubeSampler0" };
+// InputSampler filters: linear, nearest, trilinear, anisotropic. Magnification never uses mips
+static const unsigned int filter[] = { GL_LINEAR, GL_NEAREST, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR_MIPMAP_LINEAR };
+static const unsigned int magFilter[] = { GL_LINEAR, GL_NEAREST, GL_LINEAR, GL_LINEAR };
+static const uint32_t FilterTrilinear = 2;
+static const uint32_t FilterAnisotropic = 3;
+
+#ifndef GL_TEXTURE_MAX_ANISOTROPY
+#define GL_TEXTURE_MAX_ANISOTROPY 0x84FE
+#define GL_MAX_TEXTURE_MAX_ANISOTROPY 0x84FF
+#endif
+
+static bool IsMipmapFilter(uint32_t filterMode)
+{
+	filterMode %= sizeof(filter) / sizeof(filter[0]);
+	return filterMode == FilterTrilinear || filterMode == FilterAnisotropic;
+}
+
+static float GetMaxAnisotropy()
+{
+	static float maxAnisotropy = 0.f;
+	if (maxAnisotropy == 0.f)
+	{
+		// core in 4.6, EXT/ARB_texture_filter_anisotropic before. Unknown enum leaves the value untouched
+		float value = 1.f;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &value);
+		glGetError();
+		maxAnisotropy = std::min(std::max(value, 1.f), 16.f);
+	}
+	return maxAnisotropy;
+}
 static const unsigned int GLBlends[] = { GL_ZERO, GL_ONE, GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR, GL_DST_COLOR, GL_ONE_MINUS_DST_COLOR,GL_SRC_ALPHA,
 	GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA, GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR, GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA, GL_SRC_ALPHA_SATURATE };
 
+// sampler objects for every InputSampler combination, created on first use
+static unsigned int GetSamplerObject(const InputSampler& inputSampler)
+{
+	static const size_t wrapCount = sizeof(wrap) / sizeof(wrap[0]);
+	static const size_t filterCount = sizeof(filter) / sizeof(filter[0]);
+	static unsigned int samplers[wrapCount][wrapCount][filterCount][filterCount] = {};
+	unsigned int& sampler = samplers[inputSampler.mWrapU % wrapCount][inputSampler.mWrapV % wrapCount][inputSampler.mFilterMin % filterCount][inputSampler.mFilterMag % filterCount];
+	if (!sampler)
+	{
+		glGenSamplers(1, &sampler);
+		glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, filter[inputSampler.mFilterMin % filterCount]);
+		glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, magFilter[inputSampler.mFilterMag % filterCount]);
+		if (inputSampler.mFilterMin % filterCount == FilterAnisotropic && GetMaxAnisotropy() > 1.f)
+			glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY, GetMaxAnisotropy());
+		glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wrap[inputSampler.mWrapU % wrapCount]);
+		glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wrap[inputSampler.mWrapV % wrapCount]);
+	}
+	return sampler;
+}
+
 static const float rotMatrices[6][16] = {
 	// toward +x
 	{ 0,0,-1,0,
@@ -80,6 +148,18 @@ EvaluationContext::EvaluationContext(Evaluation& evaluation, bool synchronousEva
 	, mbSynchronousEvaluation(synchronousEvaluation)
 	, mDefaultWidth(defaultWidth)
 	, mDefaultHeight(defaultHeight)
+	, mbLowMemory(false)
+	, mbProgressive(false)
+	, mbProxyPass(false)
+	, mbProxyScaled(false)
+	, mFrameBudgetMs(0.f)
+	, mFramePixelBudget(1024 * 1024)
+	, mBudgetQueryPixels(0)
+	, mBudgetQuery(0)
+	, mbBudgetQueryOpen(false)
+	, mBudgetPixels(0)
+	, mBudgetNodeCount(0)
+	, mBudgetStart(0)
 {
 
 }
@@ -93,10 +173,21 @@ EvaluationContext::~EvaluationContext()
 	}
 	mWriteStreams.clear();
 
+	for (auto& write : mDiskCacheWrites)
+	{
+		if (!write.mTask)
+			continue;
+		g_TS.WaitforTask(write.mTask);
+		Evaluation::FreeImage(&write.mTask->mImage);
+		delete write.mTask;
+	}
+
 	for (auto* tgt : mAllocatedTargets)
 	{
 		delete tgt;
 	}
+	if (mBudgetQuery)
+		glDeleteQueries(1, &mBudgetQuery);
 }
 
 static void SetMouseInfos(EvaluationInfo &evaluationInfo, const EvaluationStage &evaluationStage)
@@ -109,6 +200,7 @@ static void SetMouseInfos(EvaluationInfo &evaluationInfo, const EvaluationStage
 
 unsigned int EvaluationContext::GetEvaluationTexture(size_t target)
 {
+	RequestTarget(target);
 	if (target >= mStageTarget.size())
 		return 0;
 	if (!mStageTarget[target])
@@ -121,9 +213,12 @@ void EvaluationContext::EvaluateGLSL(const EvaluationStage& evaluationStage, siz
 	const Input& input = evaluationStage.mInput;
 
 	RenderTarget* tgt = mStageTarget[index];
+	bool layered = !evaluationInfo.uiPass && tgt->mImage.mNumFaces == 6 && gEvaluators.mbLayeredRendering && gEvaluators.GetEvaluator(evaluationStage.mNodeType).mbLayered;
 	if (!evaluationInfo.uiPass)
 	{
-		if (tgt->mImage.mNumFaces == 6)
+		if (layered)
+			tgt->BindAsLayeredCubeTarget();
+		else if (tgt->mImage.mNumFaces == 6)
 			tgt->BindAsCubeTarget();
 		else
 			tgt->BindAsTarget();
@@ -140,64 +235,69 @@ void EvaluationContext::EvaluateGLSL(const EvaluationStage& evaluationStage, siz
 			blend[i] = GLBlends[blendOps[i]];
 	}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(blend[0], blend[1]);
+	// blending is disabled outside of node evaluation
+	bool blending = blend[0] != GL_ONE || blend[1] != GL_ZERO;
+	if (blending)
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(blend[0], blend[1]);
+	}
 
 	glUseProgram(program);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 1, evaluationStage.mParametersBuffer);
 
-	size_t faceCount = evaluationInfo.uiPass ? 1 : tgt->mImage.mNumFaces;
-	for (size_t face = 0; face < faceCount; face++)
+	// sampler uniforms are set at link time, inputs only need their texture and sampler object bound
+	int samplerCount = evaluator.mSamplerCount;
+	for (int samplerIndex = 0; samplerIndex < samplerCount; samplerIndex++)
 	{
-		if (tgt->mImage.mNumFaces == 6)
-			tgt->BindCubeFace(face);
-
-		memcpy(evaluationInfo.viewRot, rotMatrices[face], sizeof(float) * 16);
-		glBindBuffer(GL_UNIFORM_BUFFER, gEvaluators.mEvaluationStateGLSLBuffer);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(EvaluationInfo), &evaluationInfo, GL_DYNAMIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE0 + samplerIndex);
 
+		int targetIndex = input.mInputs[samplerIndex];
+		if (targetIndex < 0)
+		{
+			glBindTexture(GL_TEXTURE_2D, 0);
+			continue;
+		}
+		auto* inputTarget = mStageTarget[targetIndex];
+		if (!inputTarget)
+			continue;
+		// GLSL producers allocate their chain in InitGLSLTarget. Images and C outputs get it here
+		if (IsMipmapFilter(evaluationStage.mInputSamplers[samplerIndex].mFilterMin) && inputTarget->mImage.mNumMips == 1)
+			inputTarget->EnsureMipChain();
+		glBindSampler(samplerIndex, GetSamplerObject(evaluationStage.mInputSamplers[samplerIndex]));
+		glBindTexture((inputTarget->mImage.mNumFaces == 1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP, inputTarget->mGLTexID);
+	}
 
-		glBindBufferBase(GL_UNIFORM_BUFFER, 1, evaluationStage.mParametersBuffer);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 2, gEvaluators.mEvaluationStateGLSLBuffer);
-
-		int samplerIndex = 0;
-		for (size_t inputIndex = 0; inputIndex < sizeof(samplerName) / sizeof(const char*); inputIndex++)
+	if (layered)
+	{
+		// one instance per face
+		evaluationInfo.cubeFace = 0;
+		memcpy(evaluationInfo.viewRot, rotMatrices[0], sizeof(float) * 16);
+		gEvaluators.BindEvaluationInfo(evaluationInfo);
+		gFSQuad.Render(6);
+	}
+	else
+	{
+		size_t faceCount = evaluationInfo.uiPass ? 1 : tgt->mImage.mNumFaces;
+		for (size_t face = 0; face < faceCount; face++)
 		{
-			unsigned int parameter = glGetUniformLocation(program, samplerName[inputIndex]);
-			if (parameter == 0xFFFFFFFF)
-				continue;
-			glUniform1i(parameter, samplerIndex);
-			glActiveTexture(GL_TEXTURE0 + samplerIndex);
+			if (tgt->mImage.mNumFaces == 6)
+				tgt->BindCubeFace(face);
 
-			int targetIndex = input.mInputs[samplerIndex];
-			if (targetIndex < 0)
-			{
-				glBindTexture(GL_TEXTURE_2D, 0);
-			}
-			else
-			{
-				auto* tgt = mStageTarget[targetIndex];
-				if (tgt)
-				{
-					const InputSampler& inputSampler = evaluationStage.mInputSamplers[samplerIndex];
-					if (tgt->mImage.mNumFaces == 1)
-					{
-						glBindTexture(GL_TEXTURE_2D, tgt->mGLTexID);
-						TexParam(filter[inputSampler.mFilterMin], filter[inputSampler.mFilterMag], wrap[inputSampler.mWrapU], wrap[inputSampler.mWrapV], GL_TEXTURE_2D);
-					}
-					else
-					{
-						glBindTexture(GL_TEXTURE_CUBE_MAP, tgt->mGLTexID);
-						TexParam(filter[inputSampler.mFilterMin], filter[inputSampler.mFilterMag], wrap[inputSampler.mWrapU], wrap[inputSampler.mWrapV], GL_TEXTURE_CUBE_MAP);
-					}
-				}
-			}
-			samplerIndex++;
+			evaluationInfo.cubeFace = int(face);
+			memcpy(evaluationInfo.viewRot, rotMatrices[face], sizeof(float) * 16);
+			gEvaluators.BindEvaluationInfo(evaluationInfo);
+
+			gFSQuad.Render();
 		}
-		//
-		gFSQuad.Render();
+		evaluationInfo.cubeFace = 0;
 	}
-	glDisable(GL_BLEND);
+
+	// other shaders rely on texture parameters
+	for (int samplerIndex = 0; samplerIndex < samplerCount; samplerIndex++)
+		glBindSampler(samplerIndex, 0);
+	if (blending)
+		glDisable(GL_BLEND);
 }
 
 void EvaluationContext::EvaluateC(const EvaluationStage& evaluationStage, size_t index, EvaluationInfo& evaluationInfo)
@@ -274,10 +374,82 @@ void EvaluationContext::AllocRenderTargetsForBaking(const std::vector<size_t>& n
 		}
 	}
 }
+uint8_t EvaluationContext::GetOutputFormat(size_t target) const
+{
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	if (stage.mOutputFormat != TextureFormat::Null)
+		return uint8_t(stage.mOutputFormat);
+	if (gMetaNodes[stage.mNodeType].mOutputFormat != TextureFormat::Null)
+		return uint8_t(gMetaNodes[stage.mNodeType].mOutputFormat);
+
+	// keep float chains in float
+	uint8_t format = TextureFormat::RGBA8;
+	for (auto inp : stage.mInput.mInputs)
+	{
+		if (inp < 0 || inp >= int(mStageTarget.size()) || !mStageTarget[inp])
+			continue;
+		uint8_t inputFormat = mStageTarget[inp]->mImage.mFormat;
+		if (inputFormat == TextureFormat::RGBA32F)
+			return TextureFormat::RGBA32F;
+		if (inputFormat == TextureFormat::RGBA16F)
+			format = TextureFormat::RGBA16F;
+	}
+	return format;
+}
+
 void EvaluationContext::PreRun()
 {
 	mbDirty.resize(mEvaluation.GetStagesCount(), false);
 	mbProcessing.resize(mEvaluation.GetStagesCount(), false);
+	mbRequested.resize(mEvaluation.GetStagesCount(), false);
+	mbEvicted.resize(mEvaluation.GetStagesCount(), false);
+	mStageHashes.resize(mEvaluation.GetStagesCount(), 0);
+	mDiskKeys.resize(mEvaluation.GetStagesCount(), 0);
+	mPendingDiskKeys.resize(mEvaluation.GetStagesCount(), 0);
+	mbPendingResult.resize(mEvaluation.GetStagesCount(), false);
+	mbProxy.resize(mEvaluation.GetStagesCount(), false);
+	mbPriority.resize(mEvaluation.GetStagesCount(), false);
+
+	mbMipmapSampled.assign(mEvaluation.GetStagesCount(), false);
+	for (size_t i = 0; i < mEvaluation.GetStagesCount(); i++)
+	{
+		const EvaluationStage& stage = mEvaluation.GetEvaluationStage(i);
+		for (size_t slot = 0; slot < stage.mInputSamplers.size() && slot < 8; slot++)
+		{
+			int input = stage.mInput.mInputs[slot];
+			if (input >= 0 && input < int(mbMipmapSampled.size()) && IsMipmapFilter(stage.mInputSamplers[slot].mFilterMin))
+				mbMipmapSampled[input] = true;
+		}
+	}
+}
+
+// files read by the node can change on disk without any parameter change
+static uint64_t HashReadFiles(const EvaluationStage& stage, uint64_t hash)
+{
+	if (!stage.mParameters)
+		return hash;
+	const unsigned char *paramBuffer = (const unsigned char*)stage.mParameters;
+	for (auto& param : gMetaNodes[stage.mNodeType].mParams)
+	{
+		if (param.mType == Con_FilenameRead && *(const char*)paramBuffer)
+		{
+#ifdef _WIN32
+			struct _stat64 fileStat;
+			int res = _stat64((const char*)paramBuffer, &fileStat);
+#else
+			struct stat fileStat;
+			int res = stat((const char*)paramBuffer, &fileStat);
+#endif
+			hash = HashValue(res, hash);
+			if (!res)
+			{
+				hash = HashValue(uint64_t(fileStat.st_mtime), hash);
+				hash = HashValue(uint64_t(fileStat.st_size), hash);
+			}
+		}
+		paramBuffer += GetParameterTypeSize(param.mType);
+	}
+	return hash;
 }
 
 void EvaluationContext::RunNode(size_t nodeIndex)
@@ -299,23 +471,311 @@ void EvaluationContext::RunNode(size_t nodeIndex)
 
 	mbProcessing[nodeIndex] = false;
 
+	// an output computed from proxies is a proxy itself
+	bool proxyInputs = false;
+	for (auto inp : input.mInputs)
+	{
+		if (inp >= 0 && mbProxy[inp])
+			proxyInputs = true;
+	}
+	mbProxy[nodeIndex] = proxyInputs;
+	mbProxyScaled = false;
+
 	mEvaluationInfo.targetIndex = int(nodeIndex);
 	memcpy(mEvaluationInfo.inputIndices, input.mInputs, sizeof(mEvaluationInfo.inputIndices));
 	SetMouseInfos(mEvaluationInfo, currentStage);
 
+	uint64_t hash = 0;
+	if (IsMemoizable(nodeIndex))
+	{
+		// GLSL only: size and format are known before running
+		InitGLSLTarget(nodeIndex);
+		hash = ComputeStageHash(nodeIndex);
+		if (hash && FetchMemoizedOutput(nodeIndex, hash))
+		{
+			mbDirty[nodeIndex] = false;
+			return;
+		}
+	}
+
+	uint64_t diskKey = 0;
+	if (!mbProxyPass && !proxyInputs && IsDiskCacheable(nodeIndex))
+	{
+		// C nodes set their size while running: key them without it
+		diskKey = (currentStage.mEvaluationMask&EvaluationC) ? ComputeStageHash(nodeIndex, false) : hash;
+		if (diskKey && LoadDiskCachedOutput(nodeIndex, diskKey))
+		{
+			mbDirty[nodeIndex] = false;
+			return;
+		}
+	}
+
+	const char *nodeName = gMetaNodes[currentStage.mNodeType].mName.c_str();
 	if (currentStage.mEvaluationMask&EvaluationC)
+	{
+		Profiler::CPUScope cpuScope(nodeIndex, nodeName);
+		// sizes read from proxy inputs must not end up in the saved parameters. The refinement runs it again
+		std::vector<uint8_t> parameters;
+		if (proxyInputs && currentStage.mParameters)
+			parameters.assign((uint8_t*)currentStage.mParameters, (uint8_t*)currentStage.mParameters + currentStage.mParametersSize);
 		EvaluateC(currentStage, nodeIndex, mEvaluationInfo);
+		if (!parameters.empty())
+			memcpy(currentStage.mParameters, parameters.data(), parameters.size());
+	}
 
 	if (currentStage.mEvaluationMask&EvaluationGLSL)
 	{
-		if (!mStageTarget[nodeIndex]->mGLTexID)
-			mStageTarget[nodeIndex]->InitBuffer(mDefaultWidth, mDefaultHeight);
+		InitGLSLTarget(nodeIndex);
 
+		gProfiler.BeginGPU(nodeIndex, nodeName);
 		EvaluateGLSL(currentStage, nodeIndex, mEvaluationInfo);
+		mStageTarget[nodeIndex]->GenerateMips();
+		gProfiler.EndGPU();
+	}
+	if (mbProxyScaled)
+		mbProxy[nodeIndex] = true;
+	// C nodes may set their output size while running: key them afterward so their consumers can be memoized
+	if (!hash && IsDeterministic(nodeIndex))
+		hash = ComputeStageHash(nodeIndex);
+	mStageHashes[nodeIndex] = hash;
+	if (mbProcessing[nodeIndex])
+	{
+		mDiskKeys[nodeIndex] = 0;
+		mPendingDiskKeys[nodeIndex] = diskKey;
+		mbPendingResult[nodeIndex] = false;
+	}
+	else
+	{
+		mDiskKeys[nodeIndex] = diskKey;
 	}
 	mbDirty[nodeIndex] = false;
 }
 
+void EvaluationContext::InitGLSLTarget(size_t nodeIndex)
+{
+	RenderTarget* tgt = mStageTarget[nodeIndex];
+	uint8_t outputFormat = GetOutputFormat(nodeIndex);
+	if (!tgt->mGLTexID)
+		tgt->InitBuffer(mDefaultWidth, mDefaultHeight, outputFormat);
+
+	// mips are only allocated and generated when a consumer samples them
+	uint8_t numMips = IsMipmapSampled(nodeIndex) ? RenderTarget::GetFullMipCount(tgt->mImage.mWidth, tgt->mImage.mHeight) : 1;
+	if (tgt->mImage.mFormat != outputFormat || tgt->mImage.mNumMips != numMips)
+	{
+		if (tgt->mImage.mNumFaces == 6)
+			tgt->InitCube(tgt->mImage.mWidth, outputFormat, numMips);
+		else
+			tgt->InitBuffer(tgt->mImage.mWidth, tgt->mImage.mHeight, outputFormat, numMips);
+	}
+}
+
+bool EvaluationContext::IsMipmapSampled(size_t target) const
+{
+	return target < mbMipmapSampled.size() && mbMipmapSampled[target];
+}
+
+bool EvaluationContext::IsDeterministic(size_t target) const
+{
+	// baking and thumbnails contexts are short lived. Low memory already recomputes on demand
+	if (mbSynchronousEvaluation || mbLowMemory || mbProcessing[target])
+		return false;
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	// painted or blended outputs depend on what was in the target before
+	if (gMetaNodes[stage.mNodeType].mbHasUI)
+		return false;
+	return stage.mBlendingSrc == ONE && stage.mBlendingDst == ZERO;
+}
+
+bool EvaluationContext::IsMemoizable(size_t target) const
+{
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	return stage.mEvaluationMask == EvaluationGLSL && IsDeterministic(target) && mStageTarget[target];
+}
+
+uint64_t EvaluationContext::ComputeStageHash(size_t target, bool withTargetSize) const
+{
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	const RenderTarget* tgt = mStageTarget[target];
+	if (withTargetSize && (!tgt || !tgt->mGLTexID))
+		return 0;
+	const Evaluator& evaluator = gEvaluators.GetEvaluator(stage.mNodeType);
+
+	uint64_t hash = HashValue(stage.mNodeType, 0xcbf29ce484222325ULL);
+	hash = HashValue(evaluator.mGLSLHash, hash);
+	hash = HashValue(evaluator.mCHash, hash);
+	if (stage.mParameters && stage.mParametersSize)
+		hash = Hash(stage.mParameters, stage.mParametersSize, hash);
+	hash = HashReadFiles(stage, hash);
+	if (!stage.mInputSamplers.empty())
+		hash = Hash(stage.mInputSamplers.data(), stage.mInputSamplers.size() * sizeof(InputSampler), hash);
+	for (auto inp : stage.mInput.mInputs)
+	{
+		if (inp < 0)
+		{
+			hash = HashValue(inp, hash);
+			continue;
+		}
+		// input content unknown: can't be keyed
+		if (size_t(inp) >= mStageHashes.size() || !mStageHashes[inp])
+			return 0;
+		hash = HashValue(mStageHashes[inp], hash);
+	}
+	hash = HashValue(stage.mLocalTime, hash);
+	hash = HashValue(stage.mRx, hash);
+	hash = HashValue(stage.mRy, hash);
+	if (withTargetSize)
+	{
+		hash = HashValue(tgt->mImage.mWidth, hash);
+		hash = HashValue(tgt->mImage.mHeight, hash);
+		hash = HashValue(tgt->mImage.mFormat, hash);
+		hash = HashValue(tgt->mImage.mNumFaces, hash);
+		hash = HashValue(tgt->mImage.mNumMips, hash);
+	}
+	// 0 means unknown
+	return hash ? hash : 1;
+}
+
+bool EvaluationContext::FetchMemoizedOutput(size_t target, uint64_t hash)
+{
+	RenderTarget* tgt = mStageTarget[target];
+	if (mStageHashes[target] == hash)
+		return true;
+	if (gNodeOutputCache.Fetch(hash, tgt, mStageHashes[target]))
+	{
+		mStageHashes[target] = hash;
+		return true;
+	}
+
+	// keep the current content around, the node is evaluated in a fresh storage
+	if (mStageHashes[target])
+	{
+		Image_t image = tgt->mImage;
+		gNodeOutputCache.Store(mStageHashes[target], tgt);
+		if (image.mNumFaces == 6)
+			tgt->InitCube(image.mWidth, image.mFormat, image.mNumMips);
+		else
+			tgt->InitBuffer(image.mWidth, image.mHeight, image.mFormat, image.mNumMips);
+		mStageHashes[target] = 0;
+	}
+	return false;
+}
+
+void EvaluationContext::InvalidateStageHash(size_t target)
+{
+	if (target < mStageHashes.size())
+		mStageHashes[target] = 0;
+	if (target < mDiskKeys.size())
+	{
+		mDiskKeys[target] = 0;
+		mbPendingResult[target] = mPendingDiskKeys[target] != 0;
+	}
+}
+
+void EvaluationContext::StageSetProcessing(size_t target, bool processing)
+{
+	mbProcessing[target] = processing;
+	if (processing || target >= mPendingDiskKeys.size() || !mPendingDiskKeys[target])
+		return;
+
+	// jobs are done. Failed jobs leave the previous content: nothing to key
+	if (mbPendingResult[target])
+	{
+		mDiskKeys[target] = mPendingDiskKeys[target];
+		mStageHashes[target] = IsDeterministic(target) ? ComputeStageHash(target) : 0;
+	}
+	mPendingDiskKeys[target] = 0;
+	mbPendingResult[target] = false;
+}
+
+bool EvaluationContext::IsDiskCacheable(size_t target) const
+{
+	if (!gDiskCache.IsEnabled() || mEvaluationInfo.forcedDirty || !IsDeterministic(target))
+		return false;
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	// video frames are streamed, saved textures come with the library
+	return !stage.mDecoder && !gMetaNodes[stage.mNodeType].mbSaveTexture && mStageTarget[target];
+}
+
+bool EvaluationContext::LoadDiskCachedOutput(size_t target, uint64_t key)
+{
+	DiskCache::MappedFile mapped;
+	Image image;
+	if (!gDiskCache.Load(key, image, mapped))
+		return false;
+	Evaluation::SetRenderTargetImage(mStageTarget[target], &image);
+	gDiskCache.Unmap(mapped);
+
+	mStageHashes[target] = ComputeStageHash(target);
+	mDiskKeys[target] = key;
+	return true;
+}
+
+void EvaluationContext::FlushDiskCache()
+{
+	if (!gDiskCache.IsEnabled())
+		return;
+	EvaluationContext *previousContext = gCurrentContext;
+	gCurrentContext = this;
+	for (size_t i = 0; i < mDiskKeys.size() && i < mStageTarget.size(); i++)
+	{
+		uint64_t key = mDiskKeys[i];
+		if (!key || mbProcessing[i] || gDiskCache.Contains(key))
+			continue;
+		bool pending = false;
+		for (auto& write : mDiskCacheWrites)
+			pending |= write.mKey == key;
+		if (pending)
+			continue;
+		int readback = Evaluation::BeginEvaluationImageRead(int(i));
+		if (readback == -1)
+			continue;
+		DiskCacheWrite write = { readback, key, NULL };
+		mDiskCacheWrites.push_back(write);
+	}
+	gCurrentContext = previousContext;
+}
+
+void EvaluationContext::ProcessDiskCacheWrites(bool wait)
+{
+	if (mDiskCacheWrites.empty())
+		return;
+	for (size_t i = 0; i < mDiskCacheWrites.size();)
+	{
+		DiskCacheWrite& write = mDiskCacheWrites[i];
+		if (!write.mTask)
+		{
+			if (!wait && Evaluation::PollEvaluationImageRead(write.mReadback) == EVAL_PENDING)
+			{
+				i++;
+				continue;
+			}
+			Image image;
+			if (Evaluation::EndEvaluationImageRead(write.mReadback, &image) != EVAL_OK)
+			{
+				mDiskCacheWrites.erase(mDiskCacheWrites.begin() + i);
+				continue;
+			}
+			// up to hundreds of MB per output: written by a worker, the index is updated here when it's done
+			write.mTask = new DiskCacheWriteTaskSet(write.mKey, image);
+			g_TS.AddTaskSetToPipe(write.mTask);
+		}
+		if (wait)
+			g_TS.WaitforTask(write.mTask);
+		if (!write.mTask->GetIsComplete())
+		{
+			i++;
+			continue;
+		}
+		if (write.mTask->mbWritten)
+			gDiskCache.Insert(write.mKey, write.mTask->mImage);
+		Evaluation::FreeImage(&write.mTask->mImage);
+		delete write.mTask;
+		mDiskCacheWrites.erase(mDiskCacheWrites.begin() + i);
+	}
+	if (mDiskCacheWrites.empty())
+		gDiskCache.FlushIndex();
+}
+
 void EvaluationContext::RunNodeList(const std::vector<size_t>& nodesToEvaluate)
 {
 	// run C nodes
@@ -357,25 +817,396 @@ void EvaluationContext::RecurseBackward(size_t target, std::vector<size_t>& used
 		usedNodes.push_back(target);
 }
 
+void EvaluationContext::RequestTarget(size_t target, bool priority)
+{
+	if (target >= mbRequested.size())
+		mbRequested.resize(target + 1, false);
+	mbRequested[target] = true;
+	if (priority)
+	{
+		if (target >= mbPriority.size())
+			mbPriority.resize(target + 1, false);
+		mbPriority[target] = true;
+	}
+}
+
+void EvaluationContext::SetLowMemory(bool lowMemory)
+{
+	if (mbLowMemory && !lowMemory)
+	{
+		// back to full preview: every evicted output gets recomputed
+		for (size_t i = 0; i < mbEvicted.size(); i++)
+		{
+			if (mbEvicted[i])
+				mbDirty[i] = true;
+		}
+		mbEvicted.assign(mbEvicted.size(), false);
+	}
+	// low memory evaluation has no refinement pass
+	if (!mbLowMemory && lowMemory)
+		SetProxiesDirty();
+	mbLowMemory = lowMemory;
+}
+
+bool EvaluationContext::IsAlwaysResident(size_t target) const
+{
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	// outputs set by uploads or accumulated over time (paint) can't be recomputed
+	if (!(stage.mEvaluationMask&EvaluationGLSL))
+		return true;
+	if (gMetaNodes[stage.mNodeType].mbSaveTexture)
+		return true;
+	return mbProcessing[target];
+}
+
+void EvaluationContext::ComputeResidentTargets()
+{
+	size_t stageCount = mEvaluation.GetStagesCount();
+	mbResident.assign(stageCount, false);
+	for (size_t i = 0; i < stageCount; i++)
+	{
+		if (!mbRequested[i] && !IsAlwaysResident(i))
+			continue;
+		mbResident[i] = true;
+
+		// UI nodes are rendered directly with their inputs
+		const EvaluationStage& stage = mEvaluation.GetEvaluationStage(i);
+		if (mbRequested[i] && gMetaNodes[stage.mNodeType].mbHasUI)
+		{
+			for (auto inp : stage.mInput.mInputs)
+			{
+				if (inp >= 0)
+					mbResident[inp] = true;
+			}
+		}
+	}
+	mbRequested.assign(stageCount, false);
+}
+
+void EvaluationContext::EvictTarget(size_t target)
+{
+	RenderTarget *tgt = mStageTarget[target];
+	if (!tgt || !tgt->mGLTexID || mbProcessing[target])
+		return;
+	tgt->Destroy();
+	mbEvicted[target] = true;
+	InvalidateStageHash(target);
+}
+
+void EvaluationContext::RunDirtyLowMemory()
+{
+	ComputeResidentTargets();
+
+	// walk backward from resident outputs to find what needs to be (re)computed
+	auto evaluationOrderList = mEvaluation.GetForwardEvaluationOrder();
+	size_t stageCount = mEvaluation.GetStagesCount();
+	std::vector<bool> needed(mbResident);
+	std::vector<bool> evaluate(stageCount, false);
+	for (int index = int(evaluationOrderList.size()) - 1; index >= 0; index--)
+	{
+		size_t currentNodeIndex = evaluationOrderList[index];
+		if (!needed[currentNodeIndex] || (!mbDirty[currentNodeIndex] && !mbEvicted[currentNodeIndex]))
+			continue;
+		evaluate[currentNodeIndex] = true;
+		for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+		{
+			if (inp >= 0)
+				needed[inp] = true;
+		}
+	}
+
+	std::vector<size_t> nodesToEvaluate;
+	std::vector<int> useCount(stageCount, 0);
+	for (auto currentNodeIndex : evaluationOrderList)
+	{
+		if (!evaluate[currentNodeIndex])
+			continue;
+		nodesToEvaluate.push_back(currentNodeIndex);
+		for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+		{
+			if (inp >= 0)
+				useCount[inp]++;
+		}
+	}
+
+	AllocRenderTargetsForEditingPreview();
+
+	// release intermediates as soon as their last consumer is done so the pool can alias them
+	for (auto currentNodeIndex : nodesToEvaluate)
+	{
+		RunNode(currentNodeIndex);
+		if (!mbDirty[currentNodeIndex])
+			mbEvicted[currentNodeIndex] = false;
+
+		for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+		{
+			if (inp < 0)
+				continue;
+			if (!--useCount[inp] && !mbResident[inp])
+				EvictTarget(inp);
+		}
+	}
+
+	for (size_t i = 0; i < stageCount; i++)
+	{
+		if (!mbResident[i])
+			EvictTarget(i);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glUseProgram(0);
+}
+
 void EvaluationContext::RunDirty()
 {
+	ProcessDiskCacheWrites(false);
 	PreRun();
+	if (mbLowMemory)
+	{
+		memset(&mEvaluationInfo, 0, sizeof(EvaluationInfo));
+		RunDirtyLowMemory();
+		return;
+	}
 	memset(&mEvaluationInfo, 0, sizeof(EvaluationInfo));
-	auto evaluationOrderList = mEvaluation.GetForwardEvaluationOrder();
 	std::vector<size_t> nodesToEvaluate;
-	for (size_t index = 0; index < evaluationOrderList.size(); index++)
+	GetScheduledNodes(nodesToEvaluate);
+	AllocRenderTargetsForEditingPreview();
+
+	bool progressive = mbProgressive && !mbSynchronousEvaluation;
+	if (nodesToEvaluate.empty() && !(progressive && GetProxyCount()))
+		return;
+
+	BeginBudget();
+	if (nodesToEvaluate.empty())
+	{
+		// full resolution comes once the graph is idle
+		RunRefinement();
+	}
+	else
+	{
+		// edits get a proxy answer right away. What doesn't fit in the budget stays dirty for the next frame
+		mbProxyPass = progressive;
+		for (auto currentNodeIndex : nodesToEvaluate)
+		{
+			if (IsBudgetExhausted())
+				break;
+			// would be dirtied again as soon as its input is evaluated
+			bool dirtyInput = false;
+			for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+			{
+				if (inp >= 0 && mbDirty[inp])
+					dirtyInput = true;
+			}
+			if (dirtyInput)
+				continue;
+			// accumulating nodes are never proxies: they run once, from full resolution inputs
+			if (mbProxyPass && !IsProxyEvaluable(currentNodeIndex) && !RefineProxyInputs(currentNodeIndex))
+				continue;
+			RunNode(currentNodeIndex);
+			SpendBudget(currentNodeIndex);
+		}
+		mbProxyPass = false;
+	}
+	EndBudget();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glUseProgram(0);
+}
+
+bool EvaluationContext::IsProxyEvaluable(size_t target) const
+{
+	const EvaluationStage& stage = mEvaluation.GetEvaluationStage(target);
+	// painted and blended outputs accumulate over evaluations, they can't be recomputed at another size
+	if (gMetaNodes[stage.mNodeType].mbHasUI || gMetaNodes[stage.mNodeType].mbSaveTexture)
+		return false;
+	return stage.mBlendingSrc == ONE && stage.mBlendingDst == ZERO;
+}
+
+void EvaluationContext::GetProxySize(size_t target, int& width, int& height)
+{
+	static const int ProxyShift = 2;
+	static const int ProxyMinSize = 256;
+	// outputs of proxy inputs are already reduced
+	if (!mbProxyPass || target >= mbProxy.size() || mbProxy[target] || !IsProxyEvaluable(target))
+		return;
+	for (int i = 0; i < ProxyShift && std::max(width, height) > ProxyMinSize; i++)
+	{
+		width = std::max(width >> 1, 1);
+		height = std::max(height >> 1, 1);
+		mbProxyScaled = true;
+	}
+}
+
+void EvaluationContext::SetProgressive(bool progressive)
+{
+	if (mbProgressive && !progressive)
+		SetProxiesDirty();
+	mbProgressive = progressive;
+}
+
+void EvaluationContext::SetProxiesDirty()
+{
+	for (size_t i = 0; i < mbProxy.size() && i < mbDirty.size(); i++)
+	{
+		if (mbProxy[i])
+			mbDirty[i] = true;
+	}
+}
+
+size_t EvaluationContext::GetProxyCount() const
+{
+	return std::count(mbProxy.begin(), mbProxy.end(), true);
+}
+
+bool EvaluationContext::RefineProxyInputs(size_t target)
+{
+	for (auto inp : mEvaluation.GetEvaluationStage(target).mInput.mInputs)
+	{
+		if (inp < 0 || !mbProxy[inp])
+			continue;
+		if (mbProcessing[inp] || !RefineProxyInputs(inp))
+			return false;
+		bool proxyPass = mbProxyPass;
+		mbProxyPass = false;
+		RunNode(inp);
+		mbProxyPass = proxyPass;
+		SpendBudget(inp);
+		if (mbProxy[inp])
+			return false;
+	}
+	return true;
+}
+
+void EvaluationContext::RunRefinement()
+{
+	// forward order: inputs are refined before their consumers
+	auto evaluationOrderList = mEvaluation.GetForwardEvaluationOrder();
+	for (auto currentNodeIndex : evaluationOrderList)
+	{
+		if (IsBudgetExhausted())
+			break;
+		if (!mbProxy[currentNodeIndex] || mbProcessing[currentNodeIndex])
+			continue;
+		bool inputsRefined = true;
+		for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+		{
+			if (inp >= 0 && (mbProxy[inp] || mbProcessing[inp]))
+				inputsRefined = false;
+		}
+		if (!inputsRefined)
+			continue;
+
+		RunNode(currentNodeIndex);
+		SpendBudget(currentNodeIndex);
+	}
+}
+
+void EvaluationContext::BeginBudget()
+{
+	static const size_t MinBudgetPixels = 256 * 256;
+	static const size_t MaxBudgetPixels = 64 * 1024 * 1024;
+
+	mBudgetPixels = 0;
+	mBudgetNodeCount = 0;
+	mBudgetStart = Profiler::GetTime();
+	if (mFrameBudgetMs <= 0.f)
+		return;
+
+	// pixels per frame follow the GPU time measured on a previous frame
+	if (mBudgetQueryPixels)
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(mBudgetQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(mBudgetQuery, GL_QUERY_RESULT, &elapsed);
+			if (elapsed)
+			{
+				double pixelsPerMs = double(mBudgetQueryPixels) * 1000000.0 / double(elapsed);
+				mFramePixelBudget = ImClamp(size_t(pixelsPerMs * mFrameBudgetMs), MinBudgetPixels, MaxBudgetPixels);
+			}
+			mBudgetQueryPixels = 0;
+		}
+	}
+
+	mbBudgetQueryOpen = !mBudgetQueryPixels;
+	if (mbBudgetQueryOpen)
+	{
+		if (!mBudgetQuery)
+			glGenQueries(1, &mBudgetQuery);
+		glBeginQuery(GL_TIME_ELAPSED, mBudgetQuery);
+	}
+}
+
+void EvaluationContext::EndBudget()
+{
+	if (!mbBudgetQueryOpen)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	mbBudgetQueryOpen = false;
+	// nothing rendered: keep the current estimate
+	mBudgetQueryPixels = mBudgetPixels;
+}
+
+bool EvaluationContext::IsBudgetExhausted() const
+{
+	// at least one node per frame so evaluation always progresses
+	if (mFrameBudgetMs <= 0.f || !mBudgetNodeCount)
+		return false;
+	// C nodes run on the CPU, GPU work is estimated from the pixels written
+	float cpuMs = float(Profiler::GetTime() - mBudgetStart) / 1000000.f;
+	return mBudgetPixels >= mFramePixelBudget || cpuMs >= mFrameBudgetMs;
+}
+
+void EvaluationContext::SpendBudget(size_t target)
+{
+	mBudgetNodeCount++;
+	const RenderTarget *tgt = mStageTarget[target];
+	if (tgt)
+		mBudgetPixels += size_t(tgt->mImage.mWidth) * size_t(tgt->mImage.mHeight) * tgt->mImage.mNumFaces;
+}
+
+void EvaluationContext::GetScheduledNodes(std::vector<size_t>& nodesToEvaluate)
+{
+	auto evaluationOrderList = mEvaluation.GetForwardEvaluationOrder();
+	size_t stageCount = mEvaluation.GetStagesCount();
+
+	// dirty nodes feeding the preview and extracted views come first
+	std::vector<bool> priority(stageCount, false);
+	for (int index = int(evaluationOrderList.size()) - 1; index >= 0; index--)
 	{
 		size_t currentNodeIndex = evaluationOrderList[index];
-		if (mbDirty[currentNodeIndex])
-			nodesToEvaluate.push_back(currentNodeIndex);
+		if (!mbPriority[currentNodeIndex] && !priority[currentNodeIndex])
+			continue;
+		priority[currentNodeIndex] = true;
+		for (auto inp : mEvaluation.GetEvaluationStage(currentNodeIndex).mInput.mInputs)
+		{
+			if (inp >= 0)
+				priority[inp] = true;
+		}
+	}
+	mbPriority.assign(stageCount, false);
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (auto currentNodeIndex : evaluationOrderList)
+		{
+			if (mbDirty[currentNodeIndex] && priority[currentNodeIndex] == (pass == 0))
+				nodesToEvaluate.push_back(currentNodeIndex);
+		}
 	}
-	AllocRenderTargetsForEditingPreview();
-	RunNodeList(nodesToEvaluate);
 }
 
 void EvaluationContext::RunAll()
 {
 	PreRun();
+	if (mbLowMemory || (mFrameBudgetMs > 0.f && !mbSynchronousEvaluation))
+	{
+		// evaluated lazily by RunDirty, only for requested outputs or spread over frames
+		mbDirty.assign(mbDirty.size(), true);
+		return;
+	}
 	// get list of nodes to run
 	memset(&mEvaluationInfo, 0, sizeof(EvaluationInfo));
 	auto evaluationOrderList = mEvaluation.GetForwardEvaluationOrder();
@@ -404,9 +1235,22 @@ FFMPEGCodec::Encoder *EvaluationContext::GetEncoder(const std::string &filename,
 	}
 	else
 	{
+		static const char *codecs[] = { "h264", "hevc", "m4v" };
+		static const char *presets[] = { "", "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow" };
+		EncoderParameters encoderParameters = {};
+		auto paramIter = mEncoderParameters.find(filename);
+		if (paramIter != mEncoderParameters.end())
+			encoderParameters = paramIter->second;
+
+		FFMPEGCodec::Encoder::Parameters parameters;
+		parameters.mFps = encoderParameters.mFps > 0 ? encoderParameters.mFps : 25;
+		parameters.mBitrate = encoderParameters.mBitrate > 0 ? encoderParameters.mBitrate : 400000;
+		parameters.mCodec = codecs[ImClamp(encoderParameters.mCodec, 0, 2)];
+		parameters.mPreset = presets[ImClamp(encoderParameters.mPreset, 0, 9)];
+
 		encoder = new FFMPEGCodec::Encoder;
 		mWriteStreams[filename] = encoder;
-		encoder->Init(filename, align(width, 4), align(height, 4), 25, 400000);
+		encoder->Init(filename, align(width, 4), align(height, 4), parameters);
 	}
 	return encoder;
 }
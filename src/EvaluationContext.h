@@ -36,6 +36,7 @@ struct EvaluationContext
 	void RunDirty();
 
 	unsigned int GetEvaluationTexture(size_t target);
+	void RequestTarget(size_t target, bool priority = false); // keeps target output resident in low memory mode. Priority targets are evaluated first
 	RenderTarget *GetRenderTarget(size_t target)
 	{ 
 		if (target >= mStageTarget.size())
@@ -44,14 +45,43 @@ struct EvaluationContext
 	}
 
 	FFMPEGCodec::Encoder *GetEncoder(const std::string &filename, int width, int height);
+	void SetEncoderParameters(const std::string &filename, const EncoderParameters& parameters) { mEncoderParameters[filename] = parameters; }
 	bool IsSynchronous() const { return mbSynchronousEvaluation; }
 	void SetTargetDirty(size_t target, bool onlyChild = false);
 	const EvaluationInfo& GetEvaluationInfo() const { return mEvaluationInfo; }
 
+	uint8_t GetOutputFormat(size_t target) const;
+
 	bool StageIsProcessing(size_t target) const { return mbProcessing[target]; }
-	void StageSetProcessing(size_t target, bool processing) { mbProcessing[target] = processing; }
+	void StageSetProcessing(size_t target, bool processing);
 
 	void AllocRenderTargetsForEditingPreview();
+
+	// low memory preview: only requested outputs stay resident, intermediates are released
+	// as soon as their consumers are evaluated and recomputed when needed again
+	void SetLowMemory(bool lowMemory);
+	bool IsLowMemory() const { return mbLowMemory; }
+
+	// target content was changed outside of its evaluation (image set by API, async job, video frame)
+	void InvalidateStageHash(size_t target);
+	// starts readbacks of outputs not yet in the disk cache. They are stored once read, see ProcessDiskCacheWrites
+	void FlushDiskCache();
+	// called each frame by RunDirty. wait to complete every write, at exit
+	void ProcessDiskCacheWrites(bool wait);
+
+	// progressive preview: dirty nodes are evaluated at a reduced size first, then refined
+	// to full resolution over the next frames within a GPU time budget
+	void SetProgressive(bool progressive);
+	bool IsProgressive() const { return mbProgressive; }
+	bool IsProxy(size_t target) const { return target < mbProxy.size() && mbProxy[target]; }
+	size_t GetProxyCount() const;
+	// sizes requested by nodes are reduced while evaluating at proxy scale
+	void GetProxySize(size_t target, int& width, int& height);
+
+	// RunDirty stops once the budget is used and resumes next frame. 0 evaluates every dirty node
+	void SetFrameBudget(float milliseconds) { mFrameBudgetMs = milliseconds; }
+	float GetFrameBudget() const { return mFrameBudgetMs; }
+	size_t GetDirtyCount() const { return std::count(mbDirty.begin(), mbDirty.end(), true); }
 protected:
 	Evaluation& mEvaluation;
 
@@ -64,18 +94,77 @@ protected:
 	void RecurseBackward(size_t target, std::vector<size_t>& usedNodes);
 
 	
+	void InitGLSLTarget(size_t nodeIndex);
+	bool IsMipmapSampled(size_t target) const; // a consumer uses a trilinear or anisotropic filter on it
 	void AllocRenderTargetsForBaking(const std::vector<size_t>& nodesToEvaluate);
 
+	// memoization: a stage output is keyed by its node, parameters, samplers, inputs keys, time and size
+	uint64_t ComputeStageHash(size_t target, bool withTargetSize = true) const;
+	bool IsDeterministic(size_t target) const;
+	bool IsMemoizable(size_t target) const;
+	bool FetchMemoizedOutput(size_t target, uint64_t hash);
+	bool IsDiskCacheable(size_t target) const;
+	bool LoadDiskCachedOutput(size_t target, uint64_t key);
+
+	bool IsProxyEvaluable(size_t target) const;
+	void RunRefinement();
+	bool RefineProxyInputs(size_t target); // false when an input can't be refined yet (jobs running)
+	void SetProxiesDirty(); // proxies are evaluated again at full resolution
+
+	// frame budget: GPU time is measured with a timer query and converted to a pixel count
+	void GetScheduledNodes(std::vector<size_t>& nodesToEvaluate);
+	void BeginBudget();
+	void EndBudget();
+	bool IsBudgetExhausted() const;
+	void SpendBudget(size_t target);
+
+	bool IsAlwaysResident(size_t target) const;
+	void ComputeResidentTargets();
+	void EvictTarget(size_t target);
+	void RunDirtyLowMemory();
+
 	std::vector<RenderTarget*> mStageTarget; // 1 per stage
 	std::vector<RenderTarget*> mAllocatedTargets; // allocated RT, might be present multiple times in mStageTarget
 	std::map<std::string, FFMPEGCodec::Encoder*> mWriteStreams;
+	std::map<std::string, EncoderParameters> mEncoderParameters;
 	std::vector<bool> mbDirty;
 	std::vector<bool> mbProcessing;
+	std::vector<bool> mbRequested; // since last RunDirty
+	std::vector<bool> mbPriority; // preview and extracted views, since last RunDirty
+	std::vector<bool> mbResident;
+	std::vector<bool> mbMipmapSampled; // rebuilt by PreRun
+	std::vector<bool> mbEvicted; // storage released, must be recomputed before use
+	std::vector<uint64_t> mStageHashes; // key of the content in each target storage. 0 when unknown
+	std::vector<uint64_t> mDiskKeys; // disk cache key of the content in each target. 0 when unknown
+	std::vector<uint64_t> mPendingDiskKeys; // key of an output computed by jobs
+	std::vector<bool> mbPendingResult; // content was set since the jobs started
+	struct DiskCacheWrite
+	{
+		int mReadback;
+		uint64_t mKey;
+		struct DiskCacheWriteTaskSet *mTask; // file write, once the readback is done
+	};
+	std::vector<DiskCacheWrite> mDiskCacheWrites;
+	std::vector<bool> mbProxy; // computed at proxy size or from proxy inputs
 	EvaluationInfo mEvaluationInfo;
 
 	int mDefaultWidth;
 	int mDefaultHeight;
 	bool mbSynchronousEvaluation;
+	bool mbLowMemory;
+
+	bool mbProgressive;
+	bool mbProxyPass;
+	bool mbProxyScaled; // size of the running node was reduced
+
+	float mFrameBudgetMs;
+	size_t mFramePixelBudget; // pixels evaluated per frame, adapted from GPU timings
+	size_t mBudgetQueryPixels; // pixels measured by the query in flight, 0 when none
+	unsigned int mBudgetQuery;
+	bool mbBudgetQueryOpen;
+	size_t mBudgetPixels; // spent this frame
+	size_t mBudgetNodeCount;
+	int64_t mBudgetStart;
 };
 
 extern EvaluationContext *gCurrentContext;
@@ -25,9 +25,22 @@
 #include <GL/gl3w.h>    // Initialize with gl3wInit()
 #include "Evaluators.h"
 #include "Evaluation.h"
+#include "TaskScheduler.h"
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+extern enki::TaskScheduler g_TS;
 
 Evaluators gEvaluators;
 
+static const char* samplerName[] = { "Sampler0", "Sampler1", "Sampler2", "Sampler3", "Sampler4", "Sampler5", "Sampler6", "Sampler7", "CubeSampler0" };
+
 struct EValuationFunction
 {
 	const char *szFunctionName;
@@ -38,6 +51,7 @@ static const EValuationFunction evaluationFunctions[] = {
 	{ "Log", (void*)Log },
 	{ "ReadImage", (void*)Evaluation::ReadImage },
 	{ "WriteImage", (void*)Evaluation::WriteImage },
+	{ "SetEncoderParameters", (void*)Evaluation::SetEncoderParameters },
 	{ "GetEvaluationImage", (void*)Evaluation::GetEvaluationImage },
 	{ "SetEvaluationImage", (void*)Evaluation::SetEvaluationImage },
 	{ "SetEvaluationImageCube", (void*)Evaluation::SetEvaluationImageCube },
@@ -49,6 +63,10 @@ static const EValuationFunction evaluationFunctions[] = {
 	{ "GetEvaluationSize", (void*)Evaluation::GetEvaluationSize},
 	{ "SetEvaluationSize", (void*)Evaluation::SetEvaluationSize },
 	{ "SetEvaluationCubeSize", (void*)Evaluation::SetEvaluationCubeSize },
+	{ "SetEvaluationFormat", (void*)Evaluation::SetEvaluationFormat },
+	{ "BeginEvaluationImageRead", (void*)Evaluation::BeginEvaluationImageRead },
+	{ "PollEvaluationImageRead", (void*)Evaluation::PollEvaluationImageRead },
+	{ "EndEvaluationImageRead", (void*)Evaluation::EndEvaluationImageRead },
 	{ "CubemapFilter", (void*)Evaluation::CubemapFilter},
 	{ "SetProcessing", (void*)Evaluation::SetProcessing},
 	{ "Job", (void*)Evaluation::Job },
@@ -59,10 +77,174 @@ static const EValuationFunction evaluationFunctions[] = {
 	{ "fabsf", (void*)fabsf }
 };
 
+// libtcc 0.9.27 keeps its compiler state in globals: states are compiled one at a time.
+// C compilation still runs on a worker, overlapped with the GLSL link on the main thread
+static std::mutex gTCCMutex;
+
+struct CompiledC
+{
+	CompiledC() : mCFunction(0), mMem(0), mTime(0.f) {}
+	int(*mCFunction)(void *parameters, void *evaluationInfo);
+	void *mMem;
+	std::string mLog;
+	float mTime; // ms
+};
+
 static void libtccErrorFunc(void *opaque, const char *msg)
 {
-	Log(msg);
-	Log("\n");
+	std::string& log = *(std::string*)opaque;
+	log += msg;
+	log += "\n";
+}
+
+static void CompileC(const std::string& filename, const std::string& text, CompiledC& compiled)
+{
+	std::lock_guard<std::mutex> lock(gTCCMutex);
+	auto start = std::chrono::high_resolution_clock::now();
+	TCCState *s = tcc_new();
+
+	int *noLib = (int*)s;
+	noLib[2] = 1; // no stdlib
+
+	tcc_set_error_func(s, &compiled.mLog, libtccErrorFunc);
+	tcc_add_include_path(s, "C");
+	tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+
+	if (tcc_compile_string(s, text.c_str()) != 0)
+	{
+		compiled.mLog += filename + " - Compilation error!\n";
+		tcc_delete(s);
+		return;
+	}
+
+	for (auto& evaluationFunction : evaluationFunctions)
+		tcc_add_symbol(s, evaluationFunction.szFunctionName, evaluationFunction.function);
+
+	int size = tcc_relocate(s, NULL);
+	if (size == -1)
+	{
+		compiled.mLog += filename + " - Libtcc unable to relocate program!\n";
+		tcc_delete(s);
+		return;
+	}
+	compiled.mMem = malloc(size);
+	tcc_relocate(s, compiled.mMem);
+
+	*(void**)(&compiled.mCFunction) = tcc_get_symbol(s, "main");
+	if (!compiled.mCFunction)
+	{
+		compiled.mLog += filename + " - No main function!\n";
+	}
+	tcc_delete(s);
+	compiled.mTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// linked programs are kept in Cache/ as driver binaries, keyed by the final shader text and the driver
+static const uint32_t ProgramBinaryMagic = 0x50474D49; // 'IMGP'
+
+static uint64_t GetDriverHash()
+{
+	static uint64_t driverHash = 0;
+	if (!driverHash)
+	{
+		GLint formatCount = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+		if (!formatCount)
+			return 0;
+		std::string driver = std::string((const char*)glGetString(GL_VENDOR)) + (const char*)glGetString(GL_RENDERER) + (const char*)glGetString(GL_VERSION);
+		driverHash = Hash(driver.c_str(), driver.size());
+	}
+	return driverHash;
+}
+
+static std::string GetProgramBinaryPath(uint64_t key)
+{
+	char tmps[64];
+	sprintf(tmps, "Cache/%08x%08x.glprogram", uint32_t(key >> 32), uint32_t(key));
+	return tmps;
+}
+
+static unsigned int LoadProgramBinary(uint64_t key)
+{
+	FILE *fp = fopen(GetProgramBinaryPath(key).c_str(), "rb");
+	if (!fp)
+		return 0;
+	uint32_t header[3] = { 0 }; // magic, format, size
+	std::vector<char> binary;
+	if (fread(header, sizeof(header), 1, fp) == 1 && header[0] == ProgramBinaryMagic)
+	{
+		binary.resize(header[2]);
+		if (binary.empty() || fread(binary.data(), binary.size(), 1, fp) != 1)
+			binary.clear();
+	}
+	fclose(fp);
+	if (binary.empty())
+		return 0;
+
+	unsigned int program = glCreateProgram();
+	glProgramBinary(program, GLenum(header[1]), binary.data(), GLsizei(binary.size()));
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		// driver update: stale binary
+		glDeleteProgram(program);
+		remove(GetProgramBinaryPath(key).c_str());
+		return 0;
+	}
+	return program;
+}
+
+static void StoreProgramBinary(uint64_t key, unsigned int program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+	FILE *fp = fopen(GetProgramBinaryPath(key).c_str(), "wb");
+	if (!fp)
+		return;
+	uint32_t header[3] = { ProgramBinaryMagic, uint32_t(format), uint32_t(length) };
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(binary.data(), binary.size(), 1, fp);
+	fclose(fp);
+}
+
+// gl_Layer written from the vertex shader, no geometry shader needed
+static const char *GetVertexLayerExtension()
+{
+	static const char *extensions[] = { "GL_ARB_shader_viewport_layer_array", "GL_AMD_vertex_shader_layer" };
+	GLint extensionCount = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+	for (GLint i = 0; i < extensionCount; i++)
+	{
+		const char *extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		for (auto name : extensions)
+		{
+			if (!strcmp(extension, name))
+				return name;
+		}
+	}
+	return NULL;
+}
+
+static unsigned int LoadProgram(const std::string& shaderText, const char *filename, uint64_t textHash)
+{
+	uint64_t driverHash = GetDriverHash();
+	if (!driverHash)
+		return LoadShader(shaderText, filename);
+	uint64_t key = HashValue(textHash, driverHash);
+	unsigned int program = LoadProgramBinary(key);
+	if (program)
+		return program;
+	program = LoadShader(shaderText, filename);
+	if (program)
+		StoreProgramBinary(key, program);
+	return program;
 }
 
 std::string Evaluators::GetEvaluator(const std::string& filename)
@@ -72,30 +254,73 @@ std::string Evaluators::GetEvaluator(const std::string& filename)
 
 void Evaluators::SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilenames)
 {
-	ClearEvaluators();
+	// GLSL programs are kept when their text didn't change, C evaluators are always rebuilt
+	for (auto& program : mEvaluatorPerNodeType)
+	{
+		if (program.mMem)
+			free(program.mMem);
+	}
 
 	mEvaluatorPerNodeType.clear();
 	mEvaluatorPerNodeType.resize(evaluatorfilenames.size(), Evaluator());
+	mEvaluatorFiles = evaluatorfilenames;
 
-	// GLSL
-	for (auto& file : evaluatorfilenames)
+	// read every source concurrently
+	const size_t fileCount = evaluatorfilenames.size();
+	std::vector<std::string> texts(fileCount);
+	std::vector<char> loaded(fileCount, 0);
+	enki::TaskSet readTask(uint32_t(fileCount), [&](enki::TaskSetPartition range, uint32_t threadnum) {
+		for (uint32_t i = range.start; i < range.end; i++)
+		{
+			const EvaluatorFile& file = evaluatorfilenames[i];
+			std::ifstream t(file.mDirectory + file.mFilename);
+			if (!t.good())
+				continue;
+			texts[i].assign((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+			loaded[i] = 1;
+		}
+	});
+	g_TS.AddTaskSetToPipe(&readTask);
+	g_TS.WaitforTask(&readTask);
+
+	std::vector<size_t> cFiles;
+	for (size_t i = 0; i < fileCount; i++)
 	{
-		if (file.mEvaluatorType != EVALUATOR_GLSL)
+		const std::string& filename = evaluatorfilenames[i].mFilename;
+		if (!loaded[i])
+		{
+			if (evaluatorfilenames[i].mEvaluatorType == EVALUATOR_C)
+				Log("%s - Unable to load file.\n", filename.c_str());
 			continue;
-		const std::string filename = file.mFilename;
+		}
+		if (mEvaluatorScripts.find(filename) == mEvaluatorScripts.end())
+			mEvaluatorScripts[filename] = EvaluatorScript(texts[i]);
+		else
+			mEvaluatorScripts[filename].mText = texts[i];
+		if (evaluatorfilenames[i].mEvaluatorType == EVALUATOR_C)
+			cFiles.push_back(i);
+	}
 
-		std::ifstream t(file.mDirectory + filename);
-		if (t.good())
+	// C, on workers while GLSL programs are linked
+	std::vector<CompiledC> compiledC(cFiles.size());
+	enki::TaskSet compileTask(uint32_t(cFiles.size()), [&](enki::TaskSetPartition range, uint32_t threadnum) {
+		for (uint32_t i = range.start; i < range.end; i++)
 		{
-			std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
-			if (mEvaluatorScripts.find(filename) == mEvaluatorScripts.end())
-				mEvaluatorScripts[filename] = EvaluatorScript(str);
-			else
-				mEvaluatorScripts[filename].mText = str;
+			size_t fileIndex = cFiles[i];
+			try
+			{
+				CompileC(evaluatorfilenames[fileIndex].mFilename, texts[fileIndex], compiledC[i]);
+			}
+			catch (...)
+			{
+				compiledC[i].mLog += "Error at compiling " + evaluatorfilenames[fileIndex].mFilename + "\n";
+			}
 		}
-	}
+	});
+	g_TS.AddTaskSetToPipe(&compileTask);
 
-	std::string baseShader = mEvaluatorScripts["Shader.glsl"].mText;
+	// GLSL
+	std::string baseShader = GetBaseShader();
 	for (auto& file : evaluatorfilenames)
 	{
 		if (file.mEvaluatorType != EVALUATOR_GLSL)
@@ -105,113 +330,316 @@ void Evaluators::SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilena
 		if (filename == "Shader.glsl")
 			continue;
 
-		EvaluatorScript& shader = mEvaluatorScripts[filename];
-		std::string shaderText = ReplaceAll(baseShader, "__NODE__", shader.mText);
-		std::string nodeName = ReplaceAll(filename, ".glsl", "");
-		shaderText = ReplaceAll(shaderText, "__FUNCTION__", nodeName + "()");
-
-		unsigned int program = LoadShader(shaderText, filename.c_str());
-
-		int parameterBlockIndex = glGetUniformBlockIndex(program, (nodeName + "Block").c_str());
-		if (parameterBlockIndex != -1)
-			glUniformBlockBinding(program, parameterBlockIndex, 1);
-
-		parameterBlockIndex = glGetUniformBlockIndex(program, "EvaluationBlock");
-		if (parameterBlockIndex != -1)
-			glUniformBlockBinding(program, parameterBlockIndex, 2);
-		shader.mProgram = program;
-		if (shader.mNodeType != -1)
-			mEvaluatorPerNodeType[shader.mNodeType].mGLSLProgram = program;
+		LinkGLSL(filename, baseShader);
 	}
 
 	if (!mEvaluationStateGLSLBuffer)
 	{
+		GLint alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		mEvaluationStateSlotSize = align(int(sizeof(EvaluationInfo)), int(alignment));
+
 		glGenBuffers(1, &mEvaluationStateGLSLBuffer);
 		glBindBuffer(GL_UNIFORM_BUFFER, mEvaluationStateGLSLBuffer);
-
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(EvaluationInfo), NULL, GL_DYNAMIC_DRAW);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 2, mEvaluationStateGLSLBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, mEvaluationStateSlotSize * EvaluationStateSlotCount, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferRange(GL_UNIFORM_BUFFER, 2, mEvaluationStateGLSLBuffer, 0, sizeof(EvaluationInfo));
 		glBindBuffer(GL_UNIFORM_BUFFER, 0);
 	}
 
-	// C
-	for (auto& file : evaluatorfilenames)
+	g_TS.WaitforTask(&compileTask);
+	for (size_t i = 0; i < cFiles.size(); i++)
 	{
-		if (file.mEvaluatorType != EVALUATOR_C)
-			continue;
-		const std::string filename = file.mFilename;
-		try
-		{
-			std::ifstream t(file.mDirectory + filename);
-			if (!t.good())
-			{
-				Log("%s - Unable to load file.\n", filename.c_str());
-				continue;
-			}
-			std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
-			if (mEvaluatorScripts.find(filename) == mEvaluatorScripts.end())
-				mEvaluatorScripts[filename] = EvaluatorScript(str);
-			else
-				mEvaluatorScripts[filename].mText = str;
+		const std::string& filename = evaluatorfilenames[cFiles[i]].mFilename;
+		CompiledC& compiled = compiledC[i];
+		if (!compiled.mLog.empty())
+			Log("%s", compiled.mLog.c_str());
+		if (compiled.mMem)
+			Log("%s compiled in %.2f ms\n", filename.c_str(), compiled.mTime);
 
-			EvaluatorScript& program = mEvaluatorScripts[filename];
-			TCCState *s = tcc_new();
+		ApplyC(filename, compiled);
+	}
+}
 
-			int *noLib = (int*)s;
-			noLib[2] = 1; // no stdlib
+std::string Evaluators::GetBaseShader()
+{
+	static const char *vertexLayerExtension = GetVertexLayerExtension();
+	mbLayeredRendering = vertexLayerExtension != NULL;
+	if (!mbLayeredRendering)
+		return mEvaluatorScripts["Shader.glsl"].mText;
+	return std::string("#ifdef VERTEX_SHADER\n#extension ") + vertexLayerExtension + " : enable\n#define LAYERED_RENDERING\n#endif\n" + mEvaluatorScripts["Shader.glsl"].mText;
+}
 
-			tcc_set_error_func(s, 0, libtccErrorFunc);
-			tcc_add_include_path(s, "C");
-			tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+bool Evaluators::LinkGLSL(const std::string& filename, const std::string& baseShader)
+{
+	bool linked = false;
+	EvaluatorScript& shader = mEvaluatorScripts[filename];
+	std::string shaderText = ReplaceAll(baseShader, "__NODE__", shader.mText);
+	std::string nodeName = ReplaceAll(filename, ".glsl", "");
+	shaderText = ReplaceAll(shaderText, "__FUNCTION__", nodeName + "()");
+	uint64_t hash = Hash(shaderText.c_str(), shaderText.size());
+	if (!shader.mProgram || shader.mHash != hash)
+	{
+		unsigned int program = LoadProgram(shaderText, filename.c_str(), hash);
+		if (!program && shader.mProgram)
+		{
+			// compile or link error: keep the previous version running, like C evaluators
+			Log("%s - previous version kept\n", filename.c_str());
+		}
+		else
+		{
+			if (shader.mProgram)
+				glDeleteProgram(shader.mProgram);
 
-			if (tcc_compile_string(s, program.mText.c_str()) != 0)
-			{
-				Log("%s - Compilation error!\n", filename.c_str());
-				continue;
-			}
+			int parameterBlockIndex = glGetUniformBlockIndex(program, (nodeName + "Block").c_str());
+			if (parameterBlockIndex != -1)
+				glUniformBlockBinding(program, parameterBlockIndex, 1);
 
-			for (auto& evaluationFunction : evaluationFunctions)
-				tcc_add_symbol(s, evaluationFunction.szFunctionName, evaluationFunction.function);
+			parameterBlockIndex = glGetUniformBlockIndex(program, "EvaluationBlock");
+			if (parameterBlockIndex != -1)
+				glUniformBlockBinding(program, parameterBlockIndex, 2);
 
-			int size = tcc_relocate(s, NULL);
-			if (size == -1)
+			// samplers get consecutive texture units in declaration order
+			shader.mSamplerCount = 0;
+			for (auto name : samplerName)
 			{
-				Log("%s - Libtcc unable to relocate program!\n", filename.c_str());
-				continue;
+				int location = glGetUniformLocation(program, name);
+				if (location != -1)
+					glProgramUniform1i(program, location, shader.mSamplerCount++);
 			}
-			program.mMem = malloc(size);
-			tcc_relocate(s, program.mMem);
+			// viewRot holds a single face per draw, GetViewRot() works for every instance
+			shader.mbLayered = shader.mText.find("viewRot") == std::string::npos;
+			shader.mProgram = program;
+			shader.mHash = hash;
+			linked = true;
+		}
+	}
+	if (shader.mNodeType != -1)
+	{
+		mEvaluatorPerNodeType[shader.mNodeType].mGLSLProgram = shader.mProgram;
+		mEvaluatorPerNodeType[shader.mNodeType].mSamplerCount = shader.mSamplerCount;
+		mEvaluatorPerNodeType[shader.mNodeType].mbLayered = shader.mbLayered;
+		mEvaluatorPerNodeType[shader.mNodeType].mGLSLHash = shader.mHash;
+	}
+	return linked;
+}
+
+void Evaluators::ApplyC(const std::string& filename, CompiledC& compiled)
+{
+	EvaluatorScript& program = mEvaluatorScripts[filename];
+	program.mHash = Hash(program.mText.c_str(), program.mText.size());
+	program.mMem = compiled.mMem;
+	program.mCFunction = compiled.mCFunction;
+	if (program.mNodeType != -1)
+	{
+		mEvaluatorPerNodeType[program.mNodeType].mCFunction = program.mCFunction;
+		mEvaluatorPerNodeType[program.mNodeType].mMem = program.mMem;
+		mEvaluatorPerNodeType[program.mNodeType].mCHash = program.mHash;
+	}
+}
 
-			*(void**)(&program.mCFunction) = tcc_get_symbol(s, "main");
-			if (!program.mCFunction)
+int Evaluators::ReloadEvaluator(const std::string& filename)
+{
+	auto fileIter = std::find_if(mEvaluatorFiles.begin(), mEvaluatorFiles.end(), [&](const EvaluatorFile& file) { return file.mFilename == filename; });
+	if (fileIter == mEvaluatorFiles.end())
+		return ReloadUnchanged;
+	const EvaluatorFile& file = *fileIter;
+	std::ifstream t(file.mDirectory + filename);
+	if (!t.good())
+	{
+		Log("%s - Unable to load file.\n", filename.c_str());
+		return ReloadUnchanged;
+	}
+	std::string text((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+	EvaluatorScript& script = mEvaluatorScripts[filename];
+	script.mText = text;
+
+	if (file.mEvaluatorType == EVALUATOR_GLSL)
+	{
+		// base shader: every program but only the ones with a different text are linked again
+		std::string baseShader = GetBaseShader();
+		if (filename == "Shader.glsl")
+		{
+			bool linked = false;
+			for (auto& glslFile : mEvaluatorFiles)
 			{
-				Log("%s - No main function!\n", filename.c_str());
+				if (glslFile.mEvaluatorType == EVALUATOR_GLSL && glslFile.mFilename != "Shader.glsl")
+					linked |= LinkGLSL(glslFile.mFilename, baseShader);
 			}
-			tcc_delete(s);
+			return linked ? -1 : ReloadUnchanged;
+		}
+		return LinkGLSL(filename, baseShader) ? script.mNodeType : ReloadUnchanged;
+	}
+
+	// saving twice or a watcher event after an F5 save: nothing to compile
+	uint64_t hash = Hash(text.c_str(), text.size());
+	if (script.mMem && script.mHash == hash)
+		return ReloadUnchanged;
 
-			if (program.mNodeType != -1)
+	CompiledC compiled;
+	CompileC(filename, text, compiled);
+	if (!compiled.mLog.empty())
+		Log("%s", compiled.mLog.c_str());
+	if (!compiled.mMem)
+		return ReloadUnchanged; // keep the previous version running
+	Log("%s compiled in %.2f ms\n", filename.c_str(), compiled.mTime);
+	void *previousMem = script.mMem;
+	ApplyC(filename, compiled);
+	if (previousMem)
+	{
+		// jobs spawned by the previous version may still run its code
+		g_TS.WaitforAll();
+		free(previousMem);
+	}
+	return script.mNodeType;
+}
+
+#ifdef __linux__
+void Evaluators::SetWatchFiles(bool watch)
+{
+	if (watch == mbWatchFiles)
+		return;
+	mbWatchFiles = watch;
+	if (!watch)
+	{
+		close(mInotify);
+		mInotify = -1;
+		mWatchDirectories.clear();
+		return;
+	}
+	mInotify = inotify_init1(IN_NONBLOCK);
+	if (mInotify == -1)
+	{
+		Log("Unable to watch evaluator files.\n");
+		mbWatchFiles = false;
+		return;
+	}
+	for (auto& file : mEvaluatorFiles)
+	{
+		bool watched = false;
+		for (auto& directory : mWatchDirectories)
+			watched |= directory.second == file.mDirectory;
+		if (watched)
+			continue;
+		int wd = inotify_add_watch(mInotify, file.mDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd != -1)
+			mWatchDirectories[wd] = file.mDirectory;
+	}
+}
+
+void Evaluators::PollWatchedFiles(std::vector<std::string>& changedFiles)
+{
+	if (!mbWatchFiles)
+		return;
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (true)
+	{
+		ssize_t len = read(mInotify, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+		for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+		{
+			const struct inotify_event *event = (const struct inotify_event *)ptr;
+			if (!event->len)
+				continue;
+			std::string filename = event->name;
+			for (auto& file : mEvaluatorFiles)
 			{
-				mEvaluatorPerNodeType[program.mNodeType].mCFunction = program.mCFunction;
-				mEvaluatorPerNodeType[program.mNodeType].mMem = program.mMem;
+				if (file.mFilename == filename && mWatchDirectories[event->wd] == file.mDirectory
+					&& std::find(changedFiles.begin(), changedFiles.end(), filename) == changedFiles.end())
+					changedFiles.push_back(filename);
 			}
 		}
-		catch (...)
+	}
+}
+#else
+// no change notification: modification times are compared once per second
+void Evaluators::SetWatchFiles(bool watch)
+{
+	mbWatchFiles = watch;
+	mFileTimes.clear();
+	if (!watch)
+		return;
+	for (auto& file : mEvaluatorFiles)
+	{
+		struct stat st;
+		if (!stat((file.mDirectory + file.mFilename).c_str(), &st))
+			mFileTimes[file.mFilename] = int64_t(st.st_mtime);
+	}
+	mLastPoll = std::chrono::steady_clock::now();
+}
+
+void Evaluators::PollWatchedFiles(std::vector<std::string>& changedFiles)
+{
+	if (!mbWatchFiles)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	if (now - mLastPoll < std::chrono::seconds(1))
+		return;
+	mLastPoll = now;
+	for (auto& file : mEvaluatorFiles)
+	{
+		struct stat st;
+		if (stat((file.mDirectory + file.mFilename).c_str(), &st))
+			continue;
+		int64_t& fileTime = mFileTimes[file.mFilename];
+		if (fileTime != int64_t(st.st_mtime))
+		{
+			fileTime = int64_t(st.st_mtime);
+			changedFiles.push_back(file.mFilename);
+		}
+	}
+}
+#endif
+
+void Evaluators::BindEvaluationInfo(const EvaluationInfo& evaluationInfo)
+{
+	// glBufferStorage isn't available with GL 4.3: unsynchronized maps instead of a persistent one.
+	// Entering a segment waits for the draws that used it one lap before
+	static const size_t SlotsPerSegment = EvaluationStateSlotCount / EvaluationStateSegmentCount;
+	if (!(mEvaluationStateIndex % SlotsPerSegment))
+	{
+		size_t segment = mEvaluationStateIndex / SlotsPerSegment;
+		size_t previousSegment = (segment + EvaluationStateSegmentCount - 1) % EvaluationStateSegmentCount;
+		if (!mEvaluationStateFences[previousSegment])
+			mEvaluationStateFences[previousSegment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		GLsync fence = (GLsync)mEvaluationStateFences[segment];
+		if (fence)
 		{
-			Log("Error at compiling %s", filename.c_str());
+			glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+			glDeleteSync(fence);
+			mEvaluationStateFences[segment] = NULL;
 		}
 	}
+
+	size_t offset = mEvaluationStateIndex * mEvaluationStateSlotSize;
+	glBindBuffer(GL_UNIFORM_BUFFER, mEvaluationStateGLSLBuffer);
+	void *ptr = glMapBufferRange(GL_UNIFORM_BUFFER, offset, sizeof(EvaluationInfo), GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (ptr)
+	{
+		memcpy(ptr, &evaluationInfo, sizeof(EvaluationInfo));
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferRange(GL_UNIFORM_BUFFER, 2, mEvaluationStateGLSLBuffer, offset, sizeof(EvaluationInfo));
+	mEvaluationStateIndex = (mEvaluationStateIndex + 1) % EvaluationStateSlotCount;
 }
 
 void Evaluators::ClearEvaluators()
 {
 	// clear
+	for (auto& script : mEvaluatorScripts)
+	{
+		if (script.second.mProgram)
+			glDeleteProgram(script.second.mProgram);
+		script.second.mProgram = 0;
+		script.second.mMem = 0;
+	}
 	for (auto& program : mEvaluatorPerNodeType)
 	{
-		if (program.mGLSLProgram)
-			glDeleteProgram(program.mGLSLProgram);
 		if (program.mMem)
 			free(program.mMem);
 	}
+	mEvaluatorPerNodeType.clear();
 }
 
 int Evaluators::GetMask(size_t nodeType, const std::string& nodeName)
@@ -225,6 +653,9 @@ int Evaluators::GetMask(size_t nodeType, const std::string& nodeName)
 		//evaluation.mTarget = new RenderTarget;
 		//mAllocatedRenderTargets.push_back(evaluation.mTarget);
 		mEvaluatorPerNodeType[nodeType].mGLSLProgram = iter->second.mProgram;
+		mEvaluatorPerNodeType[nodeType].mSamplerCount = iter->second.mSamplerCount;
+		mEvaluatorPerNodeType[nodeType].mbLayered = iter->second.mbLayered;
+		mEvaluatorPerNodeType[nodeType].mGLSLHash = iter->second.mHash;
 	}
 	iter = mEvaluatorScripts.find(nodeName + ".c");
 	if (iter != mEvaluatorScripts.end())
@@ -233,6 +664,7 @@ int Evaluators::GetMask(size_t nodeType, const std::string& nodeName)
 		iter->second.mNodeType = int(nodeType);
 		mEvaluatorPerNodeType[nodeType].mCFunction = iter->second.mCFunction;
 		mEvaluatorPerNodeType[nodeType].mMem = iter->second.mMem;
+		mEvaluatorPerNodeType[nodeType].mCHash = iter->second.mHash;
 	}
 
 	return mask;
@@ -27,44 +27,91 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <chrono>
+#include <string.h>
 #include "Imogen.h"
 
+struct CompiledC;
+
+struct EvaluationInfo;
+
 struct Evaluator
 {
-	Evaluator() : mGLSLProgram(0), mCFunction(0), mMem(0) {}
+	Evaluator() : mGLSLProgram(0), mSamplerCount(0), mbLayered(false), mCFunction(0), mMem(0), mGLSLHash(0), mCHash(0) {}
 	unsigned int mGLSLProgram;
+	int mSamplerCount; // samplers used by the program, bound to texture units 0..mSamplerCount-1 at link time
+	bool mbLayered; // doesn't read EvaluationParam.viewRot, cube faces can be rendered in a single layered draw
 	int(*mCFunction)(void *parameters, void *evaluationInfo);
 	void *mMem;
+	// source hashes. Part of the node output keys so editing a shader invalidates cached outputs
+	uint64_t mGLSLHash;
+	uint64_t mCHash;
 };
 
 struct Evaluators
 {
-	Evaluators() : mEvaluationStateGLSLBuffer(0) {}
+	Evaluators() : mEvaluationStateGLSLBuffer(0), mbLayeredRendering(false), mEvaluationStateSlotSize(0), mEvaluationStateIndex(0), mbWatchFiles(false), mInotify(-1)
+	{
+		memset(mEvaluationStateFences, 0, sizeof(mEvaluationStateFences));
+	}
 	void SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilenames);
 	std::string GetEvaluator(const std::string& filename);
 	int GetMask(size_t nodeType, const std::string& nodeName);
 	void ClearEvaluators();
 
+	// recompiles a single file. Returns the node type using it, -1 when every node type is affected,
+	// ReloadUnchanged when no program or function was replaced
+	int ReloadEvaluator(const std::string& filename);
+	enum { ReloadUnchanged = -2 };
+
+	// external edits trigger the same reload. inotify on Linux, modification time polling otherwise
+	void SetWatchFiles(bool watch);
+	bool IsWatchingFiles() const { return mbWatchFiles; }
+	void PollWatchedFiles(std::vector<std::string>& changedFiles);
+
 	const Evaluator& GetEvaluator(size_t nodeType) const { return mEvaluatorPerNodeType[nodeType]; }
 
 	unsigned int mEvaluationStateGLSLBuffer;
+	bool mbLayeredRendering; // vertex shaders can select the layer: cube targets are rendered with a single draw
+	// EvaluationInfo of each draw goes to its own slot of a ring buffer, bound at uniform block 2
+	void BindEvaluationInfo(const EvaluationInfo& evaluationInfo);
 
 protected:
 
 	struct EvaluatorScript
 	{
-		EvaluatorScript() : mProgram(0), mCFunction(0), mMem(0), mNodeType(-1) {}
-		EvaluatorScript(const std::string & text) : mText(text), mProgram(0), mCFunction(0), mMem(0), mNodeType(-1) {}
+		EvaluatorScript() : mProgram(0), mSamplerCount(0), mbLayered(false), mCFunction(0), mMem(0), mNodeType(-1), mHash(0) {}
+		EvaluatorScript(const std::string & text) : mText(text), mProgram(0), mSamplerCount(0), mbLayered(false), mCFunction(0), mMem(0), mNodeType(-1), mHash(0) {}
 		~EvaluatorScript() { if (mMem) free(mMem); };
 		std::string mText;
 		unsigned int mProgram;
+		int mSamplerCount;
+		bool mbLayered;
 		int(*mCFunction)(void *parameters, void *evaluationInfo);
 		void *mMem;
 		int mNodeType;
+		uint64_t mHash;
 	};
 
+	std::string GetBaseShader();
+	bool LinkGLSL(const std::string& filename, const std::string& baseShader); // true when a new program is in use
+	void ApplyC(const std::string& filename, CompiledC& compiled);
+
 	std::map<std::string, EvaluatorScript> mEvaluatorScripts;
 	std::vector<Evaluator> mEvaluatorPerNodeType;
+	std::vector<EvaluatorFile> mEvaluatorFiles;
+
+	static const size_t EvaluationStateSlotCount = 1024;
+	static const size_t EvaluationStateSegmentCount = 4;
+	size_t mEvaluationStateSlotSize;
+	size_t mEvaluationStateIndex;
+	void *mEvaluationStateFences[EvaluationStateSegmentCount]; // GLsync, one per ring segment
+
+	bool mbWatchFiles;
+	int mInotify;
+	std::map<int, std::string> mWatchDirectories;
+	std::map<std::string, int64_t> mFileTimes;
+	std::chrono::steady_clock::time_point mLastPoll;
 };
 
 extern Evaluators gEvaluators;
@@ -0,0 +1,354 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include "ImageCodec.h"
+#include "TaskScheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern enki::TaskScheduler g_TS;
+
+static const uint32_t ImageCodecMagic = 0x49514D49; // 'IMQI'
+static const uint32_t StripHeight = 64;
+
+struct ImageCodecHeader
+{
+	uint32_t mMagic;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mStripCount;
+	// followed by the encoded size of each strip then by the strips
+};
+
+enum : uint8_t
+{
+	OP_INDEX = 0x00,
+	OP_DIFF = 0x40,
+	OP_LUMA = 0x80,
+	OP_RUN = 0xC0,
+	OP_RGB = 0xFE,
+	OP_RGBA = 0xFF,
+	OP_MASK = 0xC0
+};
+
+union Pixel
+{
+	struct { uint8_t r, g, b, a; };
+	uint32_t v;
+};
+
+static inline uint32_t PixelHash(const Pixel& px)
+{
+	return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) & 63;
+}
+
+// worst case is OP_RGBA for every pixel
+static size_t GetMaxStripSize(uint32_t pixelCount)
+{
+	return size_t(pixelCount) * 5;
+}
+
+static size_t EncodeStrip(const uint8_t *rgba, uint32_t pixelCount, uint8_t *dst)
+{
+	Pixel index[64];
+	memset(index, 0, sizeof(index));
+	Pixel previous;
+	previous.v = 0;
+	previous.a = 255;
+	uint8_t *out = dst;
+	uint32_t run = 0;
+	for (uint32_t i = 0; i < pixelCount; i++)
+	{
+		Pixel px;
+		memcpy(&px, rgba + i * 4, 4);
+		if (px.v == previous.v)
+		{
+			run++;
+			if (run == 62 || i == pixelCount - 1)
+			{
+				*out++ = OP_RUN | uint8_t(run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run)
+		{
+			*out++ = OP_RUN | uint8_t(run - 1);
+			run = 0;
+		}
+
+		uint32_t hash = PixelHash(px);
+		if (index[hash].v == px.v)
+		{
+			*out++ = OP_INDEX | uint8_t(hash);
+		}
+		else
+		{
+			index[hash] = px;
+			if (px.a == previous.a)
+			{
+				int8_t vr = int8_t(px.r - previous.r);
+				int8_t vg = int8_t(px.g - previous.g);
+				int8_t vb = int8_t(px.b - previous.b);
+				int8_t vgr = int8_t(vr - vg);
+				int8_t vgb = int8_t(vb - vg);
+				if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+				{
+					*out++ = OP_DIFF | uint8_t(((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+				}
+				else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+				{
+					*out++ = OP_LUMA | uint8_t(vg + 32);
+					*out++ = uint8_t(((vgr + 8) << 4) | (vgb + 8));
+				}
+				else
+				{
+					*out++ = OP_RGB;
+					*out++ = px.r;
+					*out++ = px.g;
+					*out++ = px.b;
+				}
+			}
+			else
+			{
+				*out++ = OP_RGBA;
+				memcpy(out, &px, 4);
+				out += 4;
+			}
+		}
+		previous = px;
+	}
+	return size_t(out - dst);
+}
+
+static bool DecodeStrip(const uint8_t *src, size_t size, uint8_t *rgba, uint32_t pixelCount)
+{
+	Pixel index[64];
+	memset(index, 0, sizeof(index));
+	Pixel px;
+	px.v = 0;
+	px.a = 255;
+	const uint8_t *end = src + size;
+	uint32_t i = 0;
+	while (i < pixelCount)
+	{
+		if (src >= end)
+			return false;
+		uint8_t op = *src++;
+		uint32_t run = 1;
+		if (op == OP_RGB)
+		{
+			if (end - src < 3)
+				return false;
+			px.r = src[0];
+			px.g = src[1];
+			px.b = src[2];
+			src += 3;
+		}
+		else if (op == OP_RGBA)
+		{
+			if (end - src < 4)
+				return false;
+			memcpy(&px, src, 4);
+			src += 4;
+		}
+		else if ((op & OP_MASK) == OP_INDEX)
+		{
+			px = index[op];
+		}
+		else if ((op & OP_MASK) == OP_DIFF)
+		{
+			px.r += ((op >> 4) & 3) - 2;
+			px.g += ((op >> 2) & 3) - 2;
+			px.b += (op & 3) - 2;
+		}
+		else if ((op & OP_MASK) == OP_LUMA)
+		{
+			if (src >= end)
+				return false;
+			int vg = (op & 0x3F) - 32;
+			uint8_t diff = *src++;
+			px.r += vg - 8 + ((diff >> 4) & 0xF);
+			px.g += vg;
+			px.b += vg - 8 + (diff & 0xF);
+		}
+		else
+		{
+			run = (op & 0x3F) + 1;
+			if (run > pixelCount - i)
+				return false;
+		}
+		index[PixelHash(px)] = px;
+		for (uint32_t j = 0; j < run; j++, i++)
+			memcpy(rgba + i * 4, &px, 4);
+	}
+	return src == end;
+}
+
+struct ImageCodecTaskSet : enki::ITaskSet
+{
+	ImageCodecTaskSet(uint32_t width, uint32_t height, uint32_t stripCount) : enki::ITaskSet(stripCount), mWidth(width), mHeight(height)
+		, mStripSources(stripCount), mStripSizes(stripCount), mbSuccess(true)
+	{
+	}
+	uint32_t GetStripPixelCount(uint32_t strip) const
+	{
+		uint32_t rows = (strip == m_SetSize - 1) ? (mHeight - strip * StripHeight) : StripHeight;
+		return rows * mWidth;
+	}
+	uint32_t mWidth;
+	uint32_t mHeight;
+	std::vector<const uint8_t*> mStripSources;
+	std::vector<size_t> mStripSizes;
+	bool mbSuccess;
+};
+
+struct EncodeTaskSet : ImageCodecTaskSet
+{
+	EncodeTaskSet(const uint8_t *rgba, uint32_t width, uint32_t height, uint32_t stripCount) : ImageCodecTaskSet(width, height, stripCount), mRGBA(rgba), mStrips(stripCount)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		for (uint32_t strip = range.start; strip < range.end; strip++)
+		{
+			uint32_t pixelCount = GetStripPixelCount(strip);
+			std::vector<uint8_t>& encoded = mStrips[strip];
+			encoded.resize(GetMaxStripSize(pixelCount));
+			mStripSizes[strip] = EncodeStrip(mRGBA + size_t(strip) * StripHeight * mWidth * 4, pixelCount, encoded.data());
+			// only a few worst case buffers exist at a time
+			encoded.resize(mStripSizes[strip]);
+			encoded.shrink_to_fit();
+		}
+	}
+	const uint8_t *mRGBA;
+	std::vector<std::vector<uint8_t> > mStrips;
+};
+
+struct DecodeTaskSet : ImageCodecTaskSet
+{
+	DecodeTaskSet(uint8_t *rgba, uint32_t width, uint32_t height, uint32_t stripCount) : ImageCodecTaskSet(width, height, stripCount), mRGBA(rgba)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		for (uint32_t strip = range.start; strip < range.end; strip++)
+		{
+			// a failing strip is only reported, other tasks keep running
+			if (!DecodeStrip(mStripSources[strip], mStripSizes[strip], mRGBA + size_t(strip) * StripHeight * mWidth * 4, GetStripPixelCount(strip)))
+				mbSuccess = false;
+		}
+	}
+	uint8_t *mRGBA;
+};
+
+bool IsImageCodecBlob(const void *data, size_t size)
+{
+	uint32_t magic;
+	if (size < sizeof(ImageCodecHeader))
+		return false;
+	memcpy(&magic, data, sizeof(uint32_t));
+	return magic == ImageCodecMagic;
+}
+
+bool ImageCodecEncode(const uint8_t *rgba, int width, int height, std::vector<uint8_t>& blob)
+{
+	if (!rgba || width <= 0 || height <= 0)
+		return false;
+	ImageCodecHeader header = { ImageCodecMagic, uint32_t(width), uint32_t(height), (uint32_t(height) + StripHeight - 1) / StripHeight };
+
+	EncodeTaskSet encodeTask(rgba, header.mWidth, header.mHeight, header.mStripCount);
+	g_TS.AddTaskSetToPipe(&encodeTask);
+	g_TS.WaitforTask(&encodeTask);
+
+	size_t tableSize = sizeof(uint32_t) * header.mStripCount;
+	size_t blobSize = sizeof(ImageCodecHeader) + tableSize;
+	for (auto stripSize : encodeTask.mStripSizes)
+		blobSize += stripSize;
+	blob.resize(blobSize);
+	uint8_t *dst = blob.data();
+	memcpy(dst, &header, sizeof(ImageCodecHeader));
+	dst += sizeof(ImageCodecHeader);
+	for (auto stripSize : encodeTask.mStripSizes)
+	{
+		uint32_t size = uint32_t(stripSize);
+		memcpy(dst, &size, sizeof(uint32_t));
+		dst += sizeof(uint32_t);
+	}
+	for (uint32_t strip = 0; strip < header.mStripCount; strip++)
+	{
+		memcpy(dst, encodeTask.mStrips[strip].data(), encodeTask.mStripSizes[strip]);
+		dst += encodeTask.mStripSizes[strip];
+	}
+	return true;
+}
+
+uint8_t *ImageCodecDecode(const void *data, size_t size, int *width, int *height)
+{
+	if (!IsImageCodecBlob(data, size))
+		return NULL;
+	ImageCodecHeader header;
+	memcpy(&header, data, sizeof(ImageCodecHeader));
+	if (!header.mWidth || !header.mHeight || header.mWidth > 65536 || header.mHeight > 65536
+		|| header.mStripCount != (header.mHeight + StripHeight - 1) / StripHeight)
+		return NULL;
+
+	size_t tableSize = sizeof(uint32_t) * header.mStripCount;
+	if (size < sizeof(ImageCodecHeader) + tableSize)
+		return NULL;
+	const uint8_t *table = (const uint8_t*)data + sizeof(ImageCodecHeader);
+	const uint8_t *src = table + tableSize;
+	size_t remaining = size - sizeof(ImageCodecHeader) - tableSize;
+
+	uint8_t *rgba = (uint8_t*)malloc(size_t(header.mWidth) * header.mHeight * 4);
+	if (!rgba)
+		return NULL;
+	DecodeTaskSet decodeTask(rgba, header.mWidth, header.mHeight, header.mStripCount);
+	for (uint32_t strip = 0; strip < header.mStripCount; strip++)
+	{
+		uint32_t stripSize;
+		memcpy(&stripSize, table + strip * sizeof(uint32_t), sizeof(uint32_t));
+		if (stripSize > remaining)
+		{
+			free(rgba);
+			return NULL;
+		}
+		decodeTask.mStripSources[strip] = src;
+		decodeTask.mStripSizes[strip] = stripSize;
+		src += stripSize;
+		remaining -= stripSize;
+	}
+
+	g_TS.AddTaskSetToPipe(&decodeTask);
+	g_TS.WaitforTask(&decodeTask);
+	if (!decodeTask.mbSuccess)
+	{
+		free(rgba);
+		return NULL;
+	}
+	*width = int(header.mWidth);
+	*height = int(header.mHeight);
+	return rgba;
+}
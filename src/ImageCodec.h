@@ -0,0 +1,38 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+// lossless codec of the images stored in the library: node images and thumbnails.
+// QOI opcodes over horizontal strips of RGBA8 pixels, each strip is encoded and decoded by its own task.
+// Blobs start with a magic so PNG blobs written by previous versions are still recognized
+bool IsImageCodecBlob(const void *data, size_t size);
+bool ImageCodecEncode(const uint8_t *rgba, int width, int height, std::vector<uint8_t>& blob);
+// returns malloc'ed RGBA8 bits or NULL when the blob is invalid
+uint8_t *ImageCodecDecode(const void *data, size_t size, int *width, int *height);
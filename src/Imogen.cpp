@@ -39,6 +39,11 @@
 #include "imgui_stdlib.h"
 #include "ImSequencer.h"
 #include "Evaluators.h"
+#include "Profiler.h"
+#include "DiskCache.h"
+#include "ThumbnailAtlas.h"
+#include <atomic>
+#include <algorithm>
 
 unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len);
 extern Evaluation gEvaluation;
@@ -218,10 +223,17 @@ void DebugLogText(const char *szText)
 	imguiLog.AddLog(szText);
 }
 
-void Imogen::HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
+static int currentShaderIndex = -1;
+
+void Imogen::ReloadEvaluator(const std::string& filename, TileNodeEditGraphDelegate &nodeGraphDelegate)
 {
-	static int currentShaderIndex = -1;
+	int nodeType = gEvaluators.ReloadEvaluator(filename);
+	if (nodeType != Evaluators::ReloadUnchanged)
+		nodeGraphDelegate.ReloadNodes(nodeType);
+}
 
+void Imogen::HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
+{
 	if (currentShaderIndex == -1)
 	{
 		currentShaderIndex = 0;
@@ -251,11 +263,18 @@ void Imogen::HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGra
 		t << textToSave;
 		t.close();
 
-		// TODO
-		gEvaluators.SetEvaluators(mEvaluatorFiles);
-		nodeGraphDelegate.InvalidateParameters();
+		ReloadEvaluator(mEvaluatorFiles[currentShaderIndex].mFilename, nodeGraphDelegate);
 	}
 
+	bool watchFiles = gEvaluators.IsWatchingFiles();
+	if (ImGui::Checkbox("Watch files", &watchFiles))
+	{
+		gEvaluators.SetWatchFiles(watchFiles);
+	}
+	if (ImGui::IsItemHovered())
+	{
+		ImGui::SetTooltip("Reload nodes when their file is modified by another editor.");
+	}
 	ImGui::SameLine();
 	ImGui::Text("%6d/%-6d %6d lines  | %s | %s | %s | F5 to save and update nodes", cpos.mLine + 1, cpos.mColumn + 1, editor.GetTotalLines(),
 		editor.IsOverwrite() ? "Ovr" : "Ins",
@@ -276,6 +295,9 @@ void RenderPreviewNode(int selNode, TileNodeEditGraphDelegate& nodeGraphDelegate
 	float w = ImGui::GetWindowContentRegionWidth();
 	int imageWidth(1), imageHeight(1);
 
+	if (selNode != -1)
+		nodeGraphDelegate.mEditingContext.RequestTarget(selNode, true);
+
 	// make 2 evaluation for node to get the UI pass image size
 	if (selNode != -1 && nodeGraphDelegate.NodeHasUI(selNode))
 	{
@@ -358,28 +380,6 @@ void NodeEdit(TileNodeEditGraphDelegate& nodeGraphDelegate, Evaluation& evaluati
 		nodeGraphDelegate.EditNode();
 }
 
-template <typename T, typename Ty> struct SortedResource
-{
-	SortedResource() {}
-	SortedResource(unsigned int index, const std::vector<T, Ty>* res) : mIndex(index), mRes(res) {}
-	SortedResource(const SortedResource& other) : mIndex(other.mIndex), mRes(other.mRes) {}
-	void operator = (const SortedResource& other) { mIndex = other.mIndex; mRes = other.mRes; }
-	unsigned int mIndex;
-	const std::vector<T, Ty>* mRes;
-	bool operator < (const SortedResource& other) const
-	{
-		return (*mRes)[mIndex].mName<(*mRes)[other.mIndex].mName;
-	}
-
-	static void ComputeSortedResources(const std::vector<T, Ty>& res, std::vector<SortedResource>& sortedResources)
-	{
-		sortedResources.resize(res.size());
-		for (unsigned int i = 0; i < res.size(); i++)
-			sortedResources[i] = SortedResource<T, Ty>(i, &res);
-		std::sort(sortedResources.begin(), sortedResources.end());
-	}
-};
-
 std::string GetGroup(const std::string &name)
 {
 	for (int i = int(name.length()) - 1; i >= 0; i--)
@@ -404,79 +404,179 @@ std::string GetName(const std::string &name)
 	return name;
 }
 
+// resources sorted by name and split in runs of the same group. Rebuilt only when the library generation changes
+template <typename T, typename Ty> struct SortedResources
+{
+	struct Group
+	{
+		std::string mName;
+		unsigned int mFirst; // in mSorted
+		unsigned int mCount;
+	};
+
+	SortedResources() : mGeneration(0) {}
+
+	void Update(const std::vector<T, Ty>& res, unsigned int generation)
+	{
+		if (generation == mGeneration && res.size() == mSorted.size())
+			return;
+		mGeneration = generation;
+
+		mSorted.resize(res.size());
+		for (unsigned int i = 0; i < res.size(); i++)
+			mSorted[i] = i;
+		std::sort(mSorted.begin(), mSorted.end(), [&res](unsigned int a, unsigned int b) { return res[a].mName < res[b].mName; });
+
+		mNames.resize(res.size());
+		mGroups.clear();
+		for (unsigned int i = 0; i < mSorted.size(); i++)
+		{
+			const std::string& name = res[mSorted[i]].mName;
+			std::string group = GetGroup(name);
+			mNames[i] = GetName(name);
+			if (mGroups.empty() || mGroups.back().mName != group)
+				mGroups.push_back({ group, i, 0 });
+			mGroups.back().mCount++;
+		}
+	}
+
+	std::vector<unsigned int> mSorted;
+	std::vector<std::string> mNames; // displayed name, per sorted entry
+	std::vector<Group> mGroups;
+	unsigned int mGeneration;
+};
+
 struct PinnedTaskUploadImage : enki::IPinnedTask
 {
-	PinnedTaskUploadImage(Image image, ASyncId identifier, bool isThumbnail)
+	PinnedTaskUploadImage(Image image, ASyncId identifier)
 		: enki::IPinnedTask(0) // set pinned thread to 0
 		, mImage(image)
 		, mIdentifier(identifier)
-		, mbIsThumbnail(isThumbnail)
 	{
 	}
 
 	virtual void Execute()
 	{
-		unsigned int textureId = Evaluation::UploadImage(&mImage, 0);
-		if (mbIsThumbnail)
-		{
-			Material* material = library.Get(mIdentifier);
-			if (material)
-				material->mThumbnailTextureId = textureId;
-		}
-		else
+		TileNodeEditGraphDelegate::ImogenNode *node = TileNodeEditGraphDelegate::GetInstance()->Get(mIdentifier);
+		if (node)
 		{
-			TileNodeEditGraphDelegate::ImogenNode *node = TileNodeEditGraphDelegate::GetInstance()->Get(mIdentifier);
-			if (node)
-			{
-				Evaluation::SetEvaluationImage(int(node->mEvaluationTarget), &mImage);
-				gEvaluation.SetEvaluationParameters(node->mEvaluationTarget, node->mParameters, node->mParametersSize);
-				gCurrentContext->StageSetProcessing(node->mEvaluationTarget, false);
-			}
-			Evaluation::FreeImage(&mImage);
+			Evaluation::SetEvaluationImage(int(node->mEvaluationTarget), &mImage);
+			gEvaluation.SetEvaluationParameters(node->mEvaluationTarget, node->mParameters, node->mParametersSize);
+			gCurrentContext->StageSetProcessing(node->mEvaluationTarget, false);
 		}
+		Evaluation::FreeImage(&mImage);
 	}
 	Image mImage;
 	ASyncId mIdentifier;
-	bool mbIsThumbnail;
 };
 
-struct DecodeThumbnailTaskSet : enki::ITaskSet
+static ThumbnailAtlas thumbnailAtlas;
+
+// thumbnails of the library items being displayed, decoded and scaled to an atlas slot on workers, uploaded on the main thread.
+// Requests are served in display order. A decode is cancelled when its item is scrolled out before it's done
+struct ThumbnailDecoder
 {
-	DecodeThumbnailTaskSet(std::vector<uint8_t> *src, ASyncId identifier) : enki::ITaskSet(), mIdentifier(identifier), mSrc(src)
+	struct DecodeTaskSet final : enki::ITaskSet
+	{
+		DecodeTaskSet(const std::vector<uint8_t>& src, ASyncId identifier) : enki::ITaskSet(), mSrc(src), mIdentifier(identifier), mbCancelled(false), mbDecoded(false)
+		{
+		}
+		virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+		{
+			Image image;
+			if (mbCancelled || Evaluation::DecodeImageBlob(mSrc.data(), mSrc.size(), &image) != EVAL_OK)
+				return;
+			ThumbnailAtlas::Resample(image, mPixels);
+			Evaluation::FreeImage(&image);
+			mbDecoded = true;
+		}
+		std::vector<uint8_t> mSrc;
+		ASyncId mIdentifier;
+		std::vector<uint8_t> mPixels;
+		std::atomic<bool> mbCancelled;
+		bool mbDecoded;
+	};
+
+	void Request(ASyncId identifier)
 	{
+		mRequests.push_back(identifier);
 	}
-	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+
+	void Update(Library& library)
 	{
-		Image image;
-		int components;
-		unsigned char *data = stbi_load_from_memory(mSrc->data(), int(mSrc->size()), &image.mWidth, &image.mHeight, &components, 0);
-		if (data)
+		// thumbnails turned down by a full atlas are requested again once a slot can be recycled
+		if (!mDeferred.empty() && thumbnailAtlas.HasFreeSlot())
 		{
-			image.mBits = data;
-			image.mNumFaces = 1;
-			image.mNumMips = 1;
-			image.mFormat = (components == 4) ? TextureFormat::RGBA8 : TextureFormat::RGB8;
-			PinnedTaskUploadImage uploadTexTask(image, mIdentifier, true);
-			g_TS.AddPinnedTask(&uploadTexTask);
-			g_TS.WaitforTask(&uploadTexTask);
-			Evaluation::FreeImage(&image);
+			for (auto& identifier : mDeferred)
+			{
+				Material *material = library.Get(identifier);
+				if (material && material->mThumbnailHandle == ThumbnailAtlas::DefaultHandle)
+					material->mThumbnailHandle = 0;
+			}
+			mDeferred.clear();
 		}
+
+		for (size_t i = 0; i < mTasks.size();)
+		{
+			DecodeTaskSet *task = mTasks[i];
+			bool requested = std::find(mRequests.begin(), mRequests.end(), task->mIdentifier) != mRequests.end();
+			if (!requested)
+				task->mbCancelled = true;
+			if (!task->GetIsComplete())
+			{
+				i++;
+				continue;
+			}
+			Material *material = library.Get(task->mIdentifier);
+			// a thumbnail made in the meantime is decoded with the next request
+			if (!task->mbCancelled && material && material->mThumbnail == task->mSrc)
+			{
+				material->mThumbnailHandle = task->mbDecoded ? thumbnailAtlas.Add(material->mRuntimeUniqueId, task->mPixels.data()) : ThumbnailAtlas::DefaultHandle;
+				if (task->mbDecoded && material->mThumbnailHandle == ThumbnailAtlas::DefaultHandle)
+					mDeferred.push_back(task->mIdentifier);
+			}
+			delete task;
+			mTasks.erase(mTasks.begin() + i);
+		}
+
+		for (auto& identifier : mRequests)
+		{
+			if (mTasks.size() >= MaxTasks)
+				break;
+			if (std::find_if(mTasks.begin(), mTasks.end(), [&identifier](DecodeTaskSet *task) { return task->mIdentifier == identifier; }) != mTasks.end())
+				continue;
+			Material *material = library.Get(identifier);
+			if (!material)
+				continue;
+			LoadMaterialThumbnail(&library, *material);
+			if (material->mThumbnail.empty())
+			{
+				material->mThumbnailHandle = ThumbnailAtlas::DefaultHandle;
+				continue;
+			}
+			DecodeTaskSet *task = new DecodeTaskSet(material->mThumbnail, identifier);
+			mTasks.push_back(task);
+			g_TS.AddTaskSetToPipe(task);
+		}
+		mRequests.clear();
 	}
-	ASyncId mIdentifier;
-	std::vector<uint8_t> *mSrc;
+
+	static const size_t MaxTasks = 4;
+	std::vector<ASyncId> mRequests; // this frame, in display order
+	std::vector<DecodeTaskSet*> mTasks;
+	std::vector<ASyncId> mDeferred; // decoded while the atlas was full, showing the default thumbnail
 };
+static ThumbnailDecoder thumbnailDecoder;
 
-struct EncodeImageTaskSet : enki::ITaskSet
+struct EncodeImageTaskSet final : enki::ITaskSet
 {
 	EncodeImageTaskSet(Image image, ASyncId materialIdentifier, ASyncId nodeIdentifier) : enki::ITaskSet(), mMaterialIdentifier(materialIdentifier), mNodeIdentifier(nodeIdentifier), mImage(image)
 	{
 	}
 	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
 	{
-		int outlen;
-		int components = 4;
-		unsigned char *bits = stbi_write_png_to_mem((unsigned char*)mImage.mBits, mImage.mWidth * components, mImage.mWidth, mImage.mHeight, components, &outlen);
-		if (bits)
+		std::vector<unsigned char> blob;
+		if (Evaluation::EncodeImageBlob(&mImage, blob) == EVAL_OK)
 		{
 			Material *material = library.Get(mMaterialIdentifier);
 			if (material)
@@ -484,11 +584,11 @@ struct EncodeImageTaskSet : enki::ITaskSet
 				MaterialNode *node = material->Get(mNodeIdentifier);
 				if (node)
 				{
-					node->mImage.resize(outlen);
-					memcpy(node->mImage.data(), bits, outlen);
+					node->mImage = blob;
 				}
 			}
 		}
+		Evaluation::FreeImage(&mImage);
 	}
 	ASyncId mMaterialIdentifier;
 	ASyncId mNodeIdentifier;
@@ -503,15 +603,9 @@ struct DecodeImageTaskSet : enki::ITaskSet
 	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
 	{
 		Image image;
-		int components;
-		unsigned char *data = stbi_load_from_memory(mSrc->data(), int(mSrc->size()), &image.mWidth, &image.mHeight, &components, 0);
-		if (data)
+		if (Evaluation::DecodeImageBlob(mSrc->data(), mSrc->size(), &image) == EVAL_OK)
 		{
-			image.mBits = data;
-			image.mNumFaces = 1;
-			image.mNumMips = 1;
-			image.mFormat = (components == 3) ? TextureFormat::RGB8 : TextureFormat::RGBA8;
-			PinnedTaskUploadImage uploadTexTask(image, mIdentifier, false);
+			PinnedTaskUploadImage uploadTexTask(image, mIdentifier);
 			g_TS.AddPinnedTask(&uploadTexTask);
 			g_TS.WaitforTask(&uploadTexTask);
 		}
@@ -520,106 +614,168 @@ struct DecodeImageTaskSet : enki::ITaskSet
 	std::vector<uint8_t> *mSrc;
 };
 
-template <typename T, typename Ty> bool TVRes(std::vector<T, Ty>& res, const char *szName, int &selection, int index, Evaluation& evaluation, int viewMode)
+template <typename T, typename Ty> bool TVRes(std::vector<T, Ty>& res, unsigned int generation, const char *szName, int &selection, int index, Evaluation& evaluation, int viewMode)
 {
 	bool ret = false;
 	if (!ImGui::TreeNodeEx(szName, ImGuiTreeNodeFlags_FramePadding | ImGuiTreeNodeFlags_DefaultOpen))
 		return ret;
 
-	std::string currentGroup = "";
-	bool currentGroupIsSkipped = false;
-
-	std::vector<SortedResource<T, Ty>> sortedResources;
-	SortedResource<T, Ty>::ComputeSortedResources(res, sortedResources);
-	unsigned int defaultTextureId = evaluation.GetTexture("Stock/thumbnail-icon.png");
+	static SortedResources<T, Ty> sortedResources;
+	sortedResources.Update(res, generation);
+	if (!thumbnailAtlas.HasDefault())
+	{
+		std::vector<uint8_t> pixels(ThumbnailAtlas::SlotSize * ThumbnailAtlas::SlotSize * 4, 0);
+		Image image;
+		if (Evaluation::ReadImage("Stock/thumbnail-icon.png", &image) == EVAL_OK)
+		{
+			ThumbnailAtlas::Resample(image, pixels);
+			Evaluation::FreeImage(&image);
+		}
+		thumbnailAtlas.SetDefault(pixels.data());
+	}
 	float regionWidth = ImGui::GetWindowContentRegionWidth();
-	float currentStep = 0.f;
 	float stepSize = (viewMode == 2) ? 64.f : 128.f;
-	for (const auto& sortedRes : sortedResources)
-	{
-		unsigned int indexInRes = sortedRes.mIndex;
-		bool selected = ((selection >> 16) == index) && (selection & 0xFFFF) == (int)indexInRes;
-		ImGuiTreeNodeFlags node_flags = ImGuiTreeNodeFlags_FramePadding | ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen | (selected ? ImGuiTreeNodeFlags_Selected : 0);
+	int itemsPerRow = (viewMode == 2 || viewMode == 3) ? std::max(int(regionWidth / stepSize), 1) : 1;
+	static const float itemHeights[] = { 0.f, 64.f, 64.f, 128.f };
+	float itemHeight = std::max(itemHeights[viewMode], (viewMode < 2) ? ImGui::GetFrameHeight() : 0.f);
+	float rowHeight = itemHeight + ImGui::GetStyle().ItemSpacing.y;
 
-		std::string grp = GetGroup(res[indexInRes].mName);
-
-		if ( grp != currentGroup)
+	for (const auto& group : sortedResources.mGroups)
+	{
+		if (group.mName.length())
 		{
-			if (currentGroup.length() && !currentGroupIsSkipped)
-				ImGui::TreePop();
-
-			currentGroup = grp;
-			currentStep = 0.f;
-			if (currentGroup.length())
+			bool opened;
+			if (ImGui::IsRectVisible(ImVec2(regionWidth, ImGui::GetTextLineHeight())))
 			{
-				if (!ImGui::TreeNode(currentGroup.c_str()))
-				{
-					currentGroupIsSkipped = true;
-					continue;
-				}
+				opened = ImGui::TreeNode(group.mName.c_str());
+			}
+			else
+			{
+				// same state and layout as the tree node, without the widget
+				opened = ImGui::GetStateStorage()->GetInt(ImGui::GetID(group.mName.c_str()), 0) != 0;
+				ImGui::Dummy(ImVec2(0.f, ImGui::GetTextLineHeight()));
+				if (opened)
+					ImGui::TreePush(group.mName.c_str());
 			}
-			currentGroupIsSkipped = false;
+			if (!opened)
+				continue;
 		}
-		else if (currentGroupIsSkipped)
-			continue;
 
-		if ((regionWidth - currentStep) < stepSize)
-		{
-			currentStep = 0.f;
-		}
-		if (viewMode == 2 || viewMode == 3)
+		// only visible rows are submitted
+		ImGuiListClipper clipper((int(group.mCount) + itemsPerRow - 1) / itemsPerRow, rowHeight);
+		while (clipper.Step())
 		{
-			if (currentStep > FLT_EPSILON)
+			for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++)
 			{
-				ImGui::SameLine();
+				float rowY = ImGui::GetCursorPosY();
+				unsigned int first = group.mFirst + row * itemsPerRow;
+				unsigned int last = std::min(first + itemsPerRow, group.mFirst + group.mCount);
+				for (unsigned int sortedIndex = first; sortedIndex < last; sortedIndex++)
+				{
+					if (sortedIndex != first)
+						ImGui::SameLine();
+
+					unsigned int indexInRes = sortedResources.mSorted[sortedIndex];
+					const char *name = sortedResources.mNames[sortedIndex].c_str();
+					bool selected = ((selection >> 16) == index) && (selection & 0xFFFF) == (int)indexInRes;
+					ImGuiTreeNodeFlags node_flags = ImGuiTreeNodeFlags_FramePadding | ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen | (selected ? ImGuiTreeNodeFlags_Selected : 0);
+
+					ImGui::BeginGroup();
+
+					T& resource = res[indexInRes];
+					// consecutive thumbnails of the same atlas page are batched in a single draw
+					ThumbnailAtlas::Thumbnail thumbnail;
+					if (viewMode && !thumbnailAtlas.Get(resource.mThumbnailHandle, resource.mRuntimeUniqueId, thumbnail))
+					{
+						resource.mThumbnailHandle = 0;
+						thumbnailDecoder.Request(std::make_pair(indexInRes, resource.mRuntimeUniqueId));
+						thumbnailAtlas.Get(ThumbnailAtlas::DefaultHandle, 0, thumbnail);
+					}
+					bool clicked = false;
+					switch (viewMode)
+					{
+					case 0:
+						ImGui::TreeNodeEx(name, node_flags);
+						clicked |= ImGui::IsItemClicked();
+						break;
+					case 1:
+						ImGui::Image(thumbnail.mTexture, ImVec2(64, 64), thumbnail.mUV0, thumbnail.mUV1);
+						clicked = ImGui::IsItemClicked();
+						ImGui::SameLine();
+						ImGui::TreeNodeEx(name, node_flags);
+						clicked |= ImGui::IsItemClicked();
+						break;
+					case 2:
+						ImGui::Image(thumbnail.mTexture, ImVec2(64, 64), thumbnail.mUV0, thumbnail.mUV1);
+						clicked = ImGui::IsItemClicked();
+						break;
+					case 3:
+						ImGui::Image(thumbnail.mTexture, ImVec2(128, 128), thumbnail.mUV0, thumbnail.mUV1);
+						clicked = ImGui::IsItemClicked();
+						break;
+					}
+					if (clicked)
+					{
+						selection = (index << 16) + indexInRes;
+						ret = true;
+					}
+					ImGui::EndGroup();
+				}
+				ImGui::SetCursorPosY(rowY + rowHeight);
 			}
 		}
 
-		ImGui::BeginGroup();
+		if (group.mName.length())
+			ImGui::TreePop();
+	}
+	thumbnailDecoder.Update(library);
+
+	ImGui::TreePop();
+	return ret;
+}
+
+// node images being read back from the GPU, then encoded to png on a worker
+struct PendingNodeImageRead
+{
+	int mReadback;
+	ASyncId mMaterialIdentifier;
+	ASyncId mNodeIdentifier;
+};
+static std::vector<PendingNodeImageRead> pendingNodeImageReads;
+static std::vector<EncodeImageTaskSet*> encodeImageTasks;
 
-		T& resource = res[indexInRes];
-		if (!resource.mThumbnailTextureId)
+static void ProcessPendingNodeImageReads(bool waitForCompletion)
+{
+	for (size_t i = 0; i < pendingNodeImageReads.size();)
+	{
+		const PendingNodeImageRead& pendingRead = pendingNodeImageReads[i];
+		if (!waitForCompletion && Evaluation::PollEvaluationImageRead(pendingRead.mReadback) == EVAL_PENDING)
 		{
-			resource.mThumbnailTextureId = defaultTextureId;
-			g_TS.AddTaskSetToPipe(new DecodeThumbnailTaskSet(&resource.mThumbnail, std::make_pair(indexInRes,resource.mRuntimeUniqueId)));
+			i++;
+			continue;
 		}
-		bool clicked = false;
-		switch (viewMode)
+		Image image;
+		if (Evaluation::EndEvaluationImageRead(pendingRead.mReadback, &image) == EVAL_OK)
 		{
-		case 0:
-			ImGui::TreeNodeEx(GetName(resource.mName).c_str(), node_flags);
-			clicked |= ImGui::IsItemClicked();
-			break;
-		case 1:
-			ImGui::Image((ImTextureID)(int64_t)(resource.mThumbnailTextureId), ImVec2(64, 64), ImVec2(0, 1), ImVec2(1, 0));
-			clicked = ImGui::IsItemClicked();
-			ImGui::SameLine();
-			ImGui::TreeNodeEx(GetName(resource.mName).c_str(), node_flags);
-			clicked |= ImGui::IsItemClicked();
-			break;
-		case 2:
-			ImGui::Image((ImTextureID)(int64_t)(resource.mThumbnailTextureId), ImVec2(64, 64), ImVec2(0, 1), ImVec2(1, 0));
-			clicked = ImGui::IsItemClicked();
-			break;
-		case 3:
-			ImGui::Image((ImTextureID)(int64_t)(resource.mThumbnailTextureId), ImVec2(128, 128), ImVec2(0, 1), ImVec2(1, 0));
-			clicked = ImGui::IsItemClicked();
-			break;
+			EncodeImageTaskSet *encodeTask = new EncodeImageTaskSet(image, pendingRead.mMaterialIdentifier, pendingRead.mNodeIdentifier);
+			encodeImageTasks.push_back(encodeTask);
+			g_TS.AddTaskSetToPipe(encodeTask);
 		}
-		if (clicked)
+		pendingNodeImageReads.erase(pendingNodeImageReads.begin() + i);
+	}
+
+	for (size_t i = 0; i < encodeImageTasks.size();)
+	{
+		if (waitForCompletion)
+			g_TS.WaitforTask(encodeImageTasks[i]);
+		if (!encodeImageTasks[i]->GetIsComplete())
 		{
-			selection = (index << 16) + indexInRes;
-			ret = true;
+			i++;
+			continue;
 		}
-		ImGui::EndGroup();
-		currentStep += stepSize;
+		delete encodeImageTasks[i];
+		encodeImageTasks.erase(encodeImageTasks.begin() + i);
 	}
-
-	if (currentGroup.length() && !currentGroupIsSkipped)
-		ImGui::TreePop();
-
-	ImGui::TreePop();
-	return ret;
 }
 
 static int selectedMaterial = -1;
@@ -627,11 +783,16 @@ int Imogen::GetCurrentMaterialIndex()
 {
 	return selectedMaterial;
 }
+void Imogen::SetCurrentMaterialIndex(int index)
+{
+	selectedMaterial = index;
+}
 void ValidateMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate, int materialIndex)
 {
 	if (materialIndex == -1)
 		return;
 	Material& material = library.mMaterials[materialIndex];
+	material.mChunk.mbDirty = true;
 	material.mMaterialNodes.resize(nodeGraphDelegate.mNodes.size());
 
 	for (size_t i = 0; i < nodeGraphDelegate.mNodes.size(); i++)
@@ -642,10 +803,11 @@ void ValidateMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDele
 		dstNode.mRuntimeUniqueId = GetRuntimeId();
 		if (metaNode.mbSaveTexture)
 		{
-			Image image;
-			if (Evaluation::GetEvaluationImage(int(i), &image) == EVAL_OK)
+			int readback = Evaluation::BeginEvaluationImageRead(int(i));
+			if (readback != -1)
 			{
-				g_TS.AddTaskSetToPipe(new EncodeImageTaskSet(image, std::make_pair(materialIndex, material.mRuntimeUniqueId), std::make_pair(i, dstNode.mRuntimeUniqueId)));
+				PendingNodeImageRead pendingRead = { readback, std::make_pair(materialIndex, material.mRuntimeUniqueId), std::make_pair(i, dstNode.mRuntimeUniqueId) };
+				pendingNodeImageReads.push_back(pendingRead);
 			}
 		}
 
@@ -683,6 +845,40 @@ void ValidateMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDele
 		rug.mColor = rugs[i].mColor;
 		rug.mComment = rugs[i].mText;
 	}
+	nodeGraphDelegate.mEditingContext.FlushDiskCache();
+}
+
+void BuildMaterialGraph(Material& material, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
+{
+	nodeGraphDelegate.Clear();
+	evaluation.Clear();
+	NodeGraphClear();
+	gProfiler.Clear();
+
+	for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
+	{
+		MaterialNode& node = material.mMaterialNodes[i];
+		assert(node.mType < gMetaNodes.size());
+		if (nodeGraphDelegate.ComputeNodeParametersSize(node.mType) != node.mParameters.size())
+		{
+			Log("MaterialNode parameters size mismatch (type=%s)\n", node.mTypeName.c_str());
+			node.mParameters.resize(nodeGraphDelegate.ComputeNodeParametersSize(node.mType));
+		}
+		NodeGraphAddNode(&nodeGraphDelegate, node.mType, node.mParameters.data(), node.mPosX, node.mPosY, node.mFrameStart, node.mFrameEnd);
+	}
+	for (size_t i = 0; i < material.mMaterialConnections.size(); i++)
+	{
+		MaterialConnection& materialConnection = material.mMaterialConnections[i];
+		NodeGraphAddLink(&nodeGraphDelegate, materialConnection.mInputNode, materialConnection.mInputSlot, materialConnection.mOutputNode, materialConnection.mOutputSlot);
+	}
+	for (size_t i = 0; i < material.mMaterialRugs.size(); i++)
+	{
+		MaterialNodeRug& rug = material.mMaterialRugs[i];
+		NodeGraphAddRug(rug.mPosX, rug.mPosY, rug.mSizeX, rug.mSizeY, rug.mColor, rug.mComment);
+	}
+	NodeGraphUpdateEvaluationOrder(&nodeGraphDelegate);
+	// same content as the material
+	nodeGraphDelegate.mEditCount = 0;
 }
 
 void UpdateNewlySelectedGraph(TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
@@ -690,41 +886,22 @@ void UpdateNewlySelectedGraph(TileNodeEditGraphDelegate &nodeGraphDelegate, Eval
 	// set new
 	if (selectedMaterial != -1)
 	{
-		nodeGraphDelegate.Clear();
-		evaluation.Clear();
-		NodeGraphClear();
 		InitCallbackRects();
 		ClearExtractedViews();
 
 		Material& material = library.mMaterials[selectedMaterial];
+		LoadMaterial(&library, material);
+		BuildMaterialGraph(material, nodeGraphDelegate, evaluation);
 		for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
 		{
 			MaterialNode& node = material.mMaterialNodes[i];
-			assert(node.mType < gMetaNodes.size());
-			if (nodeGraphDelegate.ComputeNodeParametersSize(node.mType) != node.mParameters.size())
-			{
-				Log("MaterialNode parameters size mismatch (type=%s)\n", node.mTypeName.c_str());
-				node.mParameters.resize(nodeGraphDelegate.ComputeNodeParametersSize(node.mType));
-			}
-			NodeGraphAddNode(&nodeGraphDelegate, node.mType, node.mParameters.data(), node.mPosX, node.mPosY, node.mFrameStart, node.mFrameEnd);
 			if (!node.mImage.empty())
 			{
-				TileNodeEditGraphDelegate::ImogenNode& lastNode = nodeGraphDelegate.mNodes.back();
-				gCurrentContext->StageSetProcessing(lastNode.mEvaluationTarget, true);
-				g_TS.AddTaskSetToPipe(new DecodeImageTaskSet(&node.mImage, std::make_pair(i, lastNode.mRuntimeUniqueId)));
+				TileNodeEditGraphDelegate::ImogenNode& imogenNode = nodeGraphDelegate.mNodes[i];
+				gCurrentContext->StageSetProcessing(imogenNode.mEvaluationTarget, true);
+				g_TS.AddTaskSetToPipe(new DecodeImageTaskSet(&node.mImage, std::make_pair(i, imogenNode.mRuntimeUniqueId)));
 			}
 		}
-		for (size_t i = 0; i < material.mMaterialConnections.size(); i++)
-		{
-			MaterialConnection& materialConnection = material.mMaterialConnections[i];
-			NodeGraphAddLink(&nodeGraphDelegate, materialConnection.mInputNode, materialConnection.mInputSlot, materialConnection.mOutputNode, materialConnection.mOutputSlot);
-		}
-		for (size_t i = 0; i < material.mMaterialRugs.size(); i++)
-		{
-			MaterialNodeRug& rug = material.mMaterialRugs[i];
-			NodeGraphAddRug(rug.mPosX, rug.mPosY, rug.mSizeX, rug.mSizeY, rug.mColor, rug.mComment);
-		}
-		NodeGraphUpdateEvaluationOrder(&nodeGraphDelegate);
 		NodeGraphUpdateScrolling();
 		nodeGraphDelegate.mEditingContext.RunAll();
 	}
@@ -738,8 +915,9 @@ void LibraryEdit(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate,
 		library.mMaterials.push_back(Material());
 		Material& back = library.mMaterials.back();
 		back.mName = "Name_Of_New_Graph";
-		back.mThumbnailTextureId = 0;
+		back.mThumbnailHandle = 0;
 		back.mRuntimeUniqueId = GetRuntimeId();
+		library.mGeneration++;
 		
 		if (previousSelection != -1)
 		{
@@ -762,11 +940,15 @@ void LibraryEdit(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate,
 		{
 			Library tempLibrary;
 			LoadLib(&tempLibrary, outPath);
+			LoadAllMaterials(&tempLibrary);
 			for (auto& material : tempLibrary.mMaterials)
 			{
 				Log("Importing Graph %s\n", material.mName.c_str());
 				library.mMaterials.push_back(material);
+				// stored in the other library, written with the next save
+				library.mMaterials.back().mChunk = MaterialChunk();
 			}
+			library.mGeneration++;
 			free(outPath);
 		}
 	}
@@ -786,7 +968,7 @@ void LibraryEdit(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate,
 	}
 
 	ImGui::BeginChild("TV");
-	if (TVRes(library.mMaterials, "Graphs", selectedMaterial, 0, evaluation, libraryViewMode))
+	if (TVRes(library.mMaterials, library.mGeneration, "Graphs", selectedMaterial, 0, evaluation, libraryViewMode))
 	{
 		nodeGraphDelegate.mSelectedNodeIndex = -1;
 		// save previous
@@ -833,8 +1015,102 @@ struct MySequence : public ImSequencer::SequenceInterface
 	TileNodeEditGraphDelegate &mNodeGraphDelegate;
 };
 
+static void ShowProfiler(TileNodeEditGraphDelegate &nodeGraphDelegate)
+{
+	bool enabled = gProfiler.IsEnabled();
+	if (ImGui::Checkbox("Enabled", &enabled))
+	{
+		gProfiler.SetEnabled(enabled);
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Clear"))
+	{
+		gProfiler.Clear();
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Export trace"))
+	{
+		nfdchar_t *outPath = NULL;
+		nfdresult_t result = NFD_SaveDialog("json", NULL, &outPath);
+		if (result == NFD_OKAY)
+		{
+			if (gProfiler.ExportChromeTrace(outPath))
+				Log("Chrome trace saved at path %s\n", outPath);
+			else
+				Log("Unable to write trace : %s\n", outPath);
+			free(outPath);
+		}
+	}
+
+	struct NodeTimes
+	{
+		size_t mNodeIndex;
+		Profiler::NodeHistory mHistory;
+		float mTotal;
+	};
+	std::vector<NodeTimes> nodeTimes;
+	for (size_t i = 0; i < nodeGraphDelegate.mNodes.size(); i++)
+	{
+		NodeTimes times;
+		times.mNodeIndex = i;
+		if (!gProfiler.GetNodeHistory(i, times.mHistory))
+			continue;
+		times.mTotal = 0.f;
+		for (int type = 0; type < Profiler::Sample_Count; type++)
+			times.mTotal += ImMax(times.mHistory.GetAverage(type), 0.f);
+		nodeTimes.push_back(times);
+	}
+	// slowest first
+	std::sort(nodeTimes.begin(), nodeTimes.end(), [](const NodeTimes& a, const NodeTimes& b) { return a.mTotal > b.mTotal; });
+
+	ImGui::Columns(5, "profilerColumns");
+	ImGui::Text("Node"); ImGui::NextColumn();
+	ImGui::Text("GPU ms"); ImGui::NextColumn();
+	ImGui::Text("CPU ms"); ImGui::NextColumn();
+	ImGui::Text("Jobs ms"); ImGui::NextColumn();
+	ImGui::Text("History"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (auto& times : nodeTimes)
+	{
+		const Profiler::NodeHistory& history = times.mHistory;
+		size_t nodeIndex = times.mNodeIndex;
+		ImGui::PushID(int(nodeIndex));
+		const char *nodeName = gMetaNodes[nodeGraphDelegate.mNodes[nodeIndex].mType].mName.c_str();
+		if (ImGui::Selectable(nodeName, nodeGraphDelegate.mSelectedNodeIndex == int(nodeIndex), ImGuiSelectableFlags_SpanAllColumns))
+		{
+			nodeGraphDelegate.mSelectedNodeIndex = int(nodeIndex);
+		}
+		ImGui::NextColumn();
+		for (int type = 0; type < Profiler::Sample_Count; type++)
+		{
+			if (history.mCount[type])
+				ImGui::Text("%.2f (avg %.2f, max %.2f)", history.GetLast(type), history.GetAverage(type), history.GetMax(type));
+			ImGui::NextColumn();
+		}
+		int plotType = history.mCount[Profiler::Sample_GPU] ? Profiler::Sample_GPU : Profiler::Sample_CPU;
+		int plotOffset = (history.mCount[plotType] == Profiler::NodeHistory::HistorySize) ? history.mIndex[plotType] : 0;
+		ImGui::PlotLines("", history.mTimes[plotType], history.mCount[plotType], plotOffset, NULL, 0.f, FLT_MAX, ImVec2(0, 16));
+		ImGui::NextColumn();
+		ImGui::PopID();
+	}
+	ImGui::Columns(1);
+}
+
 void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
 {
+	ProcessPendingNodeImageReads(false);
+	gProfiler.ResolveGPU();
+
+	std::vector<std::string> changedFiles;
+	gEvaluators.PollWatchedFiles(changedFiles);
+	for (auto& filename : changedFiles)
+	{
+		Log("%s modified, reloading.\n", filename.c_str());
+		ReloadEvaluator(filename, nodeGraphDelegate);
+		if (currentShaderIndex != -1 && mEvaluatorFiles[currentShaderIndex].mFilename == filename)
+			editor.SetText(gEvaluators.GetEvaluator(filename));
+	}
+
 	ImGuiIO& io = ImGui::GetIO();
 	ImGui::SetNextWindowPos(ImVec2(0, 0));
 	ImGui::SetNextWindowSize(io.DisplaySize);
@@ -850,7 +1126,8 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 			{
 				Material& material = library.mMaterials[selectedMaterial];
 				ImGui::PushItemWidth(150);
-				ImGui::InputText("Name", &material.mName);
+				if (ImGui::InputText("Name", &material.mName))
+					library.mGeneration++;
 				ImGui::SameLine();
 				ImGui::PopItemWidth();
 
@@ -873,6 +1150,7 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 					{
 						Library tempLibrary;
 						Material& material = library.mMaterials[selectedMaterial];
+						LoadMaterial(&library, material);
 						tempLibrary.mMaterials.push_back(material);
 						SaveLib(&tempLibrary, outPath);
 						Log("Graph %s saved at path %s\n", material.mName.c_str(), outPath);
@@ -883,9 +1161,69 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 				if (ImGui::Button("Delete Graph"))
 				{
 					library.mMaterials.erase(library.mMaterials.begin() + selectedMaterial);
+					library.mGeneration++;
 					selectedMaterial = int(library.mMaterials.size()) - 1;
 					UpdateNewlySelectedGraph(nodeGraphDelegate, evaluation);
 				}
+				ImGui::SameLine();
+				bool lowMemory = nodeGraphDelegate.mEditingContext.IsLowMemory();
+				if (ImGui::Checkbox("Low memory", &lowMemory))
+				{
+					nodeGraphDelegate.mEditingContext.SetLowMemory(lowMemory);
+				}
+				if (ImGui::IsItemHovered())
+				{
+					ImGui::SetTooltip("Only keep visible, selected and extracted node outputs in video memory.\nOther nodes are recomputed when needed.");
+				}
+				ImGui::SameLine();
+				bool progressive = nodeGraphDelegate.mEditingContext.IsProgressive();
+				if (ImGui::Checkbox("Progressive", &progressive))
+				{
+					nodeGraphDelegate.mEditingContext.SetProgressive(progressive);
+				}
+				if (ImGui::IsItemHovered())
+				{
+					ImGui::SetTooltip("Evaluate edited nodes at a reduced size first.\nFull resolution is refined over the next frames.\nNodes to refine: %d",
+						int(nodeGraphDelegate.mEditingContext.GetProxyCount()));
+				}
+				ImGui::SameLine();
+				float frameBudget = nodeGraphDelegate.mEditingContext.GetFrameBudget();
+				ImGui::PushItemWidth(100);
+				if (ImGui::SliderFloat("Budget", &frameBudget, 0.f, 50.f, (frameBudget > 0.f) ? "%.0f ms" : "Unlimited"))
+				{
+					nodeGraphDelegate.mEditingContext.SetFrameBudget(frameBudget);
+				}
+				ImGui::PopItemWidth();
+				if (ImGui::IsItemHovered())
+				{
+					ImGui::SetTooltip("Evaluation time per frame. Remaining nodes are evaluated on the next frames.\nDirty nodes: %d",
+						int(nodeGraphDelegate.mEditingContext.GetDirtyCount()));
+				}
+				ImGui::SameLine();
+				bool diskCache = gDiskCache.IsEnabled();
+				if (ImGui::Checkbox("Disk cache", &diskCache))
+				{
+					gDiskCache.SetEnabled(diskCache);
+				}
+				if (ImGui::IsItemHovered())
+				{
+					const DiskCache::Statistics& diskStats = gDiskCache.GetStatistics();
+					ImGui::SetTooltip("Keep evaluated outputs on disk between sessions.\nWritten when leaving a graph.\nEntries: %d (%.1f MB)\nHits: %d misses: %d",
+						int(diskStats.mCount), float(diskStats.mBytes) / (1024.f * 1024.f), int(diskStats.mHitCount), int(diskStats.mMissCount));
+				}
+				ImGui::SameLine();
+				const RenderTargetPool::Statistics& rtStats = gRenderTargetPool.GetStatistics();
+				ImGui::Text("Render targets: %d (%.1f MB)", int(rtStats.mUsedCount), float(rtStats.mUsedBytes) / (1024.f * 1024.f));
+				if (ImGui::IsItemHovered())
+				{
+					const NodeOutputCache::Statistics& cacheStats = gNodeOutputCache.GetStatistics();
+					ImGui::SetTooltip("Pooled: %d (%.1f MB)\nPeak: %d (%.1f MB)\nAllocations: %d\nReuses: %d\nCached outputs: %d (%.1f MB)\nCache hits: %d misses: %d",
+						int(rtStats.mFreeCount), float(rtStats.mFreeBytes) / (1024.f * 1024.f),
+						int(rtStats.mPeakCount), float(rtStats.mPeakBytes) / (1024.f * 1024.f),
+						int(rtStats.mAllocationCount), int(rtStats.mReuseCount),
+						int(cacheStats.mCount), float(cacheStats.mBytes) / (1024.f * 1024.f),
+						int(cacheStats.mHitCount), int(cacheStats.mMissCount));
+				}
 				ImGui::PopItemWidth();
 			}
 			NodeGraph(&nodeGraphDelegate, selectedMaterial != -1);	
@@ -917,6 +1255,12 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 		}
 		ImGui::End();
 
+		if (ImGui::Begin("Profiler"))
+		{
+			ShowProfiler(nodeGraphDelegate);
+		}
+		ImGui::End();
+
 		if (ImGui::Begin("Timeline"))
 		{
 			MySequence mySequence(nodeGraphDelegate);
@@ -978,6 +1322,38 @@ void Imogen::ValidateCurrentMaterial(Library& library, TileNodeEditGraphDelegate
 	ValidateMaterial(library, nodeGraphDelegate, selectedMaterial);
 }
 
+void Imogen::CompletePendingSaves()
+{
+	ProcessPendingNodeImageReads(true);
+}
+
+void Imogen::AutoSave(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate)
+{
+	static const double autoSaveInterval = 60.;
+	static double lastAutoSave = 0.;
+	static bool autoSavePending = false;
+
+	EndLibrarySave(&library, false);
+	double time = ImGui::GetTime();
+	if (!autoSavePending && time - lastAutoSave > autoSaveInterval)
+	{
+		lastAutoSave = time;
+		// the graph is only copied back when it was edited. Library changes are found by the save itself
+		if (nodeGraphDelegate.mEditCount)
+		{
+			ValidateMaterial(library, nodeGraphDelegate, selectedMaterial);
+			nodeGraphDelegate.mEditCount = 0;
+		}
+		autoSavePending = true;
+	}
+	// node images are encoded on workers, materials are copied once they are done
+	if (autoSavePending && pendingNodeImageReads.empty() && encodeImageTasks.empty() && !IsLibrarySaving())
+	{
+		BeginLibrarySave(&library);
+		autoSavePending = false;
+	}
+}
+
 void Imogen::DiscoverNodes(const char *extension, const char *directory, EVALUATOR_TYPE evaluatorType, std::vector<EvaluatorFile>& files)
 {
 	tinydir_dir dir;
@@ -1020,5 +1396,5 @@ void Imogen::Init()
 
 void Imogen::Finish()
 {
-
+	thumbnailAtlas.Finish();
 }
\ No newline at end of file
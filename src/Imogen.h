@@ -34,6 +34,7 @@ struct TileNodeEditGraphDelegate;
 struct Evaluation;
 class TextEditor;
 struct Library;
+struct Material;
 
 
 enum EVALUATOR_TYPE
@@ -59,13 +60,17 @@ struct Imogen
 	
 	void Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation);
 	void ValidateCurrentMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate);
+	void CompletePendingSaves(); // node images read back and encoded
+	void AutoSave(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate); // current graph written to the library journal every minute
 	void DiscoverNodes(const char *extension, const char *directory, EVALUATOR_TYPE evaluatorType, std::vector<EvaluatorFile>& files);
 
 	std::vector<EvaluatorFile> mEvaluatorFiles;
 	int GetCurrentMaterialIndex();
+	void SetCurrentMaterialIndex(int index);
 
 protected:
 	void HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation);
+	void ReloadEvaluator(const std::string& filename, TileNodeEditGraphDelegate &nodeGraphDelegate);
 };
 
 void DebugLogText(const char *szText);
@@ -85,4 +90,5 @@ struct ImogenDrawCallback
 extern std::vector<ImogenDrawCallback> mCallbackRects;
 void InitCallbackRects();
 size_t AddNodeUICallbackRect(CallbackDisplayType type, const ImRect& rect, size_t nodeIndex);
-extern int gEvaluationTime;
\ No newline at end of file
+extern int gEvaluationTime;
+void BuildMaterialGraph(Material& material, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation);
\ No newline at end of file
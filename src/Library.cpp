@@ -24,9 +24,30 @@
 //
 
 #include "Library.h"
+#include "Evaluation.h"
+#include "DiskCache.h"
+#include "Utils.h"
 #include "imgui.h"
+#include "TaskScheduler.h"
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 int Log(const char *szFormat, ...);
+extern enki::TaskScheduler g_TS;
+
+#ifdef _WIN32
+#define ftell64 _ftelli64
+#define fseek64 _fseeki64
+#else
+#define ftell64 ftello
+#define fseek64 fseeko
+#endif
 
 enum : uint32_t
 {
@@ -37,6 +58,7 @@ enum : uint32_t
 	v_rugs,
 	v_nodeTypeName,
 	v_frameStartEnd,
+	v_chunked,
 	v_lastVersion
 };
 #define ADD(_fieldAdded, _fieldName) if (dataVersion >= _fieldAdded){ Ser(_fieldName); }
@@ -49,40 +71,136 @@ enum : uint32_t
 #define VERSION_IN_RANGE(_from, _to) \
 	(dataVersion >= (_from) && dataVersion < (_to))
 
+// mappings of a chunked library and of its journal, materials content is read from them on demand
+struct LibraryFile
+{
+	LibraryFile() : mDataVersion(0), mBaseId(0), mJournal(NULL), mJournalSize(0), mTocHash(0)
+	{
+	}
+	DiskCache::MappedFile mMapped[Source_Count];
+	uint32_t mDataVersion;
+	uint64_t mBaseId; // hash of the library table of contents, a journal only applies to the file it was written for
+
+	// used by the save job while it runs
+	FILE *mJournal;
+	uint64_t mJournalSize;
+	uint64_t mTocHash; // last committed table of contents
+
+	const uint8_t *GetData(uint32_t source, uint64_t offset, uint64_t size) const
+	{
+		if (source >= Source_Count || !size || offset + size > mMapped[source].mSize)
+			return NULL;
+		return (const uint8_t*)mMapped[source].mData + offset;
+	}
+};
+
+static const uint32_t JournalMagic = 0x4C4A4D49; // 'IMJL'
+static const uint32_t JournalCommitMagic = 0x434A4D49; // 'IMJC'
+struct JournalHeader
+{
+	uint32_t mMagic;
+	uint32_t mDataVersion;
+	uint64_t mBaseId;
+};
+// written after the table of contents of each commit. Magic comes last: a torn write never validates
+struct JournalCommit
+{
+	uint64_t mTocOffset;
+	uint64_t mTocSize;
+	uint64_t mTocHash;
+	uint32_t mPadding;
+	uint32_t mMagic;
+};
+
+static void SyncFile(FILE *fp)
+{
+	fflush(fp);
+#ifdef _WIN32
+	_commit(_fileno(fp));
+#else
+	fsync(fileno(fp));
+#endif
+}
+
+static bool MoveOverFile(const char *src, const char *dst)
+{
+#ifdef _WIN32
+	return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(src, dst) == 0;
+#endif
+}
+
 template<bool doWrite> struct Serialize
 {
-	Serialize(const char *szFilename)
+	Serialize(const char *szFilename) : fp(NULL), mData(NULL), mSize(0), mPosition(0), mBuffer(NULL), mbError(false), dataVersion(0)
 	{
 		fp = fopen(szFilename, doWrite ? "wb" : "rb");
 	}
+	// chunks of a mapped library
+	Serialize(const void *data, size_t size, uint32_t version) : fp(NULL), mData((const uint8_t*)data), mSize(size), mPosition(0), mBuffer(NULL), mbError(false), dataVersion(version)
+	{
+	}
+	Serialize(std::vector<uint8_t>& buffer, uint32_t version) : fp(NULL), mData(NULL), mSize(0), mPosition(0), mBuffer(&buffer), mbError(false), dataVersion(version)
+	{
+	}
 	~Serialize()
 	{
 		if (fp)
 			fclose(fp);
 	}
+	void Write(const void *data, size_t size)
+	{
+		if (mBuffer)
+			mBuffer->insert(mBuffer->end(), (const uint8_t*)data, (const uint8_t*)data + size);
+		else if (fwrite(data, size, 1, fp) != 1)
+			mbError = true;
+	}
+	void Read(void *data, size_t size)
+	{
+		if (fp)
+		{
+			if (fread(data, size, 1, fp) != 1)
+				mbError = true;
+			return;
+		}
+		// truncated chunks read as zeros
+		if (mPosition + size > mSize)
+		{
+			memset(data, 0, size);
+			mPosition = mSize;
+			mbError = true;
+			return;
+		}
+		memcpy(data, mData + mPosition, size);
+		mPosition += size;
+	}
+	int64_t Tell() const { return fp ? int64_t(ftell64(fp)) : int64_t(mPosition); }
+	void Seek(int64_t position) { fseek64(fp, position, SEEK_SET); }
+
 	template<typename T> void Ser(T& data)
 	{
 		if (doWrite)
-			fwrite(&data, sizeof(T), 1, fp);
+			Write(&data, sizeof(T));
 		else
-			fread(&data, sizeof(T), 1, fp);
+			Read(&data, sizeof(T));
 	}
 	void Ser(std::string& data)
 	{
 		if (doWrite)
 		{
 			uint32_t len = uint32_t(data.length() + 1);
-			fwrite(&len, sizeof(uint32_t), 1, fp);
-			fwrite(data.c_str(), len, 1, fp);
+			Write(&len, sizeof(uint32_t));
+			Write(data.c_str(), len);
 		}
 		else
 		{
-			uint32_t len;
-			fread(&len, sizeof(uint32_t), 1, fp);
-			if (len > 1)
+			uint32_t len = 0;
+			Read(&len, sizeof(uint32_t));
+			if (len > 1 && !mbError)
 			{
 				data.resize(len - 1);
-				fread(&data[0], len, 1, fp);
+				Read(&data[0], len);
 				assert(data.length() == (len - 1));
 			} else
 				data = "";
@@ -92,6 +210,8 @@ template<bool doWrite> struct Serialize
 	{
 		uint32_t count = uint32_t(data.size());
 		Ser(count);
+		if (mbError)
+			return;
 		data.resize(count);
 		for (auto& item : data)
 			Ser(&item);
@@ -100,16 +220,16 @@ template<bool doWrite> struct Serialize
 	{
 		uint32_t count = uint32_t(data.size());
 		Ser(count);
-		if (!count)
+		if (!count || mbError)
 			return;
 		if (doWrite)
 		{
-			fwrite(data.data(), count, 1, fp);
+			Write(data.data(), count);
 		}
 		else
 		{
 			data.resize(count);
-			fread(&data[0], count, 1, fp);
+			Read(&data[0], count);
 		}
 	}
 
@@ -151,55 +271,624 @@ template<bool doWrite> struct Serialize
 	}
 	void Ser(Material *material)
 	{
-		ADD(v_initial, material->mName);
+		// chunked: name is in the table of contents and thumbnail is a blob of its own
+		if (VERSION_IN_RANGE(v_initial, v_chunked))
+			Ser(material->mName);
 		REM(v_materialComment, v_rugs, std::string, (material->mComment), "");
 		ADD(v_initial, material->mMaterialNodes);
 		ADD(v_initial, material->mMaterialConnections);
-		ADD(v_thumbnail, material->mThumbnail);
+		if (VERSION_IN_RANGE(v_thumbnail, v_chunked))
+			Ser(material->mThumbnail);
 		ADD(v_rugs, material->mMaterialRugs);
 	}
+	// table of contents entry. Journal entries also tell which file has the chunks
+	void Ser(std::string& name, MaterialChunk& chunk, bool withSources = false)
+	{
+		Ser(name);
+		Ser(chunk.mOffset);
+		Ser(chunk.mSize);
+		Ser(chunk.mHash);
+		Ser(chunk.mThumbnailOffset);
+		Ser(chunk.mThumbnailSize);
+		if (withSources)
+		{
+			Ser(chunk.mSource);
+			Ser(chunk.mThumbnailSource);
+		}
+	}
 	bool Ser(Library *library)
 	{
-		if (!fp)
+		if (!fp && !mData)
 			return false;
 		if (doWrite)
 			dataVersion = v_lastVersion-1;
 		Ser(dataVersion);
 		if (dataVersion > v_lastVersion)
 			return false; // no forward compatibility
+		if (dataVersion >= v_chunked)
+		{
+			// table of contents only. Chunks are read by LoadMaterial, written by WriteLib
+			return SerTableOfContents(library->mMaterials, false);
+		}
 		ADD(v_initial, library->mMaterials);
 		return true;
 	}
+	bool SerTableOfContents(std::vector<Material>& materials, bool withSources)
+	{
+		uint32_t count = uint32_t(materials.size());
+		Ser(count);
+		if (mbError)
+			return false;
+		materials.resize(count);
+		for (auto& material : materials)
+		{
+			Ser(material.mName, material.mChunk, withSources);
+			if (!doWrite)
+			{
+				material.mChunk.mbLoaded = false;
+				material.mChunk.mbThumbnailLoaded = false;
+				material.mChunk.mbDirty = false;
+			}
+		}
+		return !mbError;
+	}
+	void Sync()
+	{
+		SyncFile(fp);
+	}
 	FILE *fp;
+	const uint8_t *mData;
+	size_t mSize;
+	size_t mPosition;
+	std::vector<uint8_t> *mBuffer;
+	bool mbError;
 	uint32_t dataVersion;
 };
 
 typedef Serialize<true> SerializeWrite;
 typedef Serialize<false> SerializeRead;
 
+static void CloseLibraryFile(LibraryFile *file)
+{
+	if (!file)
+		return;
+	for (auto& mapped : file->mMapped)
+		DiskCache::Unmap(mapped);
+	if (file->mJournal)
+		fclose(file->mJournal);
+	delete file;
+}
+
+Library::~Library()
+{
+	EndLibrarySave(this, true);
+	CloseLibraryFile(mFile);
+}
+
+static std::string GetJournalFilename(const std::string& filename)
+{
+	return filename + ".log";
+}
+
+static uint64_t HashTableOfContents(const std::vector<Material>& materials, uint32_t dataVersion)
+{
+	std::vector<uint8_t> buffer;
+	SerializeWrite tocSer(buffer, dataVersion);
+	tocSer.SerTableOfContents(const_cast<std::vector<Material>&>(materials), true);
+	return Hash(buffer.data(), buffer.size());
+}
+
+static void InitMaterialNodes(Material& material, uint32_t dataVersion)
+{
+	for (auto& node : material.mMaterialNodes)
+	{
+		node.mRuntimeUniqueId = GetRuntimeId();
+		if (dataVersion >= v_nodeTypeName)
+		{
+			node.mType = uint32_t(GetMetaNodeIndex(node.mTypeName));
+		}
+	}
+}
+
+// maps a library file and reads its table of contents. Older versions are read entirely and not kept mapped
+static LibraryFile *OpenLibraryFile(const char *szFilename, std::vector<Material>& materials)
+{
+	LibraryFile *file = new LibraryFile;
+	DiskCache::MappedFile& mapped = file->mMapped[Source_Library];
+	if (!DiskCache::MapFile(szFilename, mapped))
+	{
+		delete file;
+		return NULL;
+	}
+	Library library;
+	SerializeRead loadSer(mapped.mData, mapped.mSize, 0);
+	loadSer.Ser(&library);
+	file->mDataVersion = loadSer.dataVersion;
+	file->mBaseId = HashValue(loadSer.mPosition, Hash(mapped.mData, loadSer.mPosition));
+	materials.swap(library.mMaterials);
+	for (auto& material : materials)
+		InitMaterialNodes(material, loadSer.dataVersion);
+
+	if (loadSer.dataVersion < v_chunked)
+	{
+		CloseLibraryFile(file);
+		return NULL;
+	}
+	return file;
+}
+
+// replaces the table of contents with the last complete commit of the journal
+static void ReadJournal(LibraryFile *file, std::vector<Material>& materials, const std::string& journalFilename)
+{
+	DiskCache::MappedFile& mapped = file->mMapped[Source_Journal];
+	if (!DiskCache::MapFile(journalFilename.c_str(), mapped))
+		return;
+	const uint8_t *data = (const uint8_t*)mapped.mData;
+	size_t size = mapped.mSize;
+	JournalHeader header;
+	memset(&header, 0, sizeof(JournalHeader));
+	if (size >= sizeof(JournalHeader))
+		memcpy(&header, data, sizeof(JournalHeader));
+
+	// a journal written for a previous library file was folded in before it got replaced
+	if (header.mMagic == JournalMagic && header.mDataVersion == file->mDataVersion && header.mBaseId == file->mBaseId)
+	{
+		// scan back: a crash while appending leaves a partial record after the last commit
+		for (size_t position = size; position >= sizeof(JournalHeader) + sizeof(JournalCommit); position--)
+		{
+			JournalCommit commit;
+			memcpy(&commit, data + position - sizeof(JournalCommit), sizeof(JournalCommit));
+			if (commit.mMagic != JournalCommitMagic || commit.mTocOffset < sizeof(JournalHeader)
+				|| commit.mTocOffset + commit.mTocSize != position - sizeof(JournalCommit)
+				|| Hash(data + commit.mTocOffset, size_t(commit.mTocSize)) != commit.mTocHash)
+				continue;
+
+			std::vector<Material> journalMaterials;
+			SerializeRead tocSer(data + commit.mTocOffset, size_t(commit.mTocSize), file->mDataVersion);
+			if (!tocSer.SerTableOfContents(journalMaterials, true))
+				continue;
+			materials.swap(journalMaterials);
+			file->mJournalSize = size;
+			Log("Library: %d graph(s) restored from %s\n", int(materials.size()), journalFilename.c_str());
+			return;
+		}
+	}
+	DiskCache::Unmap(mapped);
+	remove(journalFilename.c_str());
+}
+
 void LoadLib(Library *library, const char *szFilename)
 {
-	SerializeRead loadSer(szFilename);
-	loadSer.Ser(library);
+	EndLibrarySave(library, true);
+	CloseLibraryFile(library->mFile);
+	library->mFilename = szFilename;
+	library->mMaterials.clear();
+	library->mGeneration++;
+	library->mFile = OpenLibraryFile(szFilename, library->mMaterials);
+	if (library->mFile)
+	{
+		ReadJournal(library->mFile, library->mMaterials, GetJournalFilename(library->mFilename));
+		library->mFile->mTocHash = HashTableOfContents(library->mMaterials, library->mFile->mDataVersion);
+	}
 
 	for (auto& material : library->mMaterials)
 	{
-		material.mThumbnailTextureId = 0;
+		material.mThumbnailHandle = 0;
 		material.mRuntimeUniqueId = GetRuntimeId();
-		for (auto& node : material.mMaterialNodes)
+	}
+}
+
+void LoadMaterialThumbnail(Library *library, Material& material)
+{
+	MaterialChunk& chunk = material.mChunk;
+	if (chunk.mbThumbnailLoaded)
+		return;
+	chunk.mbThumbnailLoaded = true;
+	const uint8_t *data = library->mFile ? library->mFile->GetData(chunk.mThumbnailSource, chunk.mThumbnailOffset, chunk.mThumbnailSize) : NULL;
+	// a thumbnail set since loading replaces the stored one
+	if (data && material.mThumbnail.empty())
+		material.mThumbnail.assign(data, data + chunk.mThumbnailSize);
+	chunk.mThumbnailHash = Hash(material.mThumbnail.data(), material.mThumbnail.size());
+}
+
+bool LoadMaterial(Library *library, Material& material)
+{
+	LoadMaterialThumbnail(library, material);
+	MaterialChunk& chunk = material.mChunk;
+	if (chunk.mbLoaded)
+		return true;
+	chunk.mbLoaded = true;
+
+	const LibraryFile *file = library->mFile;
+	const uint8_t *data = file ? file->GetData(chunk.mSource, chunk.mOffset, chunk.mSize) : NULL;
+	if (!data || Hash(data, size_t(chunk.mSize)) != chunk.mHash)
+	{
+		Log("Graph %s is corrupted in the library.\n", material.mName.c_str());
+		chunk.mbDirty = true;
+		return false;
+	}
+
+	SerializeRead chunkSer(data, size_t(chunk.mSize), file->mDataVersion);
+	chunkSer.Ser(&material);
+	InitMaterialNodes(material, file->mDataVersion);
+	return !chunkSer.mbError;
+}
+
+void LoadAllMaterials(Library *library)
+{
+	for (auto& material : library->mMaterials)
+		LoadMaterial(library, material);
+}
+
+// materials content comes from memory when loaded, from the mappings otherwise. toc receives the new positions
+static bool WriteLib(const std::vector<Material>& materials, const LibraryFile *file, const char *szFilename, std::vector<Material>& toc)
+{
+	SerializeWrite ser(szFilename);
+	if (!ser.fp)
+		return false;
+	ser.dataVersion = v_lastVersion - 1;
+	ser.Ser(ser.dataVersion);
+
+	// table of contents is written once with placeholders, then with the chunks positions
+	toc.resize(materials.size());
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		toc[i].mName = materials[i].mName;
+		toc[i].mRuntimeUniqueId = materials[i].mRuntimeUniqueId;
+		toc[i].mChunk = materials[i].mChunk;
+	}
+	int64_t tocPosition = ser.Tell();
+	ser.SerTableOfContents(toc, false);
+
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		const Material& material = materials[i];
+		const MaterialChunk& stored = material.mChunk;
+		MaterialChunk& chunk = toc[i].mChunk;
+
+		const uint8_t *thumbnail = material.mThumbnail.data();
+		size_t thumbnailSize = material.mThumbnail.size();
+		if (!stored.mbThumbnailLoaded)
+		{
+			thumbnail = file ? file->GetData(stored.mThumbnailSource, stored.mThumbnailOffset, stored.mThumbnailSize) : NULL;
+			thumbnailSize = thumbnail ? stored.mThumbnailSize : 0;
+		}
+		chunk.mThumbnailSource = Source_Library;
+		chunk.mThumbnailOffset = uint64_t(ser.Tell());
+		chunk.mThumbnailSize = uint32_t(thumbnailSize);
+		chunk.mThumbnailHash = Hash(thumbnail, thumbnailSize);
+		if (thumbnailSize)
+			ser.Write(thumbnail, thumbnailSize);
+
+		chunk.mSource = Source_Library;
+		chunk.mOffset = uint64_t(ser.Tell());
+		const uint8_t *data = (stored.mbLoaded || !file) ? NULL : file->GetData(stored.mSource, stored.mOffset, stored.mSize);
+		if (data)
+		{
+			// unchanged since written, copied as is
+			ser.Write(data, size_t(stored.mSize));
+		}
+		else
 		{
-			node.mRuntimeUniqueId = GetRuntimeId();
-			if (loadSer.dataVersion >= v_nodeTypeName)
+			std::vector<uint8_t> buffer;
+			SerializeWrite chunkSer(buffer, ser.dataVersion);
+			chunkSer.Ser(const_cast<Material*>(&material));
+			chunk.mSize = buffer.size();
+			chunk.mHash = Hash(buffer.data(), buffer.size());
+			ser.Write(buffer.data(), buffer.size());
+		}
+	}
+
+	ser.Seek(tocPosition);
+	ser.SerTableOfContents(toc, false);
+	ser.Sync();
+	return !ser.mbError;
+}
+
+static void UpdateChunkLocations(Library *library, const std::vector<Material>& toc)
+{
+	for (size_t i = 0; i < toc.size(); i++)
+	{
+		// materials deleted in the meantime are gone
+		Material *material = library->Get(ASyncId(i, toc[i].mRuntimeUniqueId));
+		if (!material)
+			continue;
+		MaterialChunk& chunk = material->mChunk;
+		const MaterialChunk& stored = toc[i].mChunk;
+		chunk.mSource = stored.mSource;
+		chunk.mOffset = stored.mOffset;
+		chunk.mSize = stored.mSize;
+		chunk.mHash = stored.mHash;
+		chunk.mThumbnailSource = stored.mThumbnailSource;
+		chunk.mThumbnailOffset = stored.mThumbnailOffset;
+		chunk.mThumbnailSize = stored.mThumbnailSize;
+		chunk.mThumbnailHash = stored.mThumbnailHash;
+	}
+}
+
+// the mapping can't outlive the file it maps: it's closed before tmpPath replaces the library and the new file is mapped
+static bool ReplaceLibraryFile(Library *library, const char *tmpPath, const char *szFilename, const std::vector<Material>& toc)
+{
+	CloseLibraryFile(library->mFile);
+	library->mFile = NULL;
+
+	if (!MoveOverFile(tmpPath, szFilename))
+	{
+		Log("Unable to replace library %s, saved as %s\n", szFilename, tmpPath);
+		return false;
+	}
+	library->mFilename = szFilename;
+	// folded in the new file
+	remove(GetJournalFilename(library->mFilename).c_str());
+
+	std::vector<Material> fileToc;
+	library->mFile = OpenLibraryFile(szFilename, fileToc);
+	if (!library->mFile)
+	{
+		// everything not loaded yet is lost for this session
+		Log("Unable to map library %s\n", szFilename);
+		return false;
+	}
+	UpdateChunkLocations(library, toc);
+	library->mFile->mTocHash = HashTableOfContents(library->mMaterials, library->mFile->mDataVersion);
+	return true;
+}
+
+void SaveLib(Library *library, const char *szFilename)
+{
+	EndLibrarySave(library, true);
+
+	// chunks of an older version can't be copied as is
+	if (library->mFile && library->mFile->mDataVersion != v_lastVersion - 1)
+		LoadAllMaterials(library);
+
+	// a partially written library never replaces the previous one
+	std::string tmpPath = std::string(szFilename) + ".tmp";
+	std::vector<Material> toc;
+	if (!WriteLib(library->mMaterials, library->mFile, tmpPath.c_str(), toc))
+	{
+		remove(tmpPath.c_str());
+		Log("Unable to write library %s\n", szFilename);
+		return;
+	}
+	if (ReplaceLibraryFile(library, tmpPath.c_str(), szFilename, toc))
+	{
+		for (auto& material : library->mMaterials)
+			material.mChunk.mbDirty = false;
+	}
+}
+
+// saves modified materials on a worker thread. Appends them to the journal next to the library
+// or, when the journal grows too large, rewrites the library with everything folded in
+struct LibrarySaveJob : enki::ITaskSet
+{
+	LibrarySaveJob() : enki::ITaskSet(), mLibrary(NULL), mFile(NULL), mbCompact(false), mbSuccess(false)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		mbSuccess = mbCompact ? Compact() : Append();
+	}
+
+	bool Compact()
+	{
+		return WriteLib(mMaterials, mFile, mTmpPath.c_str(), mToc);
+	}
+
+	uint64_t AppendBlob(const void *data, size_t size)
+	{
+		uint64_t offset = mFile->mJournalSize;
+		if (size && fwrite(data, size, 1, mFile->mJournal) != 1)
+			mbWriteError = true;
+		mFile->mJournalSize += size;
+		return offset;
+	}
+
+	bool Append()
+	{
+		LibraryFile *file = mFile;
+		mbWriteError = false;
+		if (!file->mJournal)
+		{
+			std::string journalFilename = GetJournalFilename(mFilename);
+			bool created = !file->mJournalSize;
+			file->mJournal = fopen(journalFilename.c_str(), created ? "wb" : "ab");
+			if (!file->mJournal)
+				return false;
+			if (created)
+			{
+				JournalHeader header = { JournalMagic, file->mDataVersion, file->mBaseId };
+				AppendBlob(&header, sizeof(JournalHeader));
+			}
+			else
+			{
+				// appended after a torn record if any, the scan skips it
+				fseek64(file->mJournal, 0, SEEK_END);
+				file->mJournalSize = uint64_t(ftell64(file->mJournal));
+			}
+		}
+
+		bool written = false;
+		for (auto& material : mMaterials)
+		{
+			MaterialChunk& chunk = material.mChunk;
+			if (chunk.mbThumbnailLoaded)
 			{
-				node.mType = uint32_t(GetMetaNodeIndex(node.mTypeName));
+				uint64_t thumbnailHash = Hash(material.mThumbnail.data(), material.mThumbnail.size());
+				if (thumbnailHash != chunk.mThumbnailHash)
+				{
+					chunk.mThumbnailSource = Source_Journal;
+					chunk.mThumbnailOffset = AppendBlob(material.mThumbnail.data(), material.mThumbnail.size());
+					chunk.mThumbnailSize = uint32_t(material.mThumbnail.size());
+					chunk.mThumbnailHash = thumbnailHash;
+					written = true;
+				}
+			}
+			if (chunk.mbLoaded)
+			{
+				// marked dirty without an actual change: nothing to write
+				std::vector<uint8_t> buffer;
+				SerializeWrite chunkSer(buffer, file->mDataVersion);
+				chunkSer.Ser(&material);
+				uint64_t hash = Hash(buffer.data(), buffer.size());
+				if (!chunk.mSize || hash != chunk.mHash)
+				{
+					chunk.mSource = Source_Journal;
+					chunk.mOffset = AppendBlob(buffer.data(), buffer.size());
+					chunk.mSize = buffer.size();
+					chunk.mHash = hash;
+					written = true;
+				}
 			}
 		}
+
+		// a commit is the table of contents followed by its footer, durable before it's acknowledged
+		std::vector<uint8_t> tocBuffer;
+		SerializeWrite tocSer(tocBuffer, file->mDataVersion);
+		tocSer.SerTableOfContents(mMaterials, true);
+		uint64_t tocHash = Hash(tocBuffer.data(), tocBuffer.size());
+		if (written || tocHash != file->mTocHash)
+		{
+			JournalCommit commit;
+			commit.mTocSize = tocBuffer.size();
+			commit.mTocOffset = AppendBlob(tocBuffer.data(), tocBuffer.size());
+			commit.mTocHash = tocHash;
+			commit.mPadding = 0;
+			commit.mMagic = JournalCommitMagic;
+			AppendBlob(&commit, sizeof(JournalCommit));
+			SyncFile(file->mJournal);
+			if (mbWriteError || ferror(file->mJournal))
+			{
+				// the next commit starts on a fresh journal handle
+				fclose(file->mJournal);
+				file->mJournal = NULL;
+				return false;
+			}
+			file->mTocHash = tocHash;
+		}
+		mToc.swap(mMaterials);
+		return true;
 	}
+
+	Library *mLibrary;
+	LibraryFile *mFile;
+	std::string mFilename;
+	std::string mTmpPath;
+	std::vector<Material> mMaterials;
+	std::vector<Material> mToc;
+	bool mbCompact;
+	bool mbSuccess;
+	bool mbWriteError;
+};
+static LibrarySaveJob gLibrarySaveJob;
+
+bool IsLibrarySaving()
+{
+	return gLibrarySaveJob.mLibrary != NULL;
 }
 
-void SaveLib(Library *library, const char *szFilename)
+bool BeginLibrarySave(Library *library, bool compact)
+{
+	if (IsLibrarySaving() || library->mFilename.empty())
+		return false;
+
+	LibraryFile *file = library->mFile;
+	compact |= !file || file->mDataVersion != v_lastVersion - 1;
+	if (!compact)
+	{
+		uint64_t baseSize = file->mMapped[Source_Library].mSize;
+		compact = file->mJournalSize > std::max(uint64_t(64 << 20), baseSize / 4);
+	}
+	if (compact && file && file->mDataVersion != v_lastVersion - 1)
+		LoadAllMaterials(library);
+
+	// nothing modified and nothing deleted since the last commit
+	if (!compact && file->mTocHash == HashTableOfContents(library->mMaterials, file->mDataVersion))
+	{
+		bool dirty = false;
+		for (auto& material : library->mMaterials)
+			dirty |= material.mChunk.mbDirty;
+		if (!dirty)
+			return false;
+	}
+
+	// snapshot. The worker only touches the copies and the mappings
+	LibrarySaveJob& job = gLibrarySaveJob;
+	job.mMaterials.resize(library->mMaterials.size());
+	for (size_t i = 0; i < library->mMaterials.size(); i++)
+	{
+		Material& material = library->mMaterials[i];
+		Material& copy = job.mMaterials[i];
+		bool copyContent = material.mChunk.mbLoaded && (material.mChunk.mbDirty || compact);
+		if (copyContent)
+		{
+			copy = material;
+		}
+		else
+		{
+			copy = Material();
+			copy.mName = material.mName;
+			copy.mRuntimeUniqueId = material.mRuntimeUniqueId;
+			copy.mChunk = material.mChunk;
+			copy.mChunk.mbLoaded = false;
+			if (material.mChunk.mbThumbnailLoaded)
+				copy.mThumbnail = material.mThumbnail;
+		}
+		material.mChunk.mbDirty = false;
+	}
+	job.mLibrary = library;
+	job.mFile = file;
+	job.mFilename = library->mFilename;
+	job.mTmpPath = library->mFilename + ".tmp";
+	job.mbCompact = compact;
+	job.mbSuccess = false;
+	job.mToc.clear();
+	g_TS.AddTaskSetToPipe(&job);
+	return true;
+}
+
+bool EndLibrarySave(Library *library, bool wait)
 {
-	SerializeWrite(szFilename).Ser(library);
+	LibrarySaveJob& job = gLibrarySaveJob;
+	if (job.mLibrary != library)
+		return false;
+	if (!wait && !job.GetIsComplete())
+		return true;
+	g_TS.WaitforTask(&job);
+	job.mLibrary = NULL;
+
+	bool success = job.mbSuccess;
+	if (success && job.mbCompact)
+	{
+		success = ReplaceLibraryFile(library, job.mTmpPath.c_str(), job.mFilename.c_str(), job.mToc);
+	}
+	else if (success)
+	{
+		// new records are read through a mapping of the grown journal
+		DiskCache::MappedFile& mapped = library->mFile->mMapped[Source_Journal];
+		DiskCache::Unmap(mapped);
+		DiskCache::MapFile(GetJournalFilename(job.mFilename).c_str(), mapped);
+		UpdateChunkLocations(library, job.mToc);
+	}
+	else if (job.mbCompact)
+	{
+		remove(job.mTmpPath.c_str());
+	}
+
+	if (!success)
+	{
+		Log("Unable to save library %s\n", job.mFilename.c_str());
+		// saved again next time
+		for (size_t i = 0; i < job.mMaterials.size(); i++)
+		{
+			Material *material = library->Get(ASyncId(i, job.mMaterials[i].mRuntimeUniqueId));
+			if (material && job.mMaterials[i].mChunk.mbLoaded)
+				material->mChunk.mbDirty = true;
+		}
+	}
+	job.mMaterials.clear();
+	job.mToc.clear();
+	return false;
 }
 
 unsigned int GetRuntimeId()
@@ -476,6 +1165,10 @@ void LoadMetaNodes()
 		,{ "Width", Con_Int }
 		,{ "Height", Con_Int }
 		,{ "Mode", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "Free\0Keep ratio on Y\0Keep ratio on X\0"}
+		,{ "FPS", Con_Int }
+		,{ "Bitrate (kbps)", Con_Int }
+		,{ "Codec", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "H.264\0HEVC\0MPEG-4\0" }
+		,{ "Preset", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "Default\0ultrafast\0superfast\0veryfast\0faster\0fast\0medium\0slow\0slower\0veryslow\0" }
 		,{ "Export", Con_ForceEvaluate } }
 		}
 
@@ -544,6 +1237,9 @@ void LoadMetaNodes()
 		,{ "mie distribution", Con_Float }
 		,{ "Size", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "  256\0  512\0 1024\0 2048\0 4096\0" }
 			}
+		, false
+		, false
+		, TextureFormat::RGBA16F
 		}
 
 
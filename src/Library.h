@@ -62,8 +62,8 @@ struct InputSampler
 	}
 	uint32_t mWrapU;
 	uint32_t mWrapV;
-	uint32_t mFilterMin;
-	uint32_t mFilterMag;
+	uint32_t mFilterMin; // 0 linear, 1 nearest, 2 trilinear, 3 anisotropic
+	uint32_t mFilterMag; // 0 linear, 1 nearest
 };
 struct MaterialNode
 {
@@ -99,6 +99,36 @@ struct MaterialConnection
 	uint8_t mInputSlot;
 	uint8_t mOutputSlot;
 };
+enum LibrarySource
+{
+	Source_Library,
+	Source_Journal, // library.dat.log, changes appended since the library file was written
+	Source_Count
+};
+
+// where a material is stored in a chunked library and what is in memory
+struct MaterialChunk
+{
+	MaterialChunk() : mSource(Source_Library), mOffset(0), mSize(0), mHash(0)
+		, mThumbnailSource(Source_Library), mThumbnailOffset(0), mThumbnailSize(0), mThumbnailHash(0)
+		, mbLoaded(true), mbThumbnailLoaded(true), mbDirty(true)
+	{
+	}
+	uint32_t mSource;
+	uint64_t mOffset;
+	uint64_t mSize;
+	uint64_t mHash;
+	uint32_t mThumbnailSource;
+	uint64_t mThumbnailOffset;
+	uint32_t mThumbnailSize;
+	uint64_t mThumbnailHash; // not stored, computed when the thumbnail is read or written
+
+	// runtime. A new material is loaded and not saved yet
+	bool mbLoaded;
+	bool mbThumbnailLoaded;
+	bool mbDirty; // might differ from the stored chunk, checked by the next save
+};
+
 struct Material
 {
 	std::string mName;
@@ -111,17 +141,44 @@ struct Material
 	MaterialNode* Get(ASyncId id) { return GetByAsyncId(id, mMaterialNodes); }
 
 	//run time
-	unsigned int mThumbnailTextureId;
+	unsigned int mThumbnailHandle; // slot in the thumbnail atlas, 0 when not decoded
 	unsigned int mRuntimeUniqueId;
+	MaterialChunk mChunk;
+	bool IsLoaded() const { return mChunk.mbLoaded; }
 };
+
+struct LibraryFile;
 struct Library
 {
+	Library() : mFile(NULL), mGeneration(0) {}
+	~Library();
+	Library(const Library&) = delete;
+	Library& operator = (const Library&) = delete;
+
 	std::vector<Material> mMaterials;
 	Material* Get(ASyncId id) { return GetByAsyncId(id, mMaterials); }
+
+	// chunked libraries stay mapped while materials are read on demand
+	LibraryFile *mFile;
+	std::string mFilename;
+	unsigned int mGeneration; // bumped when materials are added, removed or renamed
 };
 
+// chunked libraries only read names at load time
 void LoadLib(Library *library, const char *szFilename);
 void SaveLib(Library *library, const char *szFilename);
+// reads nodes, connections, rugs and thumbnail of a material. No-op when already loaded
+bool LoadMaterial(Library *library, Material& material);
+void LoadMaterialThumbnail(Library *library, Material& material);
+void LoadAllMaterials(Library *library);
+
+// background save of the library loaded with LoadLib. Materials flagged dirty are copied on the main thread,
+// then a worker appends the changed chunks to a journal committed by a validated footer. The journal is
+// folded into the library file by an atomic rename once it grows. Changes survive a crash after the commit
+bool BeginLibrarySave(Library *library, bool compact = false);
+// applies a finished save. Returns true while the save is running
+bool EndLibrarySave(Library *library, bool wait);
+bool IsLibrarySaving();
 
 enum ConTypes
 {
@@ -175,6 +232,7 @@ struct MetaNode
 	std::vector<MetaParameter> mParams;
 	bool mbHasUI;
 	bool mbSaveTexture;
+	int mOutputFormat = -1; // TextureFormat of the output, -1 for the highest precision of the inputs
 };
 
 extern std::vector<MetaNode> gMetaNodes;
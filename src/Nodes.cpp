@@ -468,6 +468,7 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 		{
 			node->Pos += ImGui::GetIO().MouseDelta / factor;
 			isMovingNode = true;
+			delegate->mEditCount++;
 		}
 
 		if (!io.MouseDown[0])
@@ -517,6 +518,15 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 		else
 			draw_list->AddImage((ImTextureID)(int64_t)(delegate->GetNodeTexture(size_t(node_idx))), imgPos + marge, imgPosMax - marge, ImVec2(0, 1), ImVec2(1, 0));
 
+		float evaluationTime = delegate->NodeEvaluationTime(node_idx);
+		if (evaluationTime >= 0.f)
+		{
+			char tmps[64];
+			ImFormatString(tmps, sizeof(tmps), "%.2f ms", evaluationTime);
+			draw_list->AddText(imgPos + ImVec2(3, 3), IM_COL32(0, 0, 0, 255), tmps);
+			draw_list->AddText(imgPos + ImVec2(2, 2), IM_COL32(255, 255, 255, 255), tmps);
+		}
+
 		// draw/use inputs/outputs
 		bool hoverSlot = false;
 		for (int i = 0; i < 2; i++)
@@ -643,7 +653,10 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 	{
 		if (EditRug(editRug, draw_list, offset, factor))
 			editRug = NULL;
+		delegate->mEditCount++;
 	}
+	if ((movingRug || sizingRug) && ImGui::IsMouseDragging(0))
+		delegate->mEditCount++;
 	// Open context menu
 	if (!ImGui::IsAnyItemHovered() && ImGui::IsWindowHovered(ImGuiHoveredFlags_AllowWhenBlockedByPopup | ImGuiHoveredFlags_AllowWhenBlockedByActiveItem) && ImGui::IsMouseClicked(1))
 	{
@@ -722,6 +735,7 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 			if (ImGui::MenuItem("Add rug", NULL, false))
 			{
 				rugs.push_back({ scene_pos, ImVec2(400,200), 0xFFA0A0A0, "Description\nEdit me with a double click." });
+				delegate->mEditCount++;
 			}
 			static char inputText[64] = { 0 };
 			ImGui::InputText("", inputText, sizeof(inputText));
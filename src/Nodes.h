@@ -29,13 +29,14 @@
 #include <stdint.h>
 struct NodeGraphDelegate
 {
-	NodeGraphDelegate() : mSelectedNodeIndex(-1), mBakeTargetIndex(-1), mCategoriesCount(0), mCategories(0)
+	NodeGraphDelegate() : mSelectedNodeIndex(-1), mBakeTargetIndex(-1), mCategoriesCount(0), mCategories(0), mEditCount(0)
 	{}
 
 	int mSelectedNodeIndex;
 	int mBakeTargetIndex;
 	int mCategoriesCount;
 	const char ** mCategories;
+	unsigned int mEditCount; // changes made to the graph since it was last saved
 
 	virtual void UpdateEvaluationList(const std::vector<size_t> nodeOrderList) = 0;
 	virtual void AddLink(int InputIdx, int InputSlot, int OutputIdx, int OutputSlot) = 0;
@@ -54,6 +55,8 @@ struct NodeGraphDelegate
 	virtual bool NodeHasUI(size_t nodeIndex) = 0;
 	virtual bool NodeIsProcesing(size_t nodeIndex) = 0;
 	virtual bool NodeIsCubemap(size_t nodeIndex) = 0;
+	// last evaluation time in ms, negative when not profiled
+	virtual float NodeEvaluationTime(size_t nodeIndex) = 0;
 };
 
 struct Node
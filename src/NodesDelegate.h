@@ -31,6 +31,7 @@
 #include "Library.h"
 #include "nfd.h"
 #include "EvaluationContext.h"
+#include "Profiler.h"
 
 struct RampEdit : public ImCurveEdit::Delegate
 {
@@ -113,6 +114,8 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		assert(!mInstance);
 		mInstance = this;
 		gCurrentContext = &mEditingContext;
+		mEditingContext.SetProgressive(true);
+		mEditingContext.SetFrameBudget(8.f);
 	}
 
 	Evaluation& mEvaluation;
@@ -152,6 +155,7 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		memcpy(node.mParameters, parameters, ComputeNodeParametersSize(node.mType));
 		mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, parameters, node.mParametersSize);
 		mEvaluation.SetEvaluationSampler(node.mEvaluationTarget, node.mInputSamplers);
+		mEditCount++;
 	}
 
 	virtual bool AuthorizeConnexion(int typeA, int typeB)
@@ -187,20 +191,24 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 
 		mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
 		mEvaluation.SetEvaluationSampler(node.mEvaluationTarget, node.mInputSamplers);
+		mEditCount++;
 	}
 
 	void AddLink(int InputIdx, int InputSlot, int OutputIdx, int OutputSlot)
 	{
 		mEvaluation.AddEvaluationInput(OutputIdx, OutputSlot, InputIdx);
+		mEditCount++;
 	}
 
 	virtual void DelLink(int index, int slot)
 	{
 		mEvaluation.DelEvaluationInput(index, slot);
+		mEditCount++;
 	}
 
 	virtual void DeleteNode(size_t index)
 	{
+		mEditCount++;
 		mEvaluation.DelEvaluationTarget(index);
 		free(mNodes[index].mParameters);
 		mNodes.erase(mNodes.begin() + index);
@@ -231,18 +239,20 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 			{
 				InputSampler& inputSampler = node.mInputSamplers[i];
 				static const char *wrapModes = { "REPEAT\0CLAMP_TO_EDGE\0CLAMP_TO_BORDER\0MIRRORED_REPEAT" };
-				static const char *filterModes = { "LINEAR\0NEAREST" };
+				static const char *filterMinModes = { "LINEAR\0NEAREST\0TRILINEAR\0ANISOTROPIC" };
+				static const char *filterMagModes = { "LINEAR\0NEAREST" };
 				ImGui::PushItemWidth(150);
 				ImGui::Text("Sampler %d", i);
 				samplerDirty |= ImGui::Combo("Wrap U", (int*)&inputSampler.mWrapU, wrapModes);
 				samplerDirty |= ImGui::Combo("Wrap V", (int*)&inputSampler.mWrapV, wrapModes);
-				samplerDirty |= ImGui::Combo("Filter Min", (int*)&inputSampler.mFilterMin, filterModes);
-				samplerDirty |= ImGui::Combo("Filter Mag", (int*)&inputSampler.mFilterMag, filterModes);
+				samplerDirty |= ImGui::Combo("Filter Min", (int*)&inputSampler.mFilterMin, filterMinModes);
+				samplerDirty |= ImGui::Combo("Filter Mag", (int*)&inputSampler.mFilterMag, filterMagModes);
 				ImGui::PopItemWidth();
 			}
 			if (samplerDirty)
 			{
 				mEvaluation.SetEvaluationSampler(node.mEvaluationTarget, node.mInputSamplers);
+				mEditCount++;
 			}
 
 		}
@@ -390,6 +400,7 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		{
 			mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
 			mEditingContext.SetTargetDirty(node.mEvaluationTarget);
+			mEditCount++;
 		}
 	}
 	virtual void SetTimeSlot(size_t index, int frameStart, int frameEnd)
@@ -397,12 +408,14 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		ImogenNode & node = mNodes[index];
 		node.mStartFrame = frameStart;
 		node.mEndFrame = frameEnd;
+		mEditCount++;
 	}
 
 	void SetTimeDuration(size_t index, int duration)
 	{
 		ImogenNode & node = mNodes[index];
 		node.mEndFrame = node.mStartFrame + duration;
+		mEditCount++;
 	}
 
 	void SetTime(int time, bool updateDecoder)
@@ -463,10 +476,25 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		InvalidateParameters();
 	}
 
-	void InvalidateParameters()
+	// -1 for every node type
+	void InvalidateParameters(int nodeType = -1)
 	{
 		for (auto& node : mNodes)
-			mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
+		{
+			if (nodeType == -1 || int(node.mType) == nodeType)
+				mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
+		}
+	}
+
+	// evaluator of nodeType reloaded, -1 for every node type
+	void ReloadNodes(int nodeType)
+	{
+		InvalidateParameters(nodeType);
+		for (auto& node : mNodes)
+		{
+			if (nodeType == -1 || int(node.mType) == nodeType)
+				mEditingContext.SetTargetDirty(node.mEvaluationTarget);
+		}
 	}
 
 	template<typename T> static inline T nmin(T lhs, T rhs) { return lhs >= rhs ? rhs : lhs; }
@@ -539,6 +567,9 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 			mEvaluation.SetMouse(mSelectedNodeIndex, rx, ry, lButDown, rButDown);
 			mEvaluation.SetEvaluationParameters(mNodes[mSelectedNodeIndex].mEvaluationTarget, mNodes[mSelectedNodeIndex].mParameters, mNodes[mSelectedNodeIndex].mParametersSize);
 			mEditingContext.SetTargetDirty(mNodes[mSelectedNodeIndex].mEvaluationTarget);
+			// painting and dragging parameters
+			if (lButDown || rButDown)
+				mEditCount++;
 		}
 	}
 
@@ -567,6 +598,11 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		return false;
 	}
 
+	virtual float NodeEvaluationTime(size_t nodeIndex)
+	{
+		return gProfiler.GetNodeTime(nodeIndex);
+	}
+
 	virtual void UpdateEvaluationList(const std::vector<size_t> nodeOrderList)
 	{
 		mEvaluation.SetEvaluationOrder(nodeOrderList);
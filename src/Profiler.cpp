@@ -0,0 +1,269 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <GL/gl3w.h>
+#include "Profiler.h"
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+Profiler gProfiler;
+
+static const uint32_t GPUThreadId = 1;
+
+// trace ids, numbered in order of first use
+static uint32_t GetThreadId()
+{
+	static std::atomic<uint32_t> nextThreadId(GPUThreadId + 1);
+	thread_local uint32_t threadId = nextThreadId++;
+	return threadId;
+}
+
+float Profiler::NodeHistory::GetLast(int type) const
+{
+	if (!mCount[type])
+		return -1.f;
+	return mTimes[type][(mIndex[type] + HistorySize - 1) % HistorySize];
+}
+
+float Profiler::NodeHistory::GetAverage(int type) const
+{
+	if (!mCount[type])
+		return -1.f;
+	float sum = 0.f;
+	for (int i = 0; i < mCount[type]; i++)
+		sum += mTimes[type][i];
+	return sum / float(mCount[type]);
+}
+
+float Profiler::NodeHistory::GetMax(int type) const
+{
+	if (!mCount[type])
+		return -1.f;
+	float res = 0.f;
+	for (int i = 0; i < mCount[type]; i++)
+		res = std::max(res, mTimes[type][i]);
+	return res;
+}
+
+Profiler::CPUScope::CPUScope(size_t target, const char *name, int type) : mTarget(target), mName(name), mType(type), mStart(0)
+{
+	if (gProfiler.IsEnabled())
+		mStart = Profiler::GetTime();
+}
+
+Profiler::CPUScope::~CPUScope()
+{
+	if (mStart)
+		gProfiler.AddCPUSample(mTarget, mName, mType, mStart, Profiler::GetTime());
+}
+
+Profiler::Profiler() : mbEnabled(false), mTraceEventIndex(0), mbQueryOpen(false), mGPUClockOffset(0), mGeneration(0)
+{
+}
+
+int64_t Profiler::GetTime()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Profiler::BeginGPU(size_t target, const char *name)
+{
+	if (!mbEnabled || mbQueryOpen)
+		return;
+	PendingQuery query;
+	query.mTarget = target;
+	query.mName = name;
+	query.mGeneration = mGeneration;
+	for (int i = 0; i < 2; i++)
+	{
+		if (mFreeQueries.empty())
+		{
+			glGenQueries(1, &query.mQueries[i]);
+		}
+		else
+		{
+			query.mQueries[i] = mFreeQueries.back();
+			mFreeQueries.pop_back();
+		}
+	}
+	glQueryCounter(query.mQueries[0], GL_TIMESTAMP);
+	mPendingQueries.push_back(query);
+	mbQueryOpen = true;
+}
+
+void Profiler::EndGPU()
+{
+	if (!mbQueryOpen)
+		return;
+	glQueryCounter(mPendingQueries.back().mQueries[1], GL_TIMESTAMP);
+	mbQueryOpen = false;
+}
+
+void Profiler::ResolveGPU()
+{
+	if (mPendingQueries.empty())
+		return;
+
+	GLint64 gpuTime;
+	glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+	mGPUClockOffset = GetTime() - gpuTime;
+
+	// queries complete in submission order
+	size_t resolved = 0;
+	size_t pendingCount = mPendingQueries.size() - (mbQueryOpen ? 1 : 0);
+	for (; resolved < pendingCount; resolved++)
+	{
+		PendingQuery& query = mPendingQueries[resolved];
+		GLint available = 0;
+		glGetQueryObjectiv(query.mQueries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+		GLuint64 start, end;
+		glGetQueryObjectui64v(query.mQueries[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(query.mQueries[1], GL_QUERY_RESULT, &end);
+		mFreeQueries.push_back(query.mQueries[0]);
+		mFreeQueries.push_back(query.mQueries[1]);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		// issued before Clear: targets may now belong to other nodes
+		if (query.mGeneration != mGeneration)
+			continue;
+		AddSample(query.mTarget, Sample_GPU, float(double(end - start) / 1000000.0));
+		TraceEvent event = { query.mName, Sample_GPU, query.mTarget, GPUThreadId, int64_t(start) + mGPUClockOffset, int64_t(end - start) };
+		AddTraceEvent(event);
+	}
+	mPendingQueries.erase(mPendingQueries.begin(), mPendingQueries.begin() + resolved);
+}
+
+void Profiler::AddCPUSample(size_t target, const char *name, int type, int64_t start, int64_t end)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	AddSample(target, type, float(double(end - start) / 1000000.0));
+	TraceEvent event = { name, type, target, GetThreadId(), start, end - start };
+	AddTraceEvent(event);
+}
+
+void Profiler::AddSample(size_t target, int type, float ms)
+{
+	auto iter = mNodes.find(target);
+	if (iter == mNodes.end())
+	{
+		NodeHistory history;
+		memset(&history, 0, sizeof(NodeHistory));
+		iter = mNodes.insert(std::make_pair(target, history)).first;
+	}
+	NodeHistory& history = iter->second;
+	history.mTimes[type][history.mIndex[type]] = ms;
+	history.mIndex[type] = (history.mIndex[type] + 1) % NodeHistory::HistorySize;
+	history.mCount[type] = std::min(history.mCount[type] + 1, int(NodeHistory::HistorySize));
+}
+
+void Profiler::AddTraceEvent(const TraceEvent& event)
+{
+	if (mTraceEvents.size() < MaxTraceEvents)
+	{
+		mTraceEvents.push_back(event);
+		return;
+	}
+	mTraceEvents[mTraceEventIndex] = event;
+	mTraceEventIndex = (mTraceEventIndex + 1) % MaxTraceEvents;
+}
+
+bool Profiler::GetNodeHistory(size_t target, NodeHistory& history)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto iter = mNodes.find(target);
+	if (iter == mNodes.end())
+		return false;
+	history = iter->second;
+	return true;
+}
+
+float Profiler::GetNodeTime(size_t target)
+{
+	NodeHistory history;
+	if (!mbEnabled || !GetNodeHistory(target, history))
+		return -1.f;
+	float res = 0.f;
+	for (int type = 0; type < Sample_Count; type++)
+		res += std::max(history.GetLast(type), 0.f);
+	return res;
+}
+
+void Profiler::Clear()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mNodes.clear();
+	mTraceEvents.clear();
+	mTraceEventIndex = 0;
+	mGeneration++;
+}
+
+static void WriteJSONString(FILE *fp, const std::string& str)
+{
+	fputc('"', fp);
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			fputc('\\', fp);
+		if (c >= 0 && c < 0x20)
+			continue;
+		fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+bool Profiler::ExportChromeTrace(const char *filename)
+{
+	FILE *fp = fopen(filename, "wt");
+	if (!fp)
+		return false;
+
+	std::vector<TraceEvent> events;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		events = mTraceEvents;
+	}
+	std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.mStart < b.mStart; });
+	int64_t origin = events.empty() ? 0 : events.front().mStart;
+
+	static const char *categories[Sample_Count] = { "gpu", "cpu", "job" };
+	fprintf(fp, "{\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", GPUThreadId);
+	for (auto& event : events)
+	{
+		fprintf(fp, ",\n{\"name\":");
+		WriteJSONString(fp, event.mName);
+		// chrome trace times are in microseconds
+		fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"node\":%d}}",
+			categories[event.mType], event.mThread, double(event.mStart - origin) / 1000.0, double(event.mDuration) / 1000.0, int(event.mTarget));
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(fp);
+	return true;
+}
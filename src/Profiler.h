@@ -0,0 +1,126 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+// per node timings. GPU time comes from timestamp queries resolved a few frames later,
+// CPU time covers C node functions and the jobs they spawn
+struct Profiler
+{
+	enum SampleType
+	{
+		Sample_GPU,
+		Sample_CPU,
+		Sample_Job,
+		Sample_Count
+	};
+
+	struct NodeHistory
+	{
+		static const int HistorySize = 64;
+		float mTimes[Sample_Count][HistorySize]; // ms
+		int mCount[Sample_Count];
+		int mIndex[Sample_Count];
+
+		float GetLast(int type) const;
+		float GetAverage(int type) const;
+		float GetMax(int type) const;
+	};
+
+	struct TraceEvent
+	{
+		std::string mName;
+		int mType;
+		size_t mTarget;
+		uint32_t mThread;
+		int64_t mStart; // ns, CPU clock
+		int64_t mDuration;
+	};
+
+	// RAII CPU timer, safe from any thread
+	struct CPUScope
+	{
+		CPUScope(size_t target, const char *name, int type = Sample_CPU);
+		~CPUScope();
+		size_t mTarget;
+		const char *mName;
+		int mType;
+		int64_t mStart;
+	};
+
+	Profiler();
+
+	void SetEnabled(bool enabled) { mbEnabled = enabled; }
+	bool IsEnabled() const { return mbEnabled; }
+
+	// GL thread only
+	void BeginGPU(size_t target, const char *name);
+	void EndGPU();
+	void ResolveGPU();
+
+	void AddCPUSample(size_t target, const char *name, int type, int64_t start, int64_t end);
+
+	bool GetNodeHistory(size_t target, NodeHistory& history);
+	// last evaluation time of a node, GPU + CPU in ms. -1 when unknown
+	float GetNodeTime(size_t target);
+	void Clear();
+
+	bool ExportChromeTrace(const char *filename);
+
+	static int64_t GetTime();
+	static const size_t MaxTraceEvents = 100000;
+
+protected:
+	struct PendingQuery
+	{
+		size_t mTarget;
+		std::string mName;
+		unsigned int mQueries[2];
+		unsigned int mGeneration;
+	};
+
+	void AddSample(size_t target, int type, float ms);
+	void AddTraceEvent(const TraceEvent& event);
+
+	bool mbEnabled;
+	std::mutex mMutex;
+	std::map<size_t, NodeHistory> mNodes;
+	std::vector<TraceEvent> mTraceEvents;
+	size_t mTraceEventIndex; // ring position once MaxTraceEvents is reached
+
+	std::vector<PendingQuery> mPendingQueries;
+	std::vector<unsigned int> mFreeQueries;
+	bool mbQueryOpen; // last pending query is begun and not ended
+	int64_t mGPUClockOffset; // CPU clock - GPU clock, refreshed when queries are resolved
+	unsigned int mGeneration; // bumped by Clear, pending queries of older generations are dropped
+};
+
+extern Profiler gProfiler;
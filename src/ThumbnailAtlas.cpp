@@ -0,0 +1,155 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <GL/gl3w.h>    // Initialize with gl3wInit()
+#include "ThumbnailAtlas.h"
+#include "Evaluation.h"
+#include "Utils.h"
+#include <algorithm>
+#include <string.h>
+#include <limits.h>
+
+static const int FreeSlotFrame = -1;
+
+void ThumbnailAtlas::Finish()
+{
+	if (!mPages.empty())
+		glDeleteTextures(GLsizei(mPages.size()), mPages.data());
+	mPages.clear();
+	mSlots.clear();
+}
+
+bool ThumbnailAtlas::AddPage()
+{
+	if (mPages.size() >= MaxPages)
+		return false;
+	unsigned int texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, PageSize, PageSize);
+	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	mPages.push_back(texture);
+	mSlots.resize(mPages.size() * SlotsPerPage, { 0, FreeSlotFrame });
+	return true;
+}
+
+void ThumbnailAtlas::Upload(unsigned int slotIndex, const uint8_t *pixels)
+{
+	unsigned int slotInPage = slotIndex % SlotsPerPage;
+	glBindTexture(GL_TEXTURE_2D, mPages[slotIndex / SlotsPerPage]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (slotInPage % SlotsPerRow) * SlotSize, (slotInPage / SlotsPerRow) * SlotSize, SlotSize, SlotSize, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void ThumbnailAtlas::SetDefault(const uint8_t *pixels)
+{
+	if (mSlots.empty() && !AddPage())
+		return;
+	mSlots[DefaultHandle - 1].mRuntimeUniqueId = 0;
+	mSlots[DefaultHandle - 1].mLastUsedFrame = INT_MAX;
+	Upload(DefaultHandle - 1, pixels);
+}
+
+unsigned int ThumbnailAtlas::Add(unsigned int runtimeUniqueId, const uint8_t *pixels)
+{
+	// free slot first, then a new page, then the least recently drawn slot
+	auto oldest = std::min_element(mSlots.begin(), mSlots.end(), [](const Slot& a, const Slot& b) { return a.mLastUsedFrame < b.mLastUsedFrame; });
+	if (oldest == mSlots.end() || oldest->mLastUsedFrame != FreeSlotFrame)
+	{
+		if (AddPage())
+			oldest = mSlots.end() - SlotsPerPage;
+		else if (oldest == mSlots.end() || oldest->mLastUsedFrame >= ImGui::GetFrameCount())
+			return DefaultHandle;
+	}
+	oldest->mRuntimeUniqueId = runtimeUniqueId;
+	oldest->mLastUsedFrame = ImGui::GetFrameCount();
+	unsigned int slotIndex = (unsigned int)(oldest - mSlots.begin());
+	Upload(slotIndex, pixels);
+	return slotIndex + 1;
+}
+
+bool ThumbnailAtlas::HasFreeSlot() const
+{
+	if (mPages.size() < MaxPages)
+		return true;
+	int frame = ImGui::GetFrameCount();
+	return std::any_of(mSlots.begin(), mSlots.end(), [frame](const Slot& slot) { return slot.mLastUsedFrame < frame; });
+}
+
+bool ThumbnailAtlas::Get(unsigned int handle, unsigned int runtimeUniqueId, Thumbnail& thumbnail)
+{
+	if (!handle || handle > mSlots.size())
+		return false;
+	Slot& slot = mSlots[handle - 1];
+	if (handle != DefaultHandle)
+	{
+		if (slot.mRuntimeUniqueId != runtimeUniqueId || slot.mLastUsedFrame == FreeSlotFrame)
+			return false;
+		slot.mLastUsedFrame = ImGui::GetFrameCount();
+	}
+
+	// half texel inset so linear filtering doesn't bleed from neighbour slots. Thumbnails are stored bottom up
+	unsigned int slotInPage = (handle - 1) % SlotsPerPage;
+	float x = float((slotInPage % SlotsPerRow) * SlotSize);
+	float y = float((slotInPage / SlotsPerRow) * SlotSize);
+	float scale = 1.f / float(PageSize);
+	thumbnail.mTexture = (ImTextureID)(int64_t)mPages[(handle - 1) / SlotsPerPage];
+	thumbnail.mUV0 = ImVec2((x + 0.5f) * scale, (y + SlotSize - 0.5f) * scale);
+	thumbnail.mUV1 = ImVec2((x + SlotSize - 0.5f) * scale, (y + 0.5f) * scale);
+	return true;
+}
+
+void ThumbnailAtlas::Resample(const Image_t& image, std::vector<uint8_t>& pixels)
+{
+	pixels.resize(SlotSize * SlotSize * 4);
+	int components = (image.mFormat == TextureFormat::RGB8) ? 3 : 4;
+	for (int y = 0; y < SlotSize; y++)
+	{
+		int y0 = y * image.mHeight / SlotSize;
+		int y1 = std::max((y + 1) * image.mHeight / SlotSize, y0 + 1);
+		for (int x = 0; x < SlotSize; x++)
+		{
+			int x0 = x * image.mWidth / SlotSize;
+			int x1 = std::max((x + 1) * image.mWidth / SlotSize, x0 + 1);
+			unsigned int sum[4] = { 0, 0, 0, 0 };
+			for (int sy = y0; sy < y1; sy++)
+			{
+				const uint8_t *src = image.mBits + (size_t(sy) * image.mWidth + x0) * components;
+				for (int sx = x0; sx < x1; sx++, src += components)
+				{
+					for (int c = 0; c < components; c++)
+						sum[c] += src[c];
+				}
+			}
+			unsigned int count = (y1 - y0) * (x1 - x0);
+			uint8_t *dst = &pixels[(y * SlotSize + x) * 4];
+			for (int c = 0; c < 4; c++)
+				dst[c] = (c < components) ? uint8_t(sum[c] / count) : 255;
+		}
+	}
+}
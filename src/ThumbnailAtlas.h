@@ -0,0 +1,81 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include "imgui.h"
+
+struct Image_t;
+
+// library thumbnails packed in a few texture pages of fixed size slots. Pages are allocated on demand
+// up to MaxPages, then the slots drawn the longest time ago are recycled so video memory stays bounded
+struct ThumbnailAtlas
+{
+	enum : int
+	{
+		SlotSize = 128,
+		PageSize = 2048,
+		SlotsPerRow = PageSize / SlotSize,
+		SlotsPerPage = SlotsPerRow * SlotsPerRow,
+		MaxPages = 4
+	};
+	// slot for materials without thumbnail. Owned by nobody, never recycled
+	static const unsigned int DefaultHandle = 1;
+
+	struct Thumbnail
+	{
+		ImTextureID mTexture;
+		ImVec2 mUV0;
+		ImVec2 mUV1;
+	};
+
+	void Finish();
+
+	// pixels are SlotSize x SlotSize RGBA8. Returns a handle, DefaultHandle when every slot is drawn this frame
+	unsigned int Add(unsigned int runtimeUniqueId, const uint8_t *pixels);
+	// a page can still be allocated or a slot wasn't drawn this frame
+	bool HasFreeSlot() const;
+	void SetDefault(const uint8_t *pixels);
+	bool HasDefault() const { return !mSlots.empty(); }
+	// false when the slot was recycled for another material. Marks the slot as drawn this frame
+	bool Get(unsigned int handle, unsigned int runtimeUniqueId, Thumbnail& thumbnail);
+
+	// any 8 bits image scaled to the slot size with a box filter. Called by workers
+	static void Resample(const Image_t& image, std::vector<uint8_t>& pixels);
+
+protected:
+	struct Slot
+	{
+		unsigned int mRuntimeUniqueId;
+		int mLastUsedFrame;
+	};
+	bool AddPage();
+	void Upload(unsigned int slotIndex, const uint8_t *pixels);
+
+	std::vector<unsigned int> mPages;
+	std::vector<Slot> mSlots;
+};
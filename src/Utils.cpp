@@ -35,6 +35,18 @@ void TexParam(TextureID MinFilter, TextureID MagFilter, TextureID WrapS, Texture
 	glTexParameteri(texMode, GL_TEXTURE_WRAP_T, WrapT);
 }
 
+uint64_t Hash(const void *data, size_t size, uint64_t seed)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= ptr[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 std::string ReplaceAll(std::string str, const std::string& from, const std::string& to)
 {
 	size_t start_pos = 0;
@@ -64,10 +76,10 @@ void FullScreenTriangle::Init()
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
-void FullScreenTriangle::Render()
+void FullScreenTriangle::Render(int instanceCount)
 {
 	glBindVertexArray(mGLFullScreenVertexArrayName);
-	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, 3, instanceCount);
 	glBindVertexArray(0);
 }
 
@@ -138,6 +150,7 @@ unsigned int LoadShader(const std::string &shaderString, const char *fileName)
 
 
 	// Link the program
+	glProgramParameteri(programObject, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(programObject);
 
 	glBindAttribLocation(programObject, SemUV0, "inUV");
@@ -25,6 +25,8 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
+#include <stddef.h>
 
 typedef unsigned int TextureID;
 static const int SemUV0 = 0;
@@ -39,7 +41,7 @@ public:
 	{
 	}
 	void Init();
-	void Render();
+	void Render(int instanceCount = 1);
 protected:
 	TextureID mGLFullScreenVertexArrayName;
 };
@@ -52,6 +54,10 @@ std::string ReplaceAll(std::string str, const std::string& from, const std::stri
 unsigned int LoadShader(const std::string &shaderString, const char *fileName);
 int Log(const char *szFormat, ...);
 
+// 64 bits FNV-1a. chain calls by passing the previous result as seed
+uint64_t Hash(const void *data, size_t size, uint64_t seed = 0xcbf29ce484222325ULL);
+template<typename T> uint64_t HashValue(const T& value, uint64_t seed) { return Hash(&value, sizeof(T), seed); }
+
 inline int align(int value, int alignment)
 {
 	return (value + alignment - 1)&~(alignment - 1);
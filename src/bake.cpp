@@ -0,0 +1,285 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+// Headless batch renderer.
+// Loads a library, rebuilds every material graph and runs the exporting nodes (ImageWrite, Thumbnail).
+// No UI is created. On Linux the GL context is a surfaceless EGL one so it runs on build farms without a display server,
+// elsewhere (or when EGL is not available) it lives in a hidden window.
+// Usage: imogen-bake [library.dat] [--material name]... [--slice index/count] [--save]
+
+#include <SDL.h>
+#include <GL/gl3w.h>
+#ifdef IMOGEN_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "imgui.h"
+#include "Nodes.h"
+#include "NodesDelegate.h"
+#include "Evaluation.h"
+#include "Imogen.h"
+#include "TaskScheduler.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+#include "ffmpegCodec.h"
+#include "Evaluators.h"
+#include "cmft/clcontext.h"
+
+TileNodeEditGraphDelegate *TileNodeEditGraphDelegate::mInstance = NULL;
+unsigned int gCPUCount = 1;
+cmft::ClContext* clContext = NULL;
+
+Evaluation gEvaluation;
+Library library;
+Imogen imogen;
+enki::TaskScheduler g_TS;
+
+#ifdef IMOGEN_EGL
+static EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+static EGLContext eglContext = EGL_NO_CONTEXT;
+
+// GL 4.3 core context without any surface: evaluation only renders to its own targets
+static bool CreateSurfacelessContext()
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (eglDisplay == EGL_NO_DISPLAY)
+		eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL))
+		return false;
+
+	const char *extensions = eglQueryString(eglDisplay, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context") || !eglBindAPI(EGL_OPENGL_API))
+	{
+		eglTerminate(eglDisplay);
+		return false;
+	}
+
+	static const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(eglDisplay, configAttributes, &config, 1, &configCount) || !configCount)
+	{
+		eglTerminate(eglDisplay);
+		return false;
+	}
+
+	static const EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+	eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+	if (eglContext == EGL_NO_CONTEXT || !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+	{
+		if (eglContext != EGL_NO_CONTEXT)
+			eglDestroyContext(eglDisplay, eglContext);
+		eglContext = EGL_NO_CONTEXT;
+		eglTerminate(eglDisplay);
+		return false;
+	}
+	return true;
+}
+
+static void DestroySurfacelessContext()
+{
+	eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(eglDisplay, eglContext);
+	eglTerminate(eglDisplay);
+}
+#endif
+
+// images saved with the library (paint nodes) are uploaded before exporting nodes run
+static void UploadSavedImages(Material& material, TileNodeEditGraphDelegate& nodeGraphDelegate)
+{
+	nodeGraphDelegate.mEditingContext.AllocRenderTargetsForEditingPreview();
+	for (size_t i = 0; i < material.mMaterialNodes.size() && i < nodeGraphDelegate.mNodes.size(); i++)
+	{
+		MaterialNode& node = material.mMaterialNodes[i];
+		if (node.mImage.empty())
+			continue;
+		Image image;
+		if (Evaluation::DecodeImageBlob(node.mImage.data(), node.mImage.size(), &image) != EVAL_OK)
+		{
+			Log("  unable to decode image of node %d\n", int(i));
+			continue;
+		}
+		TileNodeEditGraphDelegate::ImogenNode& imogenNode = nodeGraphDelegate.mNodes[i];
+		Evaluation::SetEvaluationImage(int(imogenNode.mEvaluationTarget), &image);
+		Evaluation::FreeImage(&image);
+	}
+}
+
+static void Usage()
+{
+	printf("Usage: imogen-bake [library.dat] [--material name]... [--slice index/count] [--save]\n");
+	printf("  --material name     only bake materials with this name (can be repeated)\n");
+	printf("  --slice index/count only bake materials where (materialIndex %% count) == index\n");
+	printf("  --save              write baked thumbnails back to the library\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* libraryFilename = "library.dat";
+	std::vector<std::string> materialNames;
+	int sliceIndex = 0;
+	int sliceCount = 1;
+	bool saveLibrary = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--material") && (i + 1) < argc)
+		{
+			materialNames.push_back(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--slice") && (i + 1) < argc)
+		{
+			if (sscanf(argv[++i], "%d/%d", &sliceIndex, &sliceCount) != 2 || sliceCount < 1 || sliceIndex < 0 || sliceIndex >= sliceCount)
+			{
+				Usage();
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "--save"))
+		{
+			saveLibrary = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			Usage();
+			return 1;
+		}
+		else
+		{
+			libraryFilename = argv[i];
+		}
+	}
+
+	g_TS.Initialize();
+	LoadMetaNodes();
+	FFMPEGCodec::RegisterAll();
+	FFMPEGCodec::Log = Log;
+
+	stbi_set_flip_vertically_on_load(1);
+	stbi_flip_vertically_on_write(1);
+
+	SDL_Window* window = NULL;
+	SDL_GLContext gl_context = NULL;
+	bool surfaceless = false;
+#ifdef IMOGEN_EGL
+	surfaceless = CreateSurfacelessContext();
+#endif
+	if (SDL_Init(surfaceless ? 0 : SDL_INIT_VIDEO) != 0)
+	{
+		printf("Error: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	if (!surfaceless)
+	{
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+
+		// never shown and never swapped: only there to own the GL context
+		window = SDL_CreateWindow("imogen-bake", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 16, 16, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		if (!window)
+		{
+			printf("Error: %s\n", SDL_GetError());
+			return -1;
+		}
+		gl_context = SDL_GL_CreateContext(window);
+	}
+	if ((!surfaceless && !gl_context) || gl3wInit() != 0)
+	{
+		fprintf(stderr, "Failed to initialize OpenGL context!\n");
+		return 1;
+	}
+
+	// Log() mirrors messages into the ImGui log buffer
+	ImGui::CreateContext();
+
+	gFSQuad.Init();
+	gCPUCount = SDL_GetCPUCount();
+
+	LoadLib(&library, libraryFilename);
+	imogen.DiscoverNodes("glsl", "GLSL/", EVALUATOR_GLSL, imogen.mEvaluatorFiles);
+	imogen.DiscoverNodes("c", "C/", EVALUATOR_C, imogen.mEvaluatorFiles);
+
+	gEvaluation.Init();
+	gEvaluators.SetEvaluators(imogen.mEvaluatorFiles);
+
+	TileNodeEditGraphDelegate nodeGraphDelegate(gEvaluation);
+
+	int bakedCount = 0;
+	for (size_t i = 0; i < library.mMaterials.size(); i++)
+	{
+		if ((int(i) % sliceCount) != sliceIndex)
+			continue;
+		Material& material = library.mMaterials[i];
+		if (!materialNames.empty() && std::find(materialNames.begin(), materialNames.end(), material.mName) == materialNames.end())
+			continue;
+
+		printf("Baking %s\n", material.mName.c_str());
+		unsigned int startTime = SDL_GetTicks();
+
+		imogen.SetCurrentMaterialIndex(int(i));
+		LoadMaterial(&library, material);
+		BuildMaterialGraph(material, nodeGraphDelegate, gEvaluation);
+		UploadSavedImages(material, nodeGraphDelegate);
+		nodeGraphDelegate.DoForce();
+		bakedCount++;
+
+		printf("  done in %d ms\n", int(SDL_GetTicks() - startTime));
+	}
+	imogen.SetCurrentMaterialIndex(-1);
+
+	if (saveLibrary)
+		SaveLib(&library, libraryFilename);
+
+	printf("%d material(s) baked.\n", bakedCount);
+	const RenderTargetPool::Statistics& rtStats = gRenderTargetPool.GetStatistics();
+	printf("Render targets peak: %d (%.1f MB), %d allocations, %d reuses\n", int(rtStats.mPeakCount), float(rtStats.mPeakBytes) / (1024.f * 1024.f), int(rtStats.mAllocationCount), int(rtStats.mReuseCount));
+
+	nodeGraphDelegate.Clear();
+	gEvaluation.Clear();
+	gEvaluation.Finish();
+
+	ImGui::DestroyContext();
+#ifdef IMOGEN_EGL
+	if (surfaceless)
+		DestroySurfacelessContext();
+#endif
+	if (gl_context)
+		SDL_GL_DeleteContext(gl_context);
+	if (window)
+		SDL_DestroyWindow(window);
+	SDL_Quit();
+
+	g_TS.WaitforAllAndShutdown();
+	return 0;
+}
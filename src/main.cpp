@@ -236,8 +236,10 @@ int main(int, char**)
 		InitCallbackRects();
 
 
+		gEvaluation.UpdateReadAheads();
 		gCurrentContext->RunDirty();
 		imogen.Show(library, nodeGraphDelegate, gEvaluation);
+		imogen.AutoSave(library, nodeGraphDelegate);
 
 		
 
@@ -261,7 +263,11 @@ int main(int, char**)
 	}
 
 	imogen.ValidateCurrentMaterial(library, nodeGraphDelegate);
-	SaveLib(&library, libraryFilename);
+	imogen.CompletePendingSaves();
+	nodeGraphDelegate.mEditingContext.ProcessDiskCacheWrites(true);
+	EndLibrarySave(&library, true);
+	BeginLibrarySave(&library);
+	EndLibrarySave(&library, true);
 	gEvaluation.Finish();
 
 	// Cleanup